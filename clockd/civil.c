@@ -0,0 +1,88 @@
+#include "civil.h"
+
+/*
+ * Proleptic Gregorian calendar arithmetic without mktime()/TZ.
+ * Days are counted from 1970-01-01, months are 1..12. Days and years
+ * are long long: long is 32 bits on ARM, time_t may not be.
+ */
+
+static const int month_days[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+static const int month_yday[12] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+
+long long
+civil_floor_div(long long a, long long b)
+{
+  long long q = a / b;
+
+  if ((a % b) && ((a < 0) != (b < 0)))
+    q--;
+
+  return q;
+}
+
+long long
+civil_days_from_date(long long year, int mon, int mday)
+{
+  long long era;
+  long long yoe;
+  long long doy;
+  long long doe;
+
+  year -= mon <= 2;
+  era = civil_floor_div(year, 400);
+  yoe = year - era * 400;
+  doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + mday - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+  return era * 146097 + doe - 719468;
+}
+
+void
+civil_date_from_days(long long days, long long *year, int *mon, int *mday)
+{
+  long long era;
+  long long doe;
+  long long yoe;
+  long long doy;
+  long long mp;
+
+  days += 719468;
+  era = civil_floor_div(days, 146097);
+  doe = days - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+
+  *mday = doy - (153 * mp + 2) / 5 + 1;
+  *mon = mp < 10 ? mp + 3 : mp - 9;
+  *year = yoe + era * 400 + (*mon <= 2);
+}
+
+int
+civil_is_leap(long long year)
+{
+  return !(year % 4) && ((year % 100) || !(year % 400));
+}
+
+int
+civil_days_in_month(long long year, int mon)
+{
+  if (mon == 2 && civil_is_leap(year))
+    return 29;
+
+  return month_days[mon - 1];
+}
+
+/* 0 is Sunday, like tm_wday */
+int
+civil_weekday(long long days)
+{
+  return days >= -4 ? (days + 4) % 7 : (days + 5) % 7 + 6;
+}
+
+/* 0 based, like tm_yday */
+int
+civil_yday(long long year, int mon, int mday)
+{
+  return month_yday[mon - 1] + mday - 1 + (mon > 2 && civil_is_leap(year));
+}
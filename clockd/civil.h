@@ -0,0 +1,17 @@
+#ifndef CIVIL_H
+#define CIVIL_H
+
+#include <time.h>
+
+#define CIVIL_SECS_PER_DAY (24 * 60 * 60)
+
+long long civil_days_from_date(long long year, int mon, int mday);
+void civil_date_from_days(long long days, long long *year, int *mon,
+                          int *mday);
+int civil_is_leap(long long year);
+int civil_days_in_month(long long year, int mon);
+int civil_weekday(long long days);
+int civil_yday(long long year, int mon, int mday);
+long long civil_floor_div(long long a, long long b);
+
+#endif // CIVIL_H
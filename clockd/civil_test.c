@@ -0,0 +1,89 @@
+#include <string.h>
+#include <time.h>
+
+#include "civil.h"
+#include "test.h"
+
+/* civil date math against gmtime_r() over a wide span of days */
+static void
+test_days(void)
+{
+  long long days;
+
+  for (days = -800000; days <= 800000; days += 7)
+  {
+    time_t t = (time_t)days * CIVIL_SECS_PER_DAY;
+    long long year;
+    struct tm tm;
+    int mon;
+    int mday;
+
+    if (!gmtime_r(&t, &tm))
+      continue;
+
+    civil_date_from_days(days, &year, &mon, &mday);
+    CHECK(year == tm.tm_year + 1900LL);
+    CHECK(mon == tm.tm_mon + 1);
+    CHECK(mday == tm.tm_mday);
+    CHECK(civil_days_from_date(year, mon, mday) == days);
+    CHECK(civil_weekday(days) == tm.tm_wday);
+    CHECK(civil_yday(year, mon, mday) == tm.tm_yday);
+  }
+}
+
+static void
+test_calendar(void)
+{
+  CHECK(civil_days_from_date(1970, 1, 1) == 0);
+  CHECK(civil_days_from_date(2000, 3, 1) == 11017);
+  CHECK(civil_days_from_date(1969, 12, 31) == -1);
+  CHECK(civil_days_from_date(0, 3, 1) == -719468);
+
+  CHECK(civil_is_leap(2000));
+  CHECK(civil_is_leap(2024));
+  CHECK(civil_is_leap(0));
+  CHECK(civil_is_leap(-4));
+  CHECK(!civil_is_leap(1900));
+  CHECK(!civil_is_leap(2100));
+  CHECK(!civil_is_leap(2023));
+
+  CHECK(civil_days_in_month(2024, 2) == 29);
+  CHECK(civil_days_in_month(2023, 2) == 28);
+  CHECK(civil_days_in_month(2023, 12) == 31);
+  CHECK(civil_days_in_month(2023, 4) == 30);
+
+  /* beyond 32 bit years */
+  CHECK(civil_days_from_date(5000000000LL, 1, 1) > 1LL << 40);
+
+  CHECK(civil_weekday(0) == 4);
+  CHECK(civil_weekday(-1) == 3);
+  CHECK(civil_weekday(-4) == 0);
+  CHECK(civil_weekday(-5) == 6);
+  CHECK(civil_weekday(-12) == 6);
+
+  CHECK(civil_yday(2024, 3, 1) == 60);
+  CHECK(civil_yday(2023, 3, 1) == 59);
+  CHECK(civil_yday(2023, 12, 31) == 364);
+}
+
+static void
+test_floor_div(void)
+{
+  CHECK(civil_floor_div(7, 2) == 3);
+  CHECK(civil_floor_div(-7, 2) == -4);
+  CHECK(civil_floor_div(7, -2) == -4);
+  CHECK(civil_floor_div(-7, -2) == 3);
+  CHECK(civil_floor_div(-8, 2) == -4);
+  CHECK(civil_floor_div(0, 5) == 0);
+  CHECK(civil_floor_div(-1, 86400) == -1);
+}
+
+int
+main(void)
+{
+  test_days();
+  test_calendar();
+  test_floor_div();
+
+  return TEST_RESULT;
+}
@@ -2,6 +2,7 @@
 #define CLOCK_DBUS_H
 
 #define CLOCKD_SET_TIME "set_time"
+#define CLOCKD_SET_TIME_EX "set_time_ex"
 #define CLOCKD_GET_TIME "get_time"
 #define CLOCKD_GET_TZ "get_tz"
 #define CLOCKD_SET_TZ "set_tz"
@@ -13,6 +14,7 @@
 #define CLOCKD_HAVE_OPERTIME "have_opertime"
 #define CLOCKD_ACTIVATE_NET_TIME "activate_net_time"
 #define CLOCKD_NET_TIME_CHANGED "net_time_changed"
+#define CLOCKD_APPLY_SETTINGS "apply_settings"
 #define CSD_SERVICE "com.nokia.phone.net"
 #define CSD_PATH "/com/nokia/phone/net"
 #define CSD_INTERFACE "Phone.Net"
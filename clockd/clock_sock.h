@@ -0,0 +1,53 @@
+#ifndef CLOCK_SOCK_H
+#define CLOCK_SOCK_H
+
+#include <stdint.h>
+
+/*
+ * clockd Unix socket protocol. One SOCK_SEQPACKET packet per request and
+ * per response, both with the fixed layout below. Responses carry the
+ * op and seq of the request they answer.
+ */
+
+#define CLOCKD_SOCKET_PATH "/run/clockd.sock"
+#define CLOCK_SOCK_VERSION 1
+#define CLOCK_SOCK_STR_SIZE 256
+
+enum clock_sock_op
+{
+  CLOCK_SOCK_GET_TIME = 1,
+  CLOCK_SOCK_SET_TIME,
+  CLOCK_SOCK_GET_TZ,
+  CLOCK_SOCK_SET_TZ,
+  CLOCK_SOCK_GET_TIMEFMT,
+  CLOCK_SOCK_SET_TIMEFMT,
+  CLOCK_SOCK_GET_DEFAULT_TZ,
+  CLOCK_SOCK_GET_AUTOSYNC,
+  CLOCK_SOCK_SET_AUTOSYNC,
+  CLOCK_SOCK_HAVE_OPERTIME,
+  CLOCK_SOCK_ACTIVATE_NET_TIME,
+  CLOCK_SOCK_NET_TIME_CHANGED
+};
+
+struct clock_sock_req
+{
+  uint16_t version;
+  uint16_t op;
+  uint32_t seq;
+  int64_t value;  /* time or boolean argument */
+  char str[CLOCK_SOCK_STR_SIZE];  /* string argument, NUL terminated */
+};
+
+struct clock_sock_rsp
+{
+  uint16_t version;
+  uint16_t op;
+  uint32_t seq;
+  /* 0 or -errno: -ENOSYS, -EPERM and -EPROTO mean not handled, try D-Bus */
+  int32_t status;
+  int32_t reserved;
+  int64_t value;  /* time or boolean result */
+  char str[CLOCK_SOCK_STR_SIZE];  /* string result, NUL terminated */
+};
+
+#endif // CLOCK_SOCK_H
@@ -0,0 +1,134 @@
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <glib.h>
+
+#include "logging.h"
+#include "conf_watch.h"
+
+/*
+ * Watches the directory of the configuration file, which is replaced by
+ * rename() as often as it is written in place. Events for the file are
+ * collected for CONF_WATCH_DELAY ms, then the callback runs once.
+ */
+
+#define CONF_WATCH_DELAY 100
+
+static int watch_fd = -1;
+static guint watch_id = 0;
+static guint delay_id = 0;
+static char watch_name[NAME_MAX + 1];
+static conf_watch_func watch_func = NULL;
+
+static gboolean
+conf_watch_delay(gpointer user_data)
+{
+  delay_id = 0;
+  watch_func();
+
+  return FALSE;
+}
+
+static gboolean
+conf_watch_io(GIOChannel *channel, GIOCondition cond, gpointer data)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  bool changed = false;
+  ssize_t bytes;
+  char *p;
+
+  if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+  {
+    DO_LOG(LOG_ERR, "configuration watch failed, no live reload");
+    watch_id = 0;
+    return FALSE;
+  }
+
+  while ((bytes = read(watch_fd, buf, sizeof(buf))) > 0)
+  {
+    for (p = buf; p < buf + bytes; p += sizeof(*ev) + ev->len)
+    {
+      ev = (const struct inotify_event *)p;
+
+      if ((ev->mask & IN_Q_OVERFLOW) ||
+          (ev->len && !strcmp(ev->name, watch_name)))
+      {
+        changed = true;
+      }
+    }
+  }
+
+  if (changed && !delay_id)
+    delay_id = g_timeout_add(CONF_WATCH_DELAY, conf_watch_delay, NULL);
+
+  return TRUE;
+}
+
+int
+conf_watch_init(const char *path, conf_watch_func func)
+{
+  char dir[PATH_MAX];
+  GIOChannel *channel;
+  const char *name = strrchr(path, '/');
+
+  if (!name || name == path || strlen(name + 1) >= sizeof(watch_name))
+    return -1;
+
+  snprintf(dir, sizeof(dir), "%.*s", (int)(name - path), path);
+  snprintf(watch_name, sizeof(watch_name), "%s", name + 1);
+
+  watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+  if (watch_fd == -1)
+  {
+    DO_LOG(LOG_ERR, "inotify_init1 failed (%s)", strerror(errno));
+    return -1;
+  }
+
+  if (inotify_add_watch(watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+  {
+    DO_LOG(LOG_ERR, "failed to watch %s (%s)", dir, strerror(errno));
+    close(watch_fd);
+    watch_fd = -1;
+    return -1;
+  }
+
+  watch_func = func;
+  channel = g_io_channel_unix_new(watch_fd);
+  watch_id = g_io_add_watch(channel, G_IO_IN | G_IO_ERR | G_IO_HUP,
+                            conf_watch_io, NULL);
+  g_io_channel_unref(channel);
+
+  DO_LOG(LOG_DEBUG, "watching %s", path);
+
+  return 0;
+}
+
+void
+conf_watch_quit(void)
+{
+  if (delay_id)
+  {
+    g_source_remove(delay_id);
+    delay_id = 0;
+  }
+
+  if (watch_id)
+  {
+    g_source_remove(watch_id);
+    watch_id = 0;
+  }
+
+  if (watch_fd != -1)
+  {
+    close(watch_fd);
+    watch_fd = -1;
+  }
+}
@@ -0,0 +1,10 @@
+#ifndef CONF_WATCH_H
+#define CONF_WATCH_H
+
+/* runs in the main loop after the watched file was written or replaced */
+typedef void (*conf_watch_func)(void);
+
+int conf_watch_init(const char *path, conf_watch_func func);
+void conf_watch_quit(void);
+
+#endif // CONF_WATCH_H
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "logging.h"
+#include "drift.h"
+
+/*
+ * RTC drift model. The RTC is written from the system time while clockd
+ * runs, it only drifts on its own while the device is off: from its last
+ * write to the boot that reads it. At boot the clock is corrected by
+ * 'ppb' over that interval. The first trusted time (network time) after
+ * the boot tells what the RTC really lost, the boot correction plus what
+ * is still off. Those are summed over boots until DRIFT_MIN_SPAN, then
+ * sum / span is a sample averaged into 'ppb'. Network time has a
+ * resolution of one second, hence the long span.
+ */
+
+#define DRIFT_MIN_SPAN (24 * 60 * 60)
+/* beyond that it is not drift: a dead RTC or a bad network time */
+#define DRIFT_MAX_PPB 500000
+/* longer off than that, the RTC is not trusted to have kept running */
+#define DRIFT_MAX_AGE (366 * 24 * 60 * 60)
+#define DRIFT_MIN_CORRECTION 500000000LL
+/* the system clock drifts too, a later trusted time is no RTC sample */
+#define DRIFT_MAX_DELAY (60 * 60)
+
+static int64_t
+drift_monotonic(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec;
+}
+
+/* this boot is not measured: the time was set by other means */
+void
+drift_reset(struct drift *d)
+{
+  d->boot_span = 0;
+}
+
+/*
+ * At boot, 'now' has been read from the RTC last written at
+ * 'rtc_written'. Returns the ns to add to the clock.
+ */
+int64_t
+drift_boot(struct drift *d, time_t rtc_written, time_t now)
+{
+  int64_t span = (int64_t)now - rtc_written;
+  int64_t correction = 0;
+
+  d->boot_span = 0;
+
+  if (!rtc_written || span <= 0 || span > DRIFT_MAX_AGE)
+    return 0;
+
+  if (d->samples)
+    correction = span * d->ppb;
+
+  if (llabs(correction) < DRIFT_MIN_CORRECTION)
+    correction = 0;
+
+  d->boot_span = span;
+  d->boot_correction = correction;
+  d->boot_mono = drift_monotonic();
+
+  return correction;
+}
+
+/* the clock, at 'system', has been found to be 'trusted' */
+void
+drift_sample(struct drift *d, time_t trusted, time_t system)
+{
+  int64_t ppb;
+
+  if (!d->boot_span)
+    return;
+
+  if (drift_monotonic() - d->boot_mono > DRIFT_MAX_DELAY)
+  {
+    d->boot_span = 0;
+    return;
+  }
+
+  d->sum += d->boot_correction + (int64_t)(trusted - system) * 1000000000;
+  d->span += d->boot_span;
+  d->boot_span = 0;
+
+  if (d->span < DRIFT_MIN_SPAN)
+    return;
+
+  ppb = d->sum / d->span;
+
+  if (llabs(ppb) > DRIFT_MAX_PPB)
+    DO_LOG(LOG_WARNING, "RTC drift %lld ppb over %lld s ignored",
+           (long long)ppb, (long long)d->span);
+  else
+  {
+    d->ppb = d->samples ? (3 * (int64_t)d->ppb + ppb) / 4 : ppb;
+    d->samples++;
+    DO_LOG(LOG_INFO, "RTC drift %lld ppb over %lld s, estimate %d ppb",
+           (long long)ppb, (long long)d->span, (int)d->ppb);
+  }
+
+  d->span = 0;
+  d->sum = 0;
+}
@@ -0,0 +1,24 @@
+#ifndef DRIFT_H
+#define DRIFT_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* how fast the RTC, running alone while the device is off, falls behind */
+struct drift
+{
+  int64_t span;            /* s the RTC ran alone, summed over boots */
+  int64_t sum;             /* ns it lost over 'span' */
+  int32_t ppb;             /* estimate, ns lost per s */
+  int32_t samples;         /* estimates 'ppb' is made of */
+  /* this boot, not kept */
+  int64_t boot_span;       /* s the RTC ran alone before it, 0 if none */
+  int64_t boot_correction; /* ns the clock was corrected by at boot */
+  int64_t boot_mono;       /* CLOCK_MONOTONIC s of the boot */
+};
+
+int64_t drift_boot(struct drift *d, time_t rtc_written, time_t now);
+void drift_sample(struct drift *d, time_t trusted, time_t system);
+void drift_reset(struct drift *d);
+
+#endif // DRIFT_H
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "logging.h"
+#include "drift.h"
+#include "test.h"
+
+bool clockd_debug_mode = false;
+
+#define DAY (24 * 60 * 60)
+
+/* the RTC, written at 'written', 'ppb' slow, is read after 'off' s */
+static time_t
+rtc_read(time_t written, int64_t off, int64_t ppb)
+{
+  return written + (off * 1000000000 - off * ppb) / 1000000000;
+}
+
+/*
+ * One boot after 'off' s with an RTC 'ppb' slow, network time right
+ * after it. Returns the correction made at boot.
+ */
+static int64_t
+boot(struct drift *d, time_t *real, int64_t off, int64_t ppb)
+{
+  time_t written = *real;
+  time_t now;
+  int64_t correction;
+
+  *real += off;
+  now = rtc_read(written, off, ppb);
+  correction = drift_boot(d, written, now);
+  drift_sample(d, *real, now + correction / 1000000000);
+
+  return correction;
+}
+
+static void
+test_estimate(void)
+{
+  struct drift d;
+  time_t real = 1700000000;
+  int64_t correction = 0;
+  int i;
+
+  memset(&d, 0, sizeof(d));
+
+  for (i = 0; i < 20; i++)
+    correction = boot(&d, &real, 10 * DAY, 20000);
+
+  CHECK(d.samples == 20);
+  CHECK(llabs(d.ppb - 20000) < 2000);
+
+  /* the RTC lost about 17 s, most of it is corrected at boot */
+  CHECK(correction > 15000000000LL && correction < 20000000000LL);
+
+  /* faster RTC, the estimate follows */
+  for (i = 0; i < 20; i++)
+    boot(&d, &real, 10 * DAY, -5000);
+
+  CHECK(llabs(d.ppb + 5000) < 2000);
+}
+
+static void
+test_min_span(void)
+{
+  struct drift d;
+  time_t real = 1700000000;
+  int i;
+
+  memset(&d, 0, sizeof(d));
+
+  /* short boots are summed until they span a day, as the RTC counts */
+  for (i = 0; i < 23; i++)
+    boot(&d, &real, 3600, 0);
+
+  CHECK(d.samples == 0 && d.span == 23 * 3600);
+
+  boot(&d, &real, 3600, 0);
+  CHECK(d.samples == 1 && d.span == 0 && d.sum == 0 && d.ppb == 0);
+
+  /* below DRIFT_MIN_CORRECTION the clock is left as is */
+  CHECK(drift_boot(&d, real, real + 10) == 0);
+}
+
+static void
+test_rejected(void)
+{
+  struct drift d;
+  time_t real = 1700000000;
+
+  memset(&d, 0, sizeof(d));
+  d.ppb = 20000;
+  d.samples = 1;
+
+  /* never written, written in the future, off too long */
+  CHECK(drift_boot(&d, 0, real) == 0 && !d.boot_span);
+  CHECK(drift_boot(&d, real + 10, real) == 0 && !d.boot_span);
+  CHECK(drift_boot(&d, real - 2 * 366 * DAY, real) == 0 && !d.boot_span);
+  drift_sample(&d, real + 100, real);
+  CHECK(d.span == 0 && d.sum == 0);
+
+  /* the time was set by other means */
+  CHECK(drift_boot(&d, real - 10 * DAY, real) != 0 && d.boot_span);
+  drift_reset(&d);
+  drift_sample(&d, real + 100, real);
+  CHECK(d.span == 0 && d.sum == 0 && d.samples == 1);
+
+  /* network time came too late, the system clock drifted meanwhile */
+  drift_boot(&d, real - 10 * DAY, real);
+  d.boot_mono -= 2 * 3600;
+  drift_sample(&d, real + 100, real);
+  CHECK(d.span == 0 && d.sum == 0 && !d.boot_span);
+
+  /* an hour lost in two days is no drift */
+  memset(&d, 0, sizeof(d));
+  boot(&d, &real, 2 * DAY, 3600000000000LL / (2 * DAY));
+  CHECK(d.samples == 0 && d.ppb == 0 && d.span == 0);
+}
+
+int
+main(void)
+{
+  test_estimate();
+  test_min_span();
+  test_rejected();
+
+  return TEST_RESULT;
+}
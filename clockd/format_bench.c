@@ -0,0 +1,99 @@
+/*
+ * Throughput of time_format_batch() against localtime_r() and strftime()
+ * for the same ticks, in records per second. libtime.c is built in so
+ * that no clockd is needed: the zone is the one of TZ.
+ *
+ *   format_bench [count] [step seconds] [format]
+ */
+
+#include "libtime.c"
+
+#define BENCH_STRIDE 64
+
+static double
+bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  long step = argc > 2 ? strtol(argv[2], NULL, 10) : 1;
+  const char *fmt = argc > 3 ? argv[3] : "%Y-%m-%d %H:%M:%S";
+  const char *tz = getenv("TZ");
+  time_t *ticks;
+  char *expected;
+  char *buf;
+  double strftime_s;
+  double batch_s;
+  double t;
+  size_t diffs = 0;
+  size_t i;
+  int rv;
+
+  ticks = malloc(n * sizeof(*ticks));
+  expected = malloc(n * BENCH_STRIDE);
+  buf = malloc(n * BENCH_STRIDE);
+
+  if (!n || !ticks || !expected || !buf)
+  {
+    fprintf(stderr, "usage: %s [count] [step seconds] [format]\n", argv[0]);
+    return 2;
+  }
+
+  /* what libtime would have got from clockd */
+  snprintf(s_tz, sizeof(s_tz), "%s", tz ? tz : "");
+  s_inited = true;
+  tzset();
+
+  for (i = 0; i < n; i++)
+    ticks[i] = 1700000000 + (time_t)i * step;
+
+  t = bench_now();
+
+  for (i = 0; i < n; i++)
+  {
+    struct tm tm;
+
+    localtime_r(&ticks[i], &tm);
+    strftime(&expected[i * BENCH_STRIDE], BENCH_STRIDE, fmt, &tm);
+  }
+
+  strftime_s = bench_now() - t;
+
+  t = bench_now();
+  rv = time_format_batch(fmt, ticks, n, buf, BENCH_STRIDE);
+  batch_s = bench_now() - t;
+
+  if (rv < 0)
+  {
+    fprintf(stderr, "time_format_batch() failed\n");
+    return 1;
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    if (strcmp(&expected[i * BENCH_STRIDE], &buf[i * BENCH_STRIDE]))
+      diffs++;
+  }
+
+  printf("format \"%s\", %zu ticks %ld s apart, TZ=%s\n", fmt, n, step,
+         tz ? tz : "");
+  printf("localtime_r+strftime %12.0f records/s\n", n / strftime_s);
+  printf("time_format_batch    %12.0f records/s\n", n / batch_s);
+
+  if (diffs)
+    printf("%zu records differ\n", diffs);
+
+  free(ticks);
+  free(expected);
+  free(buf);
+
+  return diffs ? 1 : 0;
+}
@@ -5,89 +5,532 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
 
 #include "logging.h"
 #include "internal_time_utils.h"
+#include "rclockd.h"
+#include "zone.h"
+
+#ifdef CLOCKD_INPROCESS_PRIVILEGED
+#include <sys/prctl.h>
+#include <grp.h>
+#include <linux/capability.h>
+
+#include "privops.h"
+#endif
 
 /* 1st of January, 1st of July and 31st of December */
 static int days[3] = {1, 1, 31};
 static int months[3] = {0, 6, 11};
 
+/*
+ * clockd's local zone. Conversions use the zone engine, TZ is set once
+ * by internal_tz_init() and never changed: the worker and reader threads
+ * read the environment, in syslog() for one. Main thread only.
+ */
+#define INTERNAL_TZ_SIZE 256
+#define INTERNAL_ABBRS 128
+
+static char local_tz[INTERNAL_TZ_SIZE] = "";
+static char abbrs[INTERNAL_ABBRS][ZONE_ABBR_SIZE];
+
 int
 internal_set_tz(const char *tz)
 {
-  int rv;
-  char buf[512];
+  return internal_set_time_tz(NULL, tz);
+}
+
+/* before any thread is created */
+void
+internal_tz_init(void)
+{
+  setenv("TZ", ":/etc/localtime", 1);
+  tzset();
+}
+
+/* clockd zone names as TZ values, NULL is UTC */
+static void
+internal_tz_name(const char *tz, char *buf, size_t size)
+{
+  if (!tz)
+    snprintf(buf, size, "UTC");
+  else if (tz[0] != ':' && !isalpha(tz[0]))
+    snprintf(buf, size, ":%s", tz + 1);
+  else
+    snprintf(buf, size, "%s", tz);
+}
 
-  snprintf(buf, sizeof(buf), "/usr/bin/rclockd clockd %s", tz);
+/* 'tz' NULL for the local zone, UTC if it cannot be loaded */
+static const struct zone *
+internal_zone(const char *tz)
+{
+  char buf[INTERNAL_TZ_SIZE];
+  const struct zone *zone;
 
-  rv = system(buf);
+  if (tz)
+    internal_tz_name(tz, buf, sizeof(buf));
+  else
+    snprintf(buf, sizeof(buf), "%s", local_tz);
 
-  if (rv)
+  zone = zone_cache_get(buf);
+
+  if (!zone)
   {
-    DO_LOG(LOG_ERR, "set_tz(), system(%s) failed (st=%d/%s)", buf, rv,
-           rv == -1 ? strerror(errno) : "");
+    DO_LOG(LOG_WARNING, "zone '%s' not loaded, using UTC", buf);
+    zone = zone_cache_get("UTC0");
   }
 
-  return rv;
+  return zone;
 }
 
-void
-internal_tz_set(char **old, const char *tz)
+/* tm_zone must outlive the zone cache entry */
+static const char *
+internal_abbr(const char *abbr)
 {
-  char *tzname = getenv("TZ");
+  int i;
 
-  free(*old);
+  for (i = 0; i < INTERNAL_ABBRS && abbrs[i][0]; i++)
+  {
+    if (!strcmp(abbrs[i], abbr))
+      return abbrs[i];
+  }
 
-  if (tzname)
-    tzname = strdup(tzname);
+  if (i == INTERNAL_ABBRS)
+    return "";
 
-  *old = tzname;
+  snprintf(abbrs[i], sizeof(abbrs[i]), "%s", abbr);
 
-  internal_setenv_tz(tz);
+  return abbrs[i];
 }
 
-void
-internal_tz_res(char **old)
+/* localtime_r() in 'tz', NULL for the local zone */
+struct tm *
+internal_localtime_in(time_t tick, struct tm *result, const char *tz)
 {
-  if (*old)
-    internal_setenv_tz(*old);
-  else
-  {
-    unsetenv("TZ");
-    tzset();
-  }
+  const struct zone *zone = internal_zone(tz);
+  const char *abbr;
+  time_t local;
+  long gmtoff;
+  int isdst;
+
+  if (!zone)
+    return NULL;
+
+  zone_lookup_abbr(zone, tick, &gmtoff, &isdst, &abbr);
+  local = tick + gmtoff;
+
+  if (!gmtime_r(&local, result))
+    return NULL;
+
+  result->tm_isdst = isdst;
+  result->tm_gmtoff = gmtoff;
+  result->tm_zone = internal_abbr(abbr);
 
-  free(*old);
-  *old = NULL;
+  return result;
 }
 
 int
 internal_set_time(time_t t)
 {
+  struct timespec ts = {t, 0};
+
+  return internal_set_time_tz(&ts, NULL);
+}
+
+/* rclockd co-process, worker thread only */
+static int rclockd_fd = -1;
+static pid_t rclockd_pid = -1;
+static uint32_t rclockd_seq = 0;
+static time_t rclockd_retry = 0;
+
+/* seconds */
+#define RCLOCKD_TIMEOUT 10
+#define RCLOCKD_RETRY 30
+
+static void
+rclockd_close(void)
+{
+  if (rclockd_fd != -1)
+  {
+    close(rclockd_fd);
+    rclockd_fd = -1;
+  }
+
+  if (rclockd_pid != -1)
+  {
+    /* it exits when its stdin is closed */
+    if (waitpid(rclockd_pid, NULL, WNOHANG) == 0)
+    {
+      kill(rclockd_pid, SIGTERM);
+      waitpid(rclockd_pid, NULL, 0);
+    }
+
+    rclockd_pid = -1;
+  }
+}
+
+static int
+rclockd_spawn(void)
+{
+  struct timeval tv = {RCLOCKD_TIMEOUT, 0};
+  time_t now = time(NULL);
+  int sv[2];
+  pid_t pid;
+
+  if (rclockd_retry && now < rclockd_retry)
+    return -1;
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv))
+  {
+    DO_LOG(LOG_ERR, "rclockd socketpair() failed (%s)", strerror(errno));
+    rclockd_retry = now + RCLOCKD_RETRY;
+    return -1;
+  }
+
+  pid = fork();
+
+  if (!pid)
+  {
+    if (dup2(sv[1], STDIN_FILENO) != -1)
+      execl(RCLOCKD_PATH, RCLOCKD_PATH, "clockd", "--serve", (char *)NULL);
+
+    _exit(127);
+  }
+
+  close(sv[1]);
+
+  if (pid == -1)
+  {
+    DO_LOG(LOG_ERR, "rclockd fork() failed (%s)", strerror(errno));
+    close(sv[0]);
+    rclockd_retry = now + RCLOCKD_RETRY;
+    return -1;
+  }
+
+  setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  rclockd_fd = sv[0];
+  rclockd_pid = pid;
+  rclockd_retry = 0;
+
+  return 0;
+}
+
+static int
+rclockd_exchange(int op, const struct timespec *ts, const char *tz,
+                 int *tz_status)
+{
+  struct rclockd_req req;
+  struct rclockd_rsp rsp;
+  ssize_t len;
+
+  memset(&req, 0, sizeof(req));
+  req.version = RCLOCKD_VERSION;
+  req.op = op;
+  req.seq = ++rclockd_seq;
+
+  if (ts)
+  {
+    req.sec = ts->tv_sec;
+    req.nsec = ts->tv_nsec;
+  }
+
+  if (tz)
+    snprintf(req.tz, sizeof(req.tz), "%s", tz);
+
+  if (send(rclockd_fd, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req))
+    return -1;
+
+  do
+    len = recv(rclockd_fd, &rsp, sizeof(rsp), 0);
+  while (len == -1 && errno == EINTR);
+
+  if (len != sizeof(rsp) || rsp.version != RCLOCKD_VERSION ||
+      rsp.seq != req.seq)
+  {
+    return -1;
+  }
+
+  if (tz_status)
+    *tz_status = rsp.tz_status;
+
+  return rsp.status;
+}
+
+/*
+ * Runs one operation in the rclockd co-process, spawned when needed.
+ * Returns 0, the errno of the failed operation or -1 if rclockd could
+ * not be reached.
+ */
+static int
+rclockd_call(int op, const struct timespec *ts, const char *tz,
+             int *tz_status)
+{
+  int retries = 1;
   int st;
+
+  do
+  {
+    if (rclockd_fd == -1 && rclockd_spawn())
+      return -1;
+
+    st = rclockd_exchange(op, ts, tz, tz_status);
+
+    if (st >= 0)
+      return st;
+
+    /* died or an old rclockd without --serve, start over */
+    rclockd_close();
+  }
+  while (retries--);
+
+  rclockd_retry = time(NULL) + RCLOCKD_RETRY;
+
+  return -1;
+}
+
+void
+internal_rclockd_quit(void)
+{
+  rclockd_close();
+}
+
+#ifdef CLOCKD_INPROCESS_PRIVILEGED
+/* clockd does the privileged operations itself */
+static bool in_process = false;
+
+/*
+ * Switches to 'uid' and 'gid' keeping only CAP_SYS_TIME and, not
+ * effective but for privops.c to raise, CAP_DAC_OVERRIDE. The bounding
+ * set goes too, nothing started by clockd gets anything back.
+ * Capabilities are per thread, call before any thread is created.
+ */
+int
+internal_privileged_init(uid_t uid, gid_t gid)
+{
+  int cap;
+
+  if (geteuid())
+  {
+    DO_LOG(LOG_WARNING, "not root, using rclockd");
+    return -1;
+  }
+
+  if (!uid || uid == (uid_t)-1 || gid == (gid_t)-1)
+  {
+    DO_LOG(LOG_WARNING, "no user to run as, using rclockd");
+    return -1;
+  }
+
+  for (cap = 0; prctl(PR_CAPBSET_READ, cap, 0, 0, 0) >= 0; cap++)
+  {
+    if (cap != CAP_SYS_TIME && cap != CAP_DAC_OVERRIDE &&
+        prctl(PR_CAPBSET_DROP, cap, 0, 0, 0))
+    {
+      DO_LOG(LOG_ERR, "PR_CAPBSET_DROP(%d) failed (%s)", cap,
+             strerror(errno));
+      return -1;
+    }
+  }
+
+  if (prctl(PR_SET_KEEPCAPS, 1, 0, 0, 0) || setgroups(0, NULL) ||
+      setresgid(gid, gid, gid) || setresuid(uid, uid, uid))
+  {
+    DO_LOG(LOG_ERR, "switching to uid %d failed (%s), using rclockd",
+           (int)uid, strerror(errno));
+    return -1;
+  }
+
+  prctl(PR_SET_KEEPCAPS, 0, 0, 0, 0);
+
+  if (privops_caps(false))
+  {
+    DO_LOG(LOG_ERR, "no capabilities left, time and zone cannot be set");
+    return -1;
+  }
+
+  DO_LOG(LOG_INFO, "setting time and zone in-process as uid %d", (int)uid);
+  in_process = true;
+
+  return 0;
+}
+#endif
+
+static int
+priv_call(int op, const struct timespec *ts, const char *tz, int *tz_status)
+{
+#ifdef CLOCKD_INPROCESS_PRIVILEGED
+  if (in_process)
+    return privops_run(op, ts, tz, tz_status);
+#endif
+
+  return rclockd_call(op, ts, tz, tz_status);
+}
+
+/* one rclockd run per change, if there is no co-process */
+static int
+internal_set_time_tz_exec(const struct timespec *ts, const char *tz)
+{
+  int all = (ts ? INTERNAL_SET_TIME_FAILED : 0) |
+      (tz ? INTERNAL_SET_TZ_FAILED : 0);
   char buf[512];
+  int len;
+  int st;
+
+  len = snprintf(buf, sizeof(buf), RCLOCKD_PATH " clockd");
+
+  if (tz)
+    len += snprintf(&buf[len], sizeof(buf) - len, " %s", tz);
+
+  if (ts && len < (int)sizeof(buf))
+  {
+    len += snprintf(&buf[len], sizeof(buf) - len, " %lu",
+                    (unsigned long)ts->tv_sec + (ts->tv_nsec >= 500000000));
+  }
+
+  if (len >= (int)sizeof(buf))
+  {
+    DO_LOG(LOG_ERR, "internal_set_time_tz(), arguments too long");
+    return all;
+  }
 
-  snprintf(buf, 512u, "/usr/bin/rclockd clockd %lu", t);
   st = system(buf);
 
+  if (st == -1 || !WIFEXITED(st) || (WEXITSTATUS(st) & ~all))
+  {
+    DO_LOG(LOG_ERR, "internal_set_time_tz(), system(%s) failed (st=%d/%s)",
+           buf, st, st == -1 ? strerror(errno) : "");
+    return all;
+  }
+
+  st = WEXITSTATUS(st);
+
   if (st)
   {
-    DO_LOG(LOG_ERR, "internal_set_time(), system(%s) failed (st=%d/%s)", buf,
-           st, st == -1 ? strerror(errno) : "");
+    DO_LOG(LOG_ERR, "internal_set_time_tz(), system(%s) failed (st=%d)", buf,
+           st);
   }
+
+  return st;
+}
+
+/*
+ * Sets the RTC to the system time when it reaches 'at', or now if 'at' is
+ * NULL. Returns 0 or an errno.
+ */
+int
+internal_set_rtc(const struct timespec *at)
+{
+  struct timespec now = {0, 0};
+  int st = priv_call(RCLOCKD_SET_RTC, at ? at : &now, NULL, NULL);
+
+  return st < 0 ? EPIPE : st;
+}
+
+/*
+ * Slews the system time by 'delta', tv_nsec is always positive. Returns 0
+ * or an errno, EPIPE if there is no way to do it.
+ */
+int
+internal_adj_time(const struct timespec *delta)
+{
+  int st = priv_call(RCLOCKD_ADJ_TIME, delta, NULL, NULL);
+
+  return st < 0 ? EPIPE : st;
+}
+
+static int64_t
+internal_monotonic_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * 'ts' plus the time since CLOCK_MONOTONIC was 'stamp': an unreachable
+ * rclockd takes up to twice RCLOCKD_TIMEOUT before the exec fallback
+ */
+static struct timespec *
+internal_ts_since(const struct timespec *ts, int64_t stamp,
+                  struct timespec *result)
+{
+  int64_t ns;
+
+  if (!ts)
+    return NULL;
+
+  ns = (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec +
+      (internal_monotonic_ns() - stamp);
+  result->tv_sec = ns / 1000000000;
+  result->tv_nsec = ns % 1000000000;
+
+  return result;
+}
+
+/*
+ * Sets the zone ('tz' not NULL) and the time ('ts' not NULL) through
+ * rclockd or in-process, both in one request, the RTC is left to
+ * rtc_sync. Returns INTERNAL_SET_*_FAILED bits, 0 if all went fine.
+ */
+int
+internal_set_time_tz(const struct timespec *ts, const char *tz)
+{
+  int64_t stamp = internal_monotonic_ns();
+  struct timespec now_ts;
+  int tz_st = 0;
+  int rv = 0;
+  int st;
+
+  if (ts && tz)
+    st = priv_call(RCLOCKD_SET_TIME_TZ, ts, tz, &tz_st);
+  else if (tz)
+    st = tz_st = priv_call(RCLOCKD_SET_TZ, NULL, tz, NULL);
   else
+    st = priv_call(RCLOCKD_SET_TIME, ts, NULL, NULL);
+
+  if (st < 0)
+  {
+    return internal_set_time_tz_exec(internal_ts_since(ts, stamp, &now_ts),
+                                     tz);
+  }
+
+  if (tz_st)
   {
-    time_t now = time(0);
+    DO_LOG(LOG_ERR, "internal_set_time_tz(), zone %s failed (%s)", tz,
+           strerror(tz_st));
+    rv |= INTERNAL_SET_TZ_FAILED;
+  }
 
-    if (abs(now - t) > 2)
+  if (ts)
+  {
+    if (st)
+    {
+      DO_LOG(LOG_ERR, "internal_set_time_tz(), time %lld failed (%s)",
+             (long long)ts->tv_sec, strerror(st));
+      rv |= INTERNAL_SET_TIME_FAILED;
+    }
+    else
     {
-      DO_LOG(LOG_ERR,
-             "internal_set_time(), difference with intended and actual time is %ld seconds!",
-             (long)t - now);
+      time_t now = time(0);
+
+      if (labs(now - ts->tv_sec) > 2)
+      {
+        DO_LOG(LOG_ERR,
+               "internal_set_time_tz(), difference with intended and actual time is %ld seconds!",
+               (long)ts->tv_sec - now);
+      }
     }
   }
-  return st;
+
+  return rv;
 }
 
 int
@@ -115,58 +558,61 @@ internal_check_timezone(const char *zone)
   return -1;
 }
 
+/* the zone of internal_localtime_in(), internal_get_dst() and friends */
 int
-internal_setenv_tz(const char *tzname)
+internal_set_local_tz(const char *tzname)
 {
-  int rv;
-  char buf[256] = {0, };
+  char buf[INTERNAL_TZ_SIZE];
 
-  memcpy(buf, "UTC", 4);
+  internal_tz_name(tzname, buf, sizeof(buf));
 
-  if (tzname)
+  if (!zone_cache_get(buf))
   {
-    if (tzname[0] != ':' && !isalpha(tzname[0]))
-      snprintf(buf, sizeof(buf), ":%s", tzname + 1);
+    DO_LOG(LOG_ERR, "zone '%s' not loaded", buf);
+    return -1;
   }
 
-  tzname = buf;
-
-  rv = setenv("TZ", tzname, 1);
-  if ( !rv )
-    tzset();
+  snprintf(local_tz, sizeof(local_tz), "%s", buf);
 
-  return rv;
+  return 0;
 }
 
+/* mktime() in 'tz', NULL for UTC. tm_isdst picks the time in a fold */
 time_t
 internal_mktime_in(struct tm *tm, const char *tz)
 {
-  time_t tick;
-  char *old_tz = NULL;
+  const struct zone *zone;
+  long long t;
+  int isdst = tm->tm_isdst;
+  time_t local = timegm(tm);
 
-  internal_tz_set(&old_tz, tz);
-  tick = mktime(tm);
-  internal_tz_res(&old_tz);
+  if (!tz || local == -1)
+    return local;
 
-  return tick;
+  zone = internal_zone(tz);
+
+  if (!zone || zone_local_to_utc(zone, local, isdst == 0 ?
+                                 ZONE_FOLD_LATER : ZONE_FOLD_EARLIER, &t) ||
+      (time_t)t != t)
+  {
+    return -1;
+  }
+
+  if (!internal_localtime_in(t, tm, tz))
+    return -1;
+
+  return t;
 }
 
 struct tm *
 internal_localtime_r_in(struct tm *utc_tm, struct tm *result, const char *tz)
 {
-  time_t tick  = internal_mktime_in(utc_tm, 0);
-  char *old_tz = NULL;
+  time_t tick = internal_mktime_in(utc_tm, NULL);
 
   if (tick == -1)
     return NULL;
-  else
-  {
-    internal_tz_set(&old_tz, tz);
-    localtime_r(&tick, result);
-    internal_tz_res(&old_tz);
-  }
 
-  return result;
+  return internal_localtime_in(tick, result, tz);
 }
 
 int
@@ -218,7 +664,7 @@ internal_get_dst(time_t tick)
   if (!tick)
     tick = internal_get_time();
 
-  localtime_r(&tick, &tm);
+  internal_localtime_in(tick, &tm, NULL);
 
   return tm.tm_isdst > 0;
 }
@@ -229,16 +675,19 @@ internal_get_time (void)
   return time(0);
 }
 
+/* secs west of GMT, without 'dst' the standard time offset */
 int
 internal_get_utc_offset(time_t timer, int dst)
 {
-  int rv = timezone;
+  struct tm tm;
+  int rv;
 
-  if (dst)
-  {
-    if (internal_get_dst(timer))
-      rv -= 3600;
-  }
+  memset(&tm, 0, sizeof(tm));
+  internal_localtime_in(timer, &tm, NULL);
+  rv = -tm.tm_gmtoff;
+
+  if (!dst && tm.tm_isdst > 0)
+    rv += 3600;
 
   return rv;
 }
@@ -1,18 +1,33 @@
 #ifndef INTERNAL_TIME_UTILS_H
 #define INTERNAL_TIME_UTILS_H
 
+#include <sys/types.h>
+#include <time.h>
+
+/* internal_set_time_tz() result, also rclockd exit status */
+#define INTERNAL_SET_TIME_FAILED 0x01
+#define INTERNAL_SET_TZ_FAILED   0x02
+
 time_t internal_get_time (void);
 int internal_set_time(time_t t);
 int internal_get_dst(time_t tick);
 int internal_get_utc_offset (time_t tick, int dst);
 int internal_set_tz(const char *tz);
-void internal_tz_set(char **old, const char *tz);
-void internal_tz_res(char **old);
+void internal_tz_init(void);
+int internal_set_time_tz(const struct timespec *ts, const char *tz);
+int internal_set_rtc(const struct timespec *at);
+int internal_adj_time(const struct timespec *delta);
+void internal_rclockd_quit(void);
+#ifdef CLOCKD_INPROCESS_PRIVILEGED
+int internal_privileged_init(uid_t uid, gid_t gid);
+#endif
 time_t internal_mktime_in(struct tm *tm, const char *tz);
+struct tm *internal_localtime_in(time_t tick, struct tm *result,
+                                 const char *tz);
 struct tm *internal_localtime_r_in(struct tm *utc_tm,
                                    struct tm *result,
                                    const char *tz);
-int internal_setenv_tz(const char *tzname);
+int internal_set_local_tz(const char *tzname);
 int internal_tz_cmp(const char *firstTZName, const char *secondTZName);
 int internal_check_timezone(const char *zone);
 
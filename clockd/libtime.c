@@ -1,4 +1,6 @@
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,10 +9,15 @@
 #include <stdbool.h>
 #include <time.h>
 #include <ctype.h>
+#include <limits.h>
 #include "libtime.h"
 #include "codec.h"
+#include "timefmt.h"
+#include "civil.h"
+#include "zone.h"
 #include <dbus/dbus.h>
 #include "clock_dbus.h"
+#include "clock_sock.h"
 #include <pthread.h>
 #include <semaphore.h>
 
@@ -19,9 +26,19 @@ static bool s_autosync_enabled = false;
 static bool s_operator_time_available = false;
 static sem_t sem_time;
 static DBusConnection *clockd_conn = NULL;
+static int s_sock_fd = -1;
+static uint32_t s_sock_seq = 0;
+static time_t s_sock_retry = 0;
 static char s_tz[CLOCKD_TZ_SIZE] = {0, };
 static char s_default_tz[CLOCKD_TZ_SIZE] = {0, };
 static char s_time_format[CLOCKD_GET_TIMEFMT_SIZE] = {0, };
+static unsigned int s_time_format_gen = 0;
+static struct timefmt_prog *s_time_format_prog = NULL;
+static unsigned int s_time_format_prog_gen = 0;
+
+/* seconds */
+#define CLIENT_SOCK_TIMEOUT 25
+#define CLIENT_SOCK_RETRY 10
 
 #define TIME_TRY_INIT_SYNC(__ret__) \
 do { \
@@ -59,6 +76,17 @@ libtime_fini()
     clockd_conn = NULL;
   }
 
+  if (s_sock_fd != -1)
+  {
+    close(s_sock_fd);
+    s_sock_fd = -1;
+  }
+
+  timefmt_free(s_time_format_prog);
+  s_time_format_prog = NULL;
+  timefmt_cache_flush();
+  zone_cache_flush();
+
   sem_destroy(&sem_time);
 }
 
@@ -114,6 +142,10 @@ client_get_rsp(DBusMessage *msg)
       fprintf(stderr, "FAILED: %s\n",
               "dbus_connection_send_with_reply_and_block");
       fprintf(stderr, "->\t%s: %s\n", error.name, error.message);
+
+      /* a new connection would not help */
+      if (dbus_error_has_name(&error, CLOCKD_ERROR_LIMITS_EXCEEDED))
+        break;
     }
     else
     {
@@ -130,13 +162,156 @@ client_get_rsp(DBusMessage *msg)
   return rsp;
 }
 
+static void
+client_sock_close(void)
+{
+  if (s_sock_fd != -1)
+  {
+    close(s_sock_fd);
+    s_sock_fd = -1;
+  }
+}
+
+static int
+client_sock_connect(void)
+{
+  struct timeval tv = {CLIENT_SOCK_TIMEOUT, 0};
+  struct sockaddr_un addr;
+  time_t now = time(NULL);
+
+  /* clockd without the socket, do not try on every call */
+  if (s_sock_retry && now < s_sock_retry)
+    return -1;
+
+  s_sock_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+  if (s_sock_fd == -1)
+    return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", CLOCKD_SOCKET_PATH);
+
+  if (connect(s_sock_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      setsockopt(s_sock_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+  {
+    client_sock_close();
+    s_sock_retry = now + CLIENT_SOCK_RETRY;
+    return -1;
+  }
+
+  s_sock_retry = 0;
+
+  return 0;
+}
+
+/* requests that change something, never sent twice */
+static bool
+client_sock_is_setter(int op)
+{
+  switch (op)
+  {
+    case CLOCK_SOCK_SET_TIME:
+    case CLOCK_SOCK_SET_TZ:
+    case CLOCK_SOCK_SET_TIMEFMT:
+    case CLOCK_SOCK_SET_AUTOSYNC:
+    case CLOCK_SOCK_ACTIVATE_NET_TIME:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/*
+ * Calls clockd over its socket. Returns -1 if the call should go over
+ * D-Bus instead: not sent, not read, or clockd did not handle it
+ * (-ENOSYS, -EPERM, -EPROTO). Once a setter has been sent, it may have been applied: no
+ * reply or any other error is its final result, 0 with rsp->value 0.
+ */
+static int
+client_sock_call(int op, int64_t value, const char *str,
+                 struct clock_sock_rsp *rsp)
+{
+  struct clock_sock_req req;
+  ssize_t len;
+  int retries = 1;
+  int fallback = client_sock_is_setter(op) ? 0 : -1;
+
+  memset(&req, 0, sizeof(req));
+  req.version = CLOCK_SOCK_VERSION;
+  req.op = op;
+  req.seq = ++s_sock_seq;
+  req.value = value;
+
+  if (str && snprintf(req.str, sizeof(req.str), "%s", str) >=
+      (int)sizeof(req.str))
+  {
+    return -1;
+  }
+
+  while (1)
+  {
+    if (s_sock_fd == -1 && client_sock_connect())
+      return -1;
+
+    if (send(s_sock_fd, &req, sizeof(req), MSG_NOSIGNAL) == sizeof(req))
+      break;
+
+    /* clockd restarted, the request was not delivered */
+    client_sock_close();
+
+    if (!retries--)
+      return -1;
+  }
+
+  do
+    len = recv(s_sock_fd, rsp, sizeof(*rsp), 0);
+  while (len == sizeof(*rsp) && rsp->seq != req.seq);
+
+  if (len != sizeof(*rsp) || rsp->version != CLOCK_SOCK_VERSION)
+  {
+    /* closed with the request unread: clockd has too many clients */
+    if (len == -1 && errno == ECONNRESET)
+    {
+      s_sock_retry = time(NULL) + CLIENT_SOCK_RETRY;
+      fallback = -1;
+    }
+
+    client_sock_close();
+    memset(rsp, 0, sizeof(*rsp));
+    return fallback;
+  }
+
+  rsp->str[sizeof(rsp->str) - 1] = 0;
+
+  if (rsp->status == -ENOSYS || rsp->status == -EPERM ||
+      rsp->status == -EPROTO)
+  {
+    return -1;
+  }
+
+  /* throttled or failed, do not try again over D-Bus */
+  if (rsp->status)
+  {
+    rsp->value = 0;
+    rsp->str[0] = 0;
+    return rsp->status == -EAGAIN ? 0 : fallback;
+  }
+
+  return 0;
+}
+
 static int
 client_set_time(time_t tick)
 {
+  struct clock_sock_rsp srsp;
   DBusMessage *msg;
   dbus_int32_t db_time = tick;
   dbus_bool_t result = FALSE;
 
+  if (!client_sock_call(CLOCK_SOCK_SET_TIME, tick, NULL, &srsp))
+    return srsp.value != 0;
+
   msg = client_new_req(CLOCKD_SET_TIME, DBUS_TYPE_INT32, &db_time,
                        DBUS_TYPE_INVALID);
   if (msg)
@@ -158,12 +333,46 @@ client_set_time(time_t tick)
   return result;
 }
 
+/* D-Bus only, a socket request has one integer argument */
+static int
+client_set_time_ex(long long realtime_ns, long long monotonic_ns)
+{
+  DBusMessage *msg;
+  dbus_int64_t db_realtime = realtime_ns;
+  dbus_int64_t db_monotonic = monotonic_ns;
+  dbus_bool_t result = FALSE;
+
+  msg = client_new_req(CLOCKD_SET_TIME_EX, DBUS_TYPE_INT64, &db_realtime,
+                       DBUS_TYPE_INT64, &db_monotonic, DBUS_TYPE_INVALID);
+  if (msg)
+  {
+    DBusMessage *rsp = client_get_rsp(msg);
+
+    if (rsp)
+    {
+      DBusError error = DBUS_ERROR_INIT;
+      dbus_message_get_args(rsp, &error, DBUS_TYPE_BOOLEAN, &result,
+                            DBUS_TYPE_INVALID);
+      dbus_error_free(&error);
+      dbus_message_unref(rsp);
+    }
+
+    dbus_message_unref(msg);
+  }
+
+  return result;
+}
+
 static int
 client_activate_net_time(void)
 {
+  struct clock_sock_rsp srsp;
   DBusMessage *req;
   dbus_bool_t result = FALSE;
 
+  if (!client_sock_call(CLOCK_SOCK_ACTIVATE_NET_TIME, 0, NULL, &srsp))
+    return srsp.value != 0;
+
   req = client_new_req(CLOCKD_ACTIVATE_NET_TIME, DBUS_TYPE_INVALID);
 
   if (req)
@@ -186,13 +395,36 @@ client_activate_net_time(void)
   return result;
 }
 
+static const char *
+client_got_tz(const char *s)
+{
+  snprintf(s_tz, sizeof(s_tz), "%s", s);
+
+  if (s_tz[0] == '/')
+    s_tz[0] = ':';
+
+  if (*s)
+  {
+    setenv("TZ", s_tz, 1);
+    tzset();
+  }
+
+  return s_tz;
+}
+
 static const char *
 client_get_tz()
 {
   DBusError error = DBUS_ERROR_INIT;
-  DBusMessage *req = client_new_req(CLOCKD_GET_TZ, DBUS_TYPE_INVALID);
+  struct clock_sock_rsp srsp;
+  DBusMessage *req;
   const char *rv = NULL;
 
+  if (!client_sock_call(CLOCK_SOCK_GET_TZ, 0, NULL, &srsp))
+    return client_got_tz(srsp.str);
+
+  req = client_new_req(CLOCKD_GET_TZ, DBUS_TYPE_INVALID);
+
   if (req)
   {
     DBusMessage *rsp = client_get_rsp(req);
@@ -204,18 +436,7 @@ client_get_tz()
       if (dbus_message_get_args(rsp, &error, DBUS_TYPE_STRING, &s,
                                 DBUS_TYPE_INVALID) && s)
       {
-        snprintf(s_tz, sizeof(s_tz), "%s", s);
-
-        if (s_tz[0] == '/')
-          s_tz[0] = ':';
-
-        rv = s_tz;
-
-        if (*s)
-        {
-          setenv("TZ", s_tz, 1);
-          tzset();
-        }
+        rv = client_got_tz(s);
       }
 
       dbus_message_unref(rsp);
@@ -232,12 +453,13 @@ client_get_tz()
 static int
 client_set_tz(const char *tz)
 {
+  struct clock_sock_rsp srsp;
   DBusMessage *req;
   dbus_bool_t result = false;
 
-  req = client_new_req(CLOCKD_SET_TZ, DBUS_TYPE_STRING, &tz, 0);
-
-  if (req)
+  if (!client_sock_call(CLOCK_SOCK_SET_TZ, 0, tz, &srsp))
+    result = srsp.value != 0;
+  else if ((req = client_new_req(CLOCKD_SET_TZ, DBUS_TYPE_STRING, &tz, 0)))
   {
     DBusMessage *rsp = client_get_rsp(req);
 
@@ -247,14 +469,6 @@ client_set_tz(const char *tz)
 
       dbus_message_get_args(rsp, &error, DBUS_TYPE_BOOLEAN, &result,
                             DBUS_TYPE_INVALID);
-
-      if (result)
-      {
-        snprintf(s_tz, sizeof(s_tz), "%s", tz);
-        setenv("TZ", tz, 1);
-        tzset();
-      }
-
       dbus_error_free(&error);
       dbus_message_unref(rsp);
     }
@@ -262,17 +476,45 @@ client_set_tz(const char *tz)
     dbus_message_unref(req);
   }
 
+  if (result)
+  {
+    snprintf(s_tz, sizeof(s_tz), "%s", tz);
+    setenv("TZ", tz, 1);
+    tzset();
+  }
+
   return result;
 }
 
+static int
+client_got_net_time(time_t tick, const char *tz, time_t *t, char *s,
+                    size_t max)
+{
+  if (!tick)
+    return -1;
+
+  *t = tick;
+
+  if (!tz)
+    return 0;
+
+  snprintf(s, max, "%s", tz);
+
+  return strlen(tz);
+}
+
 static int
 client_get_net_time(time_t *t, char *s, size_t max)
 {
+  struct clock_sock_rsp srsp;
   int rv = -1;
   DBusMessage *req;
 
   *t = 0;
 
+  if (!client_sock_call(CLOCK_SOCK_NET_TIME_CHANGED, 0, NULL, &srsp))
+    return client_got_net_time(srsp.value, srsp.str, t, s, max);
+
   req = client_new_req(CLOCKD_NET_TIME_CHANGED, DBUS_TYPE_INVALID);
 
   if (req)
@@ -287,17 +529,9 @@ client_get_net_time(time_t *t, char *s, size_t max)
       if (dbus_message_get_args(rsp, &error,
                                 DBUS_TYPE_INT32, &tick,
                                 DBUS_TYPE_STRING, &tz,
-                                DBUS_TYPE_INVALID) && tick)
+                                DBUS_TYPE_INVALID))
       {
-        *t = tick;
-
-        if (tz)
-        {
-          snprintf(s, max, "%s", tz);
-          rv = strlen(tz);
-        }
-        else
-          rv = 0;
+        rv = client_got_net_time(tick, tz, t, s, max);
       }
 
       dbus_error_free(&error);
@@ -309,13 +543,41 @@ client_get_net_time(time_t *t, char *s, size_t max)
   return rv;
 }
 
+/* the compiled program is only rebuilt if the format really changed */
+static void
+set_time_format(const char *fmt)
+{
+  if (!strncmp(s_time_format, fmt, sizeof(s_time_format) - 1))
+    return;
+
+  snprintf(s_time_format, sizeof(s_time_format), "%s", fmt);
+  s_time_format_gen++;
+}
+
+static const char *
+client_got_time_format(const char *s)
+{
+  if (!*s)
+    return NULL;
+
+  set_time_format(s);
+
+  return s_time_format;
+}
+
 static const char *
 client_get_time_format()
 {
   DBusError error = DBUS_ERROR_INIT;
-  DBusMessage *req = client_new_req(CLOCKD_GET_TIMEFMT, DBUS_TYPE_INVALID);
+  struct clock_sock_rsp srsp;
+  DBusMessage *req;
   const char *rv = NULL;
 
+  if (!client_sock_call(CLOCK_SOCK_GET_TIMEFMT, 0, NULL, &srsp))
+    return client_got_time_format(srsp.str);
+
+  req = client_new_req(CLOCKD_GET_TIMEFMT, DBUS_TYPE_INVALID);
+
   if (req)
   {
     DBusMessage *rsp = client_get_rsp(req);
@@ -325,10 +587,9 @@ client_get_time_format()
       char *s = NULL;
 
       if (dbus_message_get_args(rsp, &error, DBUS_TYPE_STRING, &s,
-                                DBUS_TYPE_INVALID) && s && *s)
+                                DBUS_TYPE_INVALID) && s)
       {
-        snprintf(s_time_format, sizeof(s_time_format), "%s", s);
-        rv = s_time_format;
+        rv = client_got_time_format(s);
       }
 
       dbus_message_unref(rsp);
@@ -345,13 +606,14 @@ client_get_time_format()
 static int
 client_set_time_format(const char *fmt)
 {
+  struct clock_sock_rsp srsp;
   DBusMessage *req;
   dbus_bool_t result = FALSE;
 
-  req = client_new_req(CLOCKD_SET_TIMEFMT, DBUS_TYPE_STRING, &fmt,
-                       DBUS_TYPE_INVALID);
-
-  if (req)
+  if (!client_sock_call(CLOCK_SOCK_SET_TIMEFMT, 0, fmt, &srsp))
+    result = srsp.value != 0;
+  else if ((req = client_new_req(CLOCKD_SET_TIMEFMT, DBUS_TYPE_STRING, &fmt,
+                                 DBUS_TYPE_INVALID)))
   {
     DBusMessage *rsp = client_get_rsp(req);
 
@@ -359,9 +621,6 @@ client_set_time_format(const char *fmt)
     {
       DBusError error = DBUS_ERROR_INIT;
       dbus_message_get_args(rsp, &error, DBUS_TYPE_BOOLEAN, &result, 0);
-      if (result)
-        snprintf(s_time_format, sizeof(s_time_format), "%s", fmt);
-
       dbus_error_free(&error);
       dbus_message_unref(rsp);
     }
@@ -369,6 +628,11 @@ client_set_time_format(const char *fmt)
     dbus_message_unref(req);
   }
 
+  if (result)
+  {
+    set_time_format(fmt);
+  }
+
   return result;
 }
 
@@ -376,7 +640,16 @@ static int
 client_is_operator_time_accessible()
 {
   DBusError error = DBUS_ERROR_INIT;
-  DBusMessage *req = client_new_req(CLOCKD_HAVE_OPERTIME, DBUS_TYPE_INVALID);
+  struct clock_sock_rsp srsp;
+  DBusMessage *req;
+
+  if (!client_sock_call(CLOCK_SOCK_HAVE_OPERTIME, 0, NULL, &srsp))
+  {
+    s_operator_time_available = srsp.value != 0;
+    return s_operator_time_available;
+  }
+
+  req = client_new_req(CLOCKD_HAVE_OPERTIME, DBUS_TYPE_INVALID);
 
   if (req)
   {
@@ -406,7 +679,16 @@ static int
 client_get_autosync()
 {
   DBusError error = DBUS_ERROR_INIT;
-  DBusMessage *req = client_new_req(CLOCKD_GET_AUTOSYNC, DBUS_TYPE_INVALID);
+  struct clock_sock_rsp srsp;
+  DBusMessage *req;
+
+  if (!client_sock_call(CLOCK_SOCK_GET_AUTOSYNC, 0, NULL, &srsp))
+  {
+    s_autosync_enabled = srsp.value != 0;
+    return s_autosync_enabled;
+  }
+
+  req = client_new_req(CLOCKD_GET_AUTOSYNC, DBUS_TYPE_INVALID);
 
   if (req)
   {
@@ -435,14 +717,15 @@ client_get_autosync()
 static int
 client_set_autosync(int enable)
 {
+  struct clock_sock_rsp srsp;
   DBusMessage *req;
   dbus_bool_t result = FALSE;
   dbus_bool_t db_enable = !!enable;
 
-  req = client_new_req(CLOCKD_SET_AUTOSYNC, DBUS_TYPE_BOOLEAN, &db_enable,
-                       DBUS_TYPE_INVALID);
-
-  if (req)
+  if (!client_sock_call(CLOCK_SOCK_SET_AUTOSYNC, db_enable, NULL, &srsp))
+    result = srsp.value != 0;
+  else if ((req = client_new_req(CLOCKD_SET_AUTOSYNC, DBUS_TYPE_BOOLEAN,
+                                 &db_enable, DBUS_TYPE_INVALID)))
   {
     DBusMessage *rsp = client_get_rsp(req);
 
@@ -452,10 +735,6 @@ client_set_autosync(int enable)
 
       dbus_message_get_args(rsp, &error, DBUS_TYPE_BOOLEAN, &result,
                             DBUS_TYPE_INVALID);
-
-      if (result)
-        s_autosync_enabled = enable;
-
       dbus_error_free(&error);
       dbus_message_unref(rsp);
     }
@@ -463,16 +742,36 @@ client_set_autosync(int enable)
     dbus_message_unref(req);
   }
 
+  if (result)
+    s_autosync_enabled = enable;
+
   return result;
 }
 
+static const char *
+client_got_default_tz(const char *s)
+{
+  if (!*s)
+    return NULL;
+
+  snprintf(s_default_tz, sizeof(s_default_tz), "%s", s);
+
+  return s_default_tz;
+}
+
 static const char*
 client_get_default_tz()
 {
-  DBusMessage *req = client_new_req(CLOCKD_GET_DEFAULT_TZ, DBUS_TYPE_INVALID);
+  struct clock_sock_rsp srsp;
+  DBusMessage *req;
   DBusError error = DBUS_ERROR_INIT;
   const char *rv = NULL;
 
+  if (!client_sock_call(CLOCK_SOCK_GET_DEFAULT_TZ, 0, NULL, &srsp))
+    return client_got_default_tz(srsp.str);
+
+  req = client_new_req(CLOCKD_GET_DEFAULT_TZ, DBUS_TYPE_INVALID);
+
   if (req)
   {
     DBusMessage *rsp = client_get_rsp(req);
@@ -482,10 +781,9 @@ client_get_default_tz()
       char *s = NULL;
 
       if (dbus_message_get_args(rsp, &error, DBUS_TYPE_STRING, &s,
-                                DBUS_TYPE_INVALID) && s && *s)
+                                DBUS_TYPE_INVALID) && s)
       {
-        snprintf(s_default_tz, sizeof(s_default_tz), "%s", s);
-        rv = s_default_tz;
+        rv = client_got_default_tz(s);
       }
 
       dbus_message_unref(rsp);
@@ -499,6 +797,58 @@ client_get_default_tz()
   return rv;
 }
 
+static int
+client_apply_settings(const struct time_settings *settings)
+{
+  DBusMessage *req;
+  dbus_uint32_t mask = settings->mask;
+  const char *tz = settings->tz ? settings->tz : "";
+  const char *fmt = settings->time_format ? settings->time_format : "";
+  dbus_bool_t enable = !!settings->autosync;
+  dbus_bool_t result = FALSE;
+
+  req = client_new_req(CLOCKD_APPLY_SETTINGS, DBUS_TYPE_UINT32, &mask,
+                       DBUS_TYPE_STRING, &tz, DBUS_TYPE_STRING, &fmt,
+                       DBUS_TYPE_BOOLEAN, &enable, DBUS_TYPE_INVALID);
+
+  if (req)
+  {
+    DBusMessage *rsp = client_get_rsp(req);
+
+    if (rsp)
+    {
+      DBusError error = DBUS_ERROR_INIT;
+
+      dbus_message_get_args(rsp, &error, DBUS_TYPE_BOOLEAN, &result,
+                            DBUS_TYPE_INVALID);
+      dbus_error_free(&error);
+      dbus_message_unref(rsp);
+    }
+
+    dbus_message_unref(req);
+  }
+
+  if (!result)
+    return result;
+
+  if (mask & CLOCKD_CHANGE_TZ)
+  {
+    snprintf(s_tz, sizeof(s_tz), "%s", tz);
+    setenv("TZ", tz, 1);
+    tzset();
+  }
+
+  if (mask & CLOCKD_CHANGE_FORMAT)
+  {
+    set_time_format(fmt);
+  }
+
+  if (mask & CLOCKD_CHANGE_AUTOSYNC)
+    s_autosync_enabled = enable;
+
+  return result;
+}
+
 static int
 get_synced()
 {
@@ -547,6 +897,20 @@ time_set_time(time_t tick)
   return rv;
 }
 
+int
+time_set_time_ex(long long realtime_ns, long long monotonic_ns)
+{
+  int rv;
+
+  TIME_TRY_INIT_SYNC(-1);
+
+  rv = client_set_time_ex(realtime_ns, monotonic_ns) ? 0 : -1;
+
+  TIME_EXIT_SYNC;
+
+  return rv;
+}
+
 int
 time_get_net_time(time_t *tick, char *s, size_t max)
 {
@@ -784,23 +1148,605 @@ time_set_time_format(const char *fmt)
   return rv;
 }
 
+static const struct timefmt_prog *
+get_time_format_prog(const char *fmt)
+{
+  if (fmt)
+    return timefmt_cache_get(fmt);
+
+  if (!s_time_format_prog || s_time_format_prog_gen != s_time_format_gen)
+  {
+    timefmt_free(s_time_format_prog);
+    s_time_format_prog = timefmt_compile(s_time_format);
+    s_time_format_prog_gen = s_time_format_gen;
+  }
+
+  return s_time_format_prog;
+}
+
 int
 time_format_time(const struct tm *tm, const char *fmt, char *s, size_t max)
 {
+  const struct timefmt_prog *prog;
   int rv;
 
   TIME_TRY_INIT_SYNC(-1);
 
+  prog = get_time_format_prog(fmt);
+
+  if (prog)
+    rv = timefmt_exec(prog, tm, s, max);
+  else
+    rv = strftime(s, max, fmt ? fmt : s_time_format, tm);
+
+  TIME_EXIT_SYNC;
+
+  return rv;
+}
+
+/* Checks that [day_start, day_start + 24h) is one plain local day */
+static int
+is_plain_local_day(time_t day_start, const struct tm *tm)
+{
+  time_t day_end = day_start + 24 * 60 * 60 - 1;
+  struct tm tp;
+
+  if (!localtime_r(&day_start, &tp) || tp.tm_gmtoff != tm->tm_gmtoff ||
+      tp.tm_hour || tp.tm_min || tp.tm_sec)
+  {
+    return 0;
+  }
+
+  if (!localtime_r(&day_end, &tp) || tp.tm_gmtoff != tm->tm_gmtoff ||
+      tp.tm_mday != tm->tm_mday || tp.tm_hour != 23 || tp.tm_min != 59 ||
+      tp.tm_sec != 59)
+  {
+    return 0;
+  }
+
+  return 1;
+}
+
+static int
+format_batch(const struct timefmt_prog *prog, const char *fmt,
+             const time_t *ticks, size_t n, char *buf, size_t stride)
+{
+  unsigned short *offs = NULL;
+  const char *prev = NULL;
+  time_t day_start = 0;
+  bool have_day = false;
+  struct tm tm;
+  int rv = 0;
+  size_t i;
+
+  if (prog && prog->nops && stride <= USHRT_MAX)
+    offs = malloc(prog->nops * sizeof(*offs));
+
+  for (i = 0; i < n; i++)
+  {
+    char *s = &buf[i * stride];
+    time_t t = ticks[i];
+    size_t len;
+
+    if (have_day && t >= day_start && t < day_start + 24 * 60 * 60)
+    {
+      int secs = t - day_start;
+
+      tm.tm_hour = secs / 3600;
+      tm.tm_min = secs / 60 % 60;
+      tm.tm_sec = secs % 60;
+
+      if (prev)
+      {
+        memcpy(s, prev, strlen(prev) + 1);
+        timefmt_patch(prog, &tm, s, offs);
+        prev = s;
+        rv++;
+        continue;
+      }
+    }
+    else
+    {
+      if (!localtime_r(&t, &tm))
+      {
+        *s = 0;
+        have_day = false;
+        prev = NULL;
+        continue;
+      }
+
+      day_start = t - (tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec);
+      have_day = tm.tm_sec < 60 && is_plain_local_day(day_start, &tm);
+      prev = NULL;
+    }
+
+    if (prog)
+      len = timefmt_exec_layout(prog, &tm, s, stride, offs);
+    else
+      len = strftime(s, stride, fmt, &tm);
+
+    if (len || (prog && !prog->nops))
+    {
+      if (have_day && offs && timefmt_can_patch(prog, &tm))
+        prev = s;
+
+      rv++;
+    }
+    else
+    {
+      *s = 0;
+      prev = NULL;
+    }
+  }
+
+  free(offs);
+
+  return rv;
+}
+
+int
+time_format_batch(const char *fmt, const time_t *ticks, size_t n, char *buf,
+                  size_t stride)
+{
+  int rv;
+
+  if (!ticks || !buf || !stride || n > INT_MAX)
+    return -1;
+
+  TIME_TRY_INIT_SYNC(-1);
+
   if (!fmt)
     fmt = s_time_format;
 
-  rv = strftime(s, max, fmt, tm);
+  rv = format_batch(get_time_format_prog(fmt == s_time_format ? NULL : fmt),
+                    fmt, ticks, n, buf, stride);
+
+  TIME_EXIT_SYNC;
+
+  return rv;
+}
+
+struct parse_day_cache
+{
+  bool valid;
+  long long year;
+  int mon;
+  int mday;
+  time_t day_start;
+};
+
+static int
+parsed_to_time(const struct timefmt_parsed *p, struct parse_day_cache *cache,
+               time_t *tick)
+{
+  long long t;
+  int secs = p->hour * 3600 + p->min * 60 + p->sec;
+
+  if (p->has_epoch)
+    t = p->epoch;
+  else if (p->has_offset)
+  {
+    t = civil_days_from_date(p->year, p->mon, p->mday) *
+        CIVIL_SECS_PER_DAY + secs - p->offset;
+  }
+  else if (cache && cache->valid && cache->year == p->year &&
+           cache->mon == p->mon && cache->mday == p->mday && p->sec < 60)
+  {
+    t = (long long)cache->day_start + secs;
+  }
+  else
+  {
+    const struct zone *zone = zone_cache_get(s_tz);
+    long long local = civil_days_from_date(p->year, p->mon, p->mday) *
+        CIVIL_SECS_PER_DAY + secs;
+    long gmtoff;
+    long end_gmtoff;
+    int isdst;
+
+    /* like time_add_calendar(), not through TZ and mktime() */
+    if (!zone || zone_local_to_utc(zone, local, ZONE_FOLD_EARLIER |
+                                   ZONE_GAP_SHIFT, &t))
+    {
+      return -1;
+    }
+
+    if (cache)
+    {
+      long long day_start = t - secs;
+
+      /* the day has one offset, the time was not shifted out of a gap */
+      zone_lookup(zone, day_start, &gmtoff, &isdst);
+      zone_lookup(zone, day_start + CIVIL_SECS_PER_DAY - 1, &end_gmtoff,
+                  &isdst);
+      cache->valid = p->sec < 60 && gmtoff == end_gmtoff &&
+          t + gmtoff == local && (time_t)day_start == day_start;
+
+      if (cache->valid)
+      {
+        cache->year = p->year;
+        cache->mon = p->mon;
+        cache->mday = p->mday;
+        cache->day_start = day_start;
+      }
+    }
+  }
+
+  if ((time_t)t != t)
+    return -1;
+
+  *tick = t;
+
+  return 0;
+}
+
+static int
+parse_one(const struct timefmt_prog *prog, const char *s, size_t len,
+          struct parse_day_cache *cache, time_t *tick, long *nsec)
+{
+  struct timefmt_parsed parsed;
+  int rv = timefmt_parse(prog, s, len, &parsed);
+
+  if (rv < 0 || parsed_to_time(&parsed, cache, tick))
+    return -1;
+
+  if (nsec)
+    *nsec = parsed.nsec;
+
+  return rv;
+}
+
+int
+time_parse(const char *fmt, const char *s, size_t len, time_t *tick,
+           long *nsec)
+{
+  const struct timefmt_prog *prog;
+  int rv = -1;
+
+  if (!s || !tick)
+    return -1;
+
+  TIME_TRY_INIT_SYNC(-1);
+
+  prog = get_time_format_prog(fmt);
+
+  if (prog)
+    rv = parse_one(prog, s, len, NULL, tick, nsec);
+
+  TIME_EXIT_SYNC;
+
+  return rv;
+}
+
+int
+time_parse_batch(const char *fmt, const char *const *s, const size_t *len,
+                 size_t n, time_t *ticks, long *nsec)
+{
+  struct parse_day_cache cache;
+  const struct timefmt_prog *prog;
+  int rv = 0;
+  size_t i;
+
+  if (!s || !ticks || n > INT_MAX)
+    return -1;
+
+  TIME_TRY_INIT_SYNC(-1);
+
+  prog = get_time_format_prog(fmt);
+  memset(&cache, 0, sizeof(cache));
+
+  for (i = 0; i < n; i++)
+  {
+    long ns = 0;
+
+    if (prog && s[i] &&
+        parse_one(prog, s[i], len ? len[i] : strlen(s[i]), &cache, &ticks[i],
+                  &ns) >= 0)
+    {
+      rv++;
+    }
+    else
+    {
+      ticks[i] = -1;
+      ns = -1;
+    }
+
+    if (nsec)
+      nsec[i] = ns;
+  }
+
+  TIME_EXIT_SYNC;
+
+  return prog ? rv : -1;
+}
+
+static int
+add_calendar_zone(const struct zone *zone, time_t tick, int years, int months,
+                  int days, int policy, long long *t)
+{
+  long long local;
+  long long m;
+  long gmtoff;
+  long long day;
+  long long year;
+  int isdst;
+  int secs;
+  int mon;
+  int mday;
+
+  zone_lookup(zone, tick, &gmtoff, &isdst);
+  local = (long long)tick + gmtoff;
+  day = civil_floor_div(local, CIVIL_SECS_PER_DAY);
+  secs = local - day * CIVIL_SECS_PER_DAY;
+  civil_date_from_days(day, &year, &mon, &mday);
+
+  m = year * 12 + mon - 1 + (long long)years * 12 + months;
+  year = civil_floor_div(m, 12);
+  mon = m - year * 12 + 1;
+
+  if (!(policy & TIME_CAL_MONTH_OVERFLOW) &&
+      mday > civil_days_in_month(year, mon))
+  {
+    mday = civil_days_in_month(year, mon);
+  }
+
+  day = civil_days_from_date(year, mon, 1) + mday - 1 + days;
+  local = day * CIVIL_SECS_PER_DAY + secs;
+
+  return zone_local_to_utc(zone, local, policy &
+                           (ZONE_FOLD_LATER | ZONE_GAP_REJECT | ZONE_GAP_NEXT),
+                           t);
+}
+
+int
+time_add_calendar(time_t tick, const char *tz, int years, int months,
+                  int days, int hours, int minutes, int seconds, int policy,
+                  time_t *result)
+{
+  const struct zone *zone;
+  long long t = tick;
+  int rv = 0;
+
+  if (!result)
+    return -1;
+
+  TIME_TRY_INIT_SYNC(-1);
+
+  if (years || months || days)
+  {
+    zone = zone_cache_get(tz ? tz : s_tz);
+
+    /* no mktime() fallback, it would change TZ and ignore 'policy' */
+    if (zone)
+      rv = add_calendar_zone(zone, tick, years, months, days, policy, &t);
+    else
+      rv = -1;
+  }
 
   TIME_EXIT_SYNC;
 
+  t += (long long)hours * 3600 + (long long)minutes * 60 + seconds;
+
+  if (rv || (time_t)t != t)
+    return -1;
+
+  *result = t;
+
+  return 0;
+}
+
+struct time_recur
+{
+  struct time_recurrence rule;
+  char tz[CLOCKD_TZ_SIZE];
+  time_t start;
+  long long period;
+  int pos;
+};
+
+/* years beyond this end the iteration */
+#define RECUR_MAX_YEAR 9999
+
+struct time_recur *
+time_recur_new(const struct time_recurrence *rule, const char *tz,
+               time_t start)
+{
+  struct time_recur *recur;
+  const struct zone *zone;
+  long gmtoff = 0;
+  long long day;
+  long long year;
+  int isdst;
+  int mon;
+  int mday;
+
+  if (!rule || rule->freq < TIME_RECUR_DAILY ||
+      rule->freq > TIME_RECUR_YEARLY || rule->interval < 0 ||
+      rule->hour < 0 || rule->hour > 23 || rule->min < 0 || rule->min > 59 ||
+      rule->sec < 0 || rule->sec > 59 || rule->mday < -31 ||
+      rule->mday > 31 || rule->mon < 0 || rule->mon > 12 ||
+      (rule->wday_mask & ~0x7f))
+  {
+    return NULL;
+  }
+
+  TIME_TRY_INIT_SYNC(NULL);
+
+  recur = calloc(1, sizeof(*recur));
+  zone = NULL;
+
+  if (recur)
+  {
+    snprintf(recur->tz, sizeof(recur->tz), "%s", tz ? tz : s_tz);
+    zone = zone_cache_get(recur->tz);
+  }
+
+  if (zone)
+    zone_lookup(zone, start, &gmtoff, &isdst);
+
+  TIME_EXIT_SYNC;
+
+  if (!zone)
+  {
+    free(recur);
+    return NULL;
+  }
+
+  recur->rule = *rule;
+  recur->start = start;
+
+  if (!recur->rule.interval)
+    recur->rule.interval = 1;
+
+  day = civil_floor_div((long long)start + gmtoff, CIVIL_SECS_PER_DAY);
+  civil_date_from_days(day, &year, &mon, &mday);
+
+  if (!recur->rule.wday_mask)
+    recur->rule.wday_mask = 1 << civil_weekday(day);
+
+  if (!recur->rule.mday)
+    recur->rule.mday = mday;
+
+  if (!recur->rule.mon)
+    recur->rule.mon = mon;
+
+  switch (recur->rule.freq)
+  {
+    case TIME_RECUR_DAILY:
+      recur->period = day;
+      break;
+    case TIME_RECUR_WEEKLY:
+      recur->period = day - (civil_weekday(day) + 6) % 7;
+      break;
+    case TIME_RECUR_MONTHLY:
+      recur->period = year * 12 + mon - 1;
+      break;
+    default:
+      recur->period = year;
+      break;
+  }
+
+  return recur;
+}
+
+static int
+recur_day_in_month(const struct time_recurrence *rule, long long year,
+                   int mon, long long *day)
+{
+  int dim = civil_days_in_month(year, mon);
+  int mday = rule->mday;
+
+  if (mday < 0)
+    mday += dim + 1;
+
+  if (mday < 1)
+    mday = 1;
+  else if (mday > dim)
+    mday = dim;
+
+  *day = civil_days_from_date(year, mon, mday);
+
+  return year <= RECUR_MAX_YEAR ? 0 : -1;
+}
+
+/*
+ * Gets the day of the current candidate and moves to the next one.
+ * Returns 1 if the candidate is valid, 0 if it is not and -1 at the end.
+ */
+static int
+recur_step(struct time_recur *recur, long long *day)
+{
+  const struct time_recurrence *rule = &recur->rule;
+  long long year;
+  int rv = 1;
+
+  switch (rule->freq)
+  {
+    case TIME_RECUR_DAILY:
+      *day = recur->period;
+      recur->period += rule->interval;
+      break;
+    case TIME_RECUR_WEEKLY:
+      *day = recur->period + recur->pos;
+      rv = !!(rule->wday_mask & (1 << civil_weekday(*day)));
+
+      if (++recur->pos == 7)
+      {
+        recur->pos = 0;
+        recur->period += 7LL * rule->interval;
+      }
+
+      break;
+    case TIME_RECUR_MONTHLY:
+      year = civil_floor_div(recur->period, 12);
+
+      if (recur_day_in_month(rule, year, recur->period - year * 12 + 1, day))
+        return -1;
+
+      recur->period += rule->interval;
+      break;
+    default:
+      if (recur_day_in_month(rule, recur->period, rule->mon, day))
+        return -1;
+
+      recur->period += rule->interval;
+      break;
+  }
+
+  if (*day > civil_days_from_date(RECUR_MAX_YEAR, 12, 31))
+    return -1;
+
   return rv;
 }
 
+int
+time_recur_next(struct time_recur *recur, time_t *ticks, size_t n)
+{
+  const struct time_recurrence *rule;
+  const struct zone *zone;
+  long secs;
+  size_t i = 0;
+
+  if (!recur || !ticks || n > INT_MAX)
+    return -1;
+
+  rule = &recur->rule;
+  secs = rule->hour * 3600 + rule->min * 60 + rule->sec;
+
+  TIME_TRY_INIT_SYNC(-1);
+
+  zone = zone_cache_get(recur->tz);
+
+  while (zone && i < n)
+  {
+    long long t;
+    long long day;
+    int rv = recur_step(recur, &day);
+
+    if (rv < 0)
+      break;
+
+    if (!rv || zone_local_to_utc(zone, day * CIVIL_SECS_PER_DAY + secs,
+                                 rule->policy & (ZONE_FOLD_LATER |
+                                 ZONE_GAP_REJECT | ZONE_GAP_NEXT), &t))
+    {
+      continue;
+    }
+
+    if (t >= recur->start && (time_t)t == t)
+      ticks[i++] = t;
+  }
+
+  TIME_EXIT_SYNC;
+
+  return zone ? (int)i : -1;
+}
+
+void
+time_recur_free(struct time_recur *recur)
+{
+  free(recur);
+}
+
 static int
 get_utc_offset(time_t tick)
 {
@@ -914,6 +1860,23 @@ time_set_autosync(int enable)
   return rv;
 }
 
+int
+time_apply_settings(const struct time_settings *settings)
+{
+  int rv;
+
+  if (!settings)
+    return -1;
+
+  TIME_TRY_INIT_SYNC(-1);
+
+  rv = client_apply_settings(settings) ? 0 : -1;
+
+  TIME_EXIT_SYNC;
+
+  return rv;
+}
+
 int
 time_get_autosync(void)
 {
@@ -54,6 +54,55 @@ extern "C" {
 
 #define CLOCKD_TIME_CHANGED "time_changed"
 
+/**
+   D-Bus method to get only the changes the caller is interested in,
+   as CLOCKD_CHANGED signals sent to the caller alone.
+   Argument is uint32 mask of CLOCKD_CHANGE_* bits, 0 cancels the
+   subscription. Returns boolean.
+   The subscription ends when the caller leaves the bus or clockd
+   restarts, subscribe again when CLOCKD_SERVICE gets a new owner.
+*/
+#define CLOCKD_SUBSCRIBE "subscribe"
+
+/**
+   D-Bus error returned to a caller that changes settings faster than
+   clockd allows, retry later.
+*/
+#define CLOCKD_ERROR_LIMITS_EXCEEDED "com.nokia.clockd.Error.LimitsExceeded"
+
+/**
+   D-Bus signal sent to the subscribers (see CLOCKD_SUBSCRIBE).
+   Arguments are uint32 mask of the subscribed CLOCKD_CHANGE_* bits
+   that have changed and int64 time, 0 if time itself has not been
+   changed.
+*/
+#define CLOCKD_CHANGED "changed"
+
+#define CLOCKD_CHANGE_TIME      0x01  /* time has been set */
+#define CLOCKD_CHANGE_TZ        0x02  /* timezone */
+#define CLOCKD_CHANGE_FORMAT    0x04  /* time format */
+#define CLOCKD_CHANGE_AUTOSYNC  0x08  /* network time autosync */
+#define CLOCKD_CHANGE_DST       0x10  /* daylight saving time started/ended */
+/* timezone database updated, libtime reloads changed zones by itself */
+#define CLOCKD_CHANGE_ZONEDATA  0x20
+#define CLOCKD_CHANGE_ALL       0x3f
+
+/**
+   D-Bus signal sent on every change, carrying the new state so that
+   receivers need not ask clockd for it. Arguments are:
+   - uint64 generation, incremented by every change, it keeps growing
+     across clockd restarts
+   - uint32 mask of CLOCKD_CHANGE_* bits that have changed
+   - string timezone, as returned by CLOCKD_GET_TZ
+   - string time format
+   - boolean network time autosync
+   - int64 nanoseconds the time has been stepped by since the previous
+     signal with CLOCKD_CHANGE_TIME, 0 if CLOCKD_CHANGE_TIME is not set
+   - int64 CLOCK_REALTIME, CLOCK_MONOTONIC and CLOCK_BOOTTIME in
+     nanoseconds, read together when the signal was sent
+*/
+#define CLOCKD_TIME_CHANGED_EX "time_changed_ex"
+
 
 
 
@@ -96,6 +145,22 @@ int time_set_time(time_t tick);
 
 
 
+/**
+   Set current system and RTC time with nanosecond precision. clockd adds
+   the time elapsed since CLOCK_MONOTONIC was monotonic_ns, so the time
+   spent in the request and in clockd does not make the clock late.
+
+   @param realtime_ns   Time since Epoch in nanoseconds
+   @param monotonic_ns  CLOCK_MONOTONIC in nanoseconds when realtime_ns
+                        was the time
+
+   @return	0 if OK, -1 if fails
+*/
+int time_set_time_ex(long long realtime_ns, long long monotonic_ns);
+
+
+
+
 
 
 
@@ -362,6 +427,213 @@ int time_format_time(const struct tm *tm, const char *fmt, char *s, size_t max);
 
 
 
+/**
+   Format many timestamps with the same formatter. The timestamps are converted
+   to local time of the current zone and formatted like time_format_time() does.
+   Consecutive timestamps within the same local day reuse the previously formatted
+   record, so formatting sorted log or CSV timestamps is considerably faster than
+   calling time_format_time() for each of them.
+
+   @param fmt     Formatter, see time_format_time(). NULL if active formatter is used.
+   @param ticks   Array of 'n' times since Epoch
+   @param n       Number of timestamps
+   @param buf     Supplied buffer of 'n' records, 'stride' bytes each. Record 'i' starts
+                  at buf + i * stride and is NUL terminated. A record that does not fit
+                  into 'stride' bytes is stored as an empty string.
+   @param stride  Size of one record, including terminating NUL
+
+   @return	Number of timestamps formatted, -1 if error
+
+*/
+int time_format_batch(const char *fmt, const time_t *ticks, size_t n, char *buf,
+                      size_t stride);
+
+
+
+/**
+   Formatter presets for time_parse() and time_parse_batch().<br>
+   TIME_FORMAT_RFC3339 requires an UTC offset (or "Z"), TIME_FORMAT_ISO8601 is
+   local time in the current zone. Both accept optional fractional seconds.
+*/
+#define TIME_FORMAT_RFC3339 "%Y-%m-%dT%H:%M:%S%f%z"
+#define TIME_FORMAT_ISO8601 "%Y-%m-%dT%H:%M:%S%f"
+
+
+
+/**
+   Parse time string. Inverse of time_format_time() and time_mktime().<br>
+   The formatter uses strftime() conversions. Whitespace in the formatter matches any
+   amount of whitespace, other characters match case insensitively. Numeric fields
+   accept up to their formatted width of digits. Additionally:
+   - %z accepts "Z", "+hh", "+hhmm" and "+hh:mm", the result is then independent of
+     the current zone
+   - %f accepts optional fractional seconds (".ddd" or ",ddd"), parsing only
+   - %s accepts seconds since Epoch
+
+   Fields missing from the formatter default to 1970-01-01 00:00:00. Without %z the
+   string is local time in the current zone: a time repeated when DST ends is the
+   earlier one, a time skipped when DST starts is moved forward by the length of
+   the gap, like time_add_calendar() does by default.
+
+   @param fmt   Formatter, see above and the TIME_FORMAT_* presets. NULL if active formatter is used.
+   @param s     String to parse, does not need to be NUL terminated
+   @param len   Length of 's'
+   @param tick  Supplied buffer to store time since Epoch
+   @param nsec  Supplied buffer to store nanoseconds, NULL if not needed
+
+   @return	Number of characters of 's' parsed, -1 if error
+*/
+int time_parse(const char *fmt, const char *s, size_t len, time_t *tick,
+               long *nsec);
+
+
+
+/**
+   Parse many time strings with the same formatter, see time_parse(). Consecutive
+   strings in the same local day are converted without consulting the zone again.
+
+   @param fmt    Formatter, NULL if active formatter is used.
+   @param s      Array of 'n' strings
+   @param len    Array of 'n' string lengths, NULL if the strings are NUL terminated
+   @param n      Number of strings
+   @param ticks  Supplied array of 'n' to store times since Epoch. Strings that could
+                 not be parsed are stored as -1.
+   @param nsec   Supplied array of 'n' to store nanoseconds, NULL if not needed.
+                 Strings that could not be parsed are stored as -1.
+
+   @return	Number of strings parsed, -1 if error
+*/
+int time_parse_batch(const char *fmt, const char *const *s, const size_t *len,
+                     size_t n, time_t *ticks, long *nsec);
+
+
+
+/**
+   time_add_calendar() policy flags. When the resulting wall clock time is
+   repeated (DST ends), TIME_CAL_FOLD_EARLIER or TIME_CAL_FOLD_LATER picks the
+   occurrence. When it does not exist (DST starts), TIME_CAL_GAP_SHIFT moves it
+   forward by the length of the gap, TIME_CAL_GAP_NEXT gives the first instant
+   after the gap and TIME_CAL_GAP_REJECT fails. Day of month is clamped to the
+   last day of the resulting month unless TIME_CAL_MONTH_OVERFLOW is given.
+*/
+#define TIME_CAL_FOLD_EARLIER   0x00
+#define TIME_CAL_FOLD_LATER     0x01
+#define TIME_CAL_GAP_SHIFT      0x00
+#define TIME_CAL_GAP_REJECT     0x02
+#define TIME_CAL_GAP_NEXT       0x04
+#define TIME_CAL_MONTH_OVERFLOW 0x08
+
+
+
+/**
+   Calendar arithmetic in a time zone, for example "same wall clock time next
+   month". Years, months and days are added to the local date, the result is
+   converted back using 'policy', then hours, minutes and seconds are added as
+   elapsed time. TZ environment variable is not touched.
+
+   @param tick     Time since Epoch
+   @param tz       Time zone, see time_mktime(). NULL if current zone is used.
+   @param years    Years to add, may be negative
+   @param months   Months to add, may be negative
+   @param days     Days to add, may be negative
+   @param hours    Hours to add, may be negative
+   @param minutes  Minutes to add, may be negative
+   @param seconds  Seconds to add, may be negative
+   @param policy   TIME_CAL_* flags
+   @param result   Supplied buffer to store time since Epoch
+
+   @return	0 if OK, -1 if error (the zone cannot be loaded, or the time is in a
+                gap and TIME_CAL_GAP_REJECT is given)
+*/
+int time_add_calendar(time_t tick, const char *tz, int years, int months,
+                      int days, int hours, int minutes, int seconds,
+                      int policy, time_t *result);
+
+
+
+/**
+   Recurrence frequencies, see struct time_recurrence
+*/
+#define TIME_RECUR_DAILY   0
+#define TIME_RECUR_WEEKLY  1
+#define TIME_RECUR_MONTHLY 2
+#define TIME_RECUR_YEARLY  3
+
+
+
+/**
+   Wall clock recurrence rule, for example "weekdays at 07:00" or "monthly
+   on the last day at 12:00". Each field is used only by the frequencies
+   listed. "Start" is the local date of the start time given to
+   time_recur_new().
+
+   freq       TIME_RECUR_*
+   interval   Every 'interval' days/weeks/months/years, 0 means 1
+   hour, min, sec  Wall clock time of the occurrences, all frequencies. No default,
+              0 is midnight or :00.
+   wday_mask  TIME_RECUR_WEEKLY: bit 0 is Sunday .. bit 6 Saturday. Weeks start on Monday.
+              0 means the weekday of start.
+   mday       TIME_RECUR_MONTHLY and TIME_RECUR_YEARLY: day of month, negative counts
+              from the end (-1 is the last day). Clamped to the length of the month.
+              0 means the day of month of start.
+   mon        TIME_RECUR_YEARLY: month 1..12, 0 means the month of start
+   policy     TIME_CAL_FOLD_* and TIME_CAL_GAP_* for occurrences in DST changes.
+              With TIME_CAL_GAP_REJECT occurrences in a gap are skipped.
+*/
+struct time_recurrence
+{
+  int freq;
+  int interval;
+  int hour;
+  int min;
+  int sec;
+  int wday_mask;
+  int mday;
+  int mon;
+  int policy;
+};
+
+struct time_recur;
+
+
+
+/**
+   Create an iterator over occurrences of a recurrence rule in a time zone.
+
+   @param rule   Recurrence rule
+   @param tz     Time zone, see time_mktime(). NULL if current zone is used.
+   @param start  First occurrence is at or after this time
+
+   @return	Iterator to be freed with time_recur_free(), NULL if error
+*/
+struct time_recur *time_recur_new(const struct time_recurrence *rule,
+                                  const char *tz, time_t start);
+
+
+
+/**
+   Get next occurrences, in increasing order.
+
+   @param recur  Iterator from time_recur_new()
+   @param ticks  Supplied array of 'n' to store times since Epoch
+   @param n      Number of occurrences wanted
+
+   @return	Number of occurrences stored, less than 'n' only if the end of the
+                supported time range was reached. -1 if error.
+*/
+int time_recur_next(struct time_recur *recur, time_t *ticks, size_t n);
+
+
+
+/**
+   Free iterator from time_recur_new()
+
+   @param recur  Iterator, may be NULL
+*/
+void time_recur_free(struct time_recur *recur);
+
+
+
 /**
    Get utc offset (secs west of GMT) in the named TZ. The current daylight saving time offset is included.
 
@@ -439,6 +711,39 @@ int time_is_operator_time_accessible(void);
 
 
 
+/**
+   Settings for time_apply_settings().
+
+   mask         CLOCKD_CHANGE_TZ, CLOCKD_CHANGE_FORMAT and/or
+                CLOCKD_CHANGE_AUTOSYNC, the settings to apply
+   tz           Time zone, see time_set_timezone()
+   time_format  Time format, see time_set_time_format()
+   autosync     Nonzero to enable automatic network time, see time_set_autosync()
+*/
+struct time_settings
+{
+  unsigned int mask;
+  const char *tz;
+  const char *time_format;
+  int autosync;
+};
+
+
+
+/**
+   Set several settings with one request. Either all the selected settings
+   are applied or none of them; clockd saves them and sends the change
+   indication only once.
+
+   @param settings  Settings to apply
+
+   @return    0 if OK, -1 if fails
+ */
+int time_apply_settings(const struct time_settings *settings);
+
+
+
+
 
 #ifdef __cplusplus
 };
@@ -25,12 +25,12 @@ dump_date(const char *server_tz)
 
   memset(&tm, 0, sizeof(tm));
   timer = internal_get_time();
-  localtime_r(&timer, &tm);
+  internal_localtime_in(timer, &tm, NULL);
 
   DO_LOG(LOG_INFO,
-         "Date now is %04d-%02d-%02d %02d:%02d:%02d (DST %s), TZ=%s, offset %d/%d, timezone=%ld, tzname=%s/%s",
+         "Date now is %04d-%02d-%02d %02d:%02d:%02d (DST %s), TZ=%s, offset %d/%d, zone=%s",
          tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min,
          tm.tm_sec, internal_get_dst(timer) ? "ON" : "OFF", server_tz,
          internal_get_utc_offset(timer, 1), internal_get_utc_offset(timer, 0),
-         timezone, tzname[0], tzname[1]);
+         tm.tm_zone ? tm.tm_zone : "");
 }
@@ -0,0 +1,282 @@
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <linux/rtc.h>
+
+#ifdef CLOCKD_INPROCESS_PRIVILEGED
+#include <sys/syscall.h>
+#include <linux/capability.h>
+#endif
+
+#include "logging.h"
+#include "rclockd.h"
+#include "privops.h"
+
+/*
+ * The operations that need privileges, run by rclockd or, when built
+ * with --enable-inprocess-privileged, by clockd itself. They return 0
+ * or an errno.
+ */
+
+#ifdef CLOCKD_INPROCESS_PRIVILEGED
+/*
+ * Sets the capabilities of the calling thread: CAP_SYS_TIME effective,
+ * CAP_DAC_OVERRIDE permitted and, around the accesses to what is not
+ * clockd's, effective too. Returns 0 or an errno.
+ */
+int
+privops_caps(bool dac_override)
+{
+  struct __user_cap_header_struct hdr;
+  struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+  int rv = 0;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memset(data, 0, sizeof(data));
+  hdr.version = _LINUX_CAPABILITY_VERSION_3;
+
+  data[CAP_TO_INDEX(CAP_SYS_TIME)].permitted |= CAP_TO_MASK(CAP_SYS_TIME);
+  data[CAP_TO_INDEX(CAP_SYS_TIME)].effective |= CAP_TO_MASK(CAP_SYS_TIME);
+  data[CAP_TO_INDEX(CAP_DAC_OVERRIDE)].permitted |=
+      CAP_TO_MASK(CAP_DAC_OVERRIDE);
+
+  if (dac_override)
+  {
+    data[CAP_TO_INDEX(CAP_DAC_OVERRIDE)].effective |=
+        CAP_TO_MASK(CAP_DAC_OVERRIDE);
+  }
+
+  if (syscall(SYS_capset, &hdr, data))
+  {
+    rv = errno;
+    DO_LOG(LOG_ERR, "capset() failed (%s)", strerror(errno));
+  }
+
+  return rv;
+}
+#else
+/* rclockd runs as root */
+#define privops_caps(dac_override) ((void)(dac_override))
+#endif
+
+int
+privops_set_rtc(time_t sec)
+{
+  struct tm tm;
+  int rv = 0;
+  int fd;
+
+  privops_caps(true);
+  fd = open("/dev/rtc", O_RDWR);
+  rv = fd == -1 ? errno : 0;
+  privops_caps(false);
+
+  if (fd != -1)
+  {
+    if (gmtime_r(&sec, &tm))
+    {
+      if (ioctl(fd, RTC_SET_TIME, &tm) < 0)
+      {
+        rv = errno;
+        DO_LOG(LOG_ERR, "ioctl(RTC_SET_TIME) error %s", strerror(errno));
+      }
+    }
+    else
+    {
+      rv = EINVAL;
+      DO_LOG(LOG_ERR, "gmtime() failed");
+    }
+
+    close(fd);
+  }
+  else
+    DO_LOG(LOG_ERR, "open(%s) error %s", "/dev/rtc", strerror(rv));
+
+  return rv;
+}
+
+int
+privops_set_time(const struct timespec *ts)
+{
+  int rv = 0;
+
+  if (clock_settime(CLOCK_REALTIME, ts))
+  {
+    rv = errno;
+    DO_LOG(LOG_ERR, "clock_settime() failed (%s)", strerror(errno));
+  }
+  else
+  {
+    DO_LOG(LOG_DEBUG, "time set successfully to %lld.%09ld",
+           (long long)ts->tv_sec, (long)ts->tv_nsec);
+  }
+
+  return rv;
+}
+
+int
+privops_set_tz(const char *s)
+{
+  char path[256];
+  struct stat stat_buf;
+  int rv = 0;
+
+  if (s[1] == '/')
+    snprintf(path, sizeof(path), "%s", s + 1);
+  else
+    snprintf(path, sizeof(path), "/usr/share/zoneinfo/%s", s + 1);
+
+  DO_LOG(LOG_DEBUG, "privops_set_tz(), path=%s", path);
+
+  if (!stat(path, &stat_buf))
+  {
+    privops_caps(true);
+    unlink("/etc/localtime.new");
+
+    /* replaced atomically, never missing */
+    if (!symlink(path, "/etc/localtime.new") &&
+        !rename("/etc/localtime.new", "/etc/localtime"))
+    {
+      DO_LOG(LOG_DEBUG, "timezone changed to '%s'", path);
+    }
+    else
+    {
+      rv = errno;
+      unlink("/etc/localtime.new");
+      DO_LOG(LOG_ERR, "privops_set_tz()/symlink, path=%s, %s", path,
+             strerror(rv));
+    }
+
+    privops_caps(false);
+  }
+  else
+  {
+    rv = errno;
+    DO_LOG(LOG_ERR, "privops_set_tz()/stat, path=%s, %s", path,
+           strerror(errno));
+  }
+
+  return rv;
+}
+
+/*
+ * Slews the system time by 'delta', replacing any slew in progress. The
+ * kernel does it at 500 ppm, a step cancels it.
+ */
+int
+privops_adj_time(const struct timespec *delta)
+{
+  struct timeval tv;
+  int rv = 0;
+
+  tv.tv_sec = delta->tv_sec;
+  tv.tv_usec = delta->tv_nsec / 1000;
+
+  if (adjtime(&tv, NULL))
+  {
+    rv = errno;
+    DO_LOG(LOG_ERR, "adjtime() failed (%s)", strerror(errno));
+  }
+  else
+  {
+    DO_LOG(LOG_DEBUG, "slewing time by %lld.%06ld",
+           (long long)tv.tv_sec, (long)tv.tv_usec);
+  }
+
+  return rv;
+}
+
+/*
+ * Waits for the system time to reach 'at' and sets the RTC to its second.
+ * ETIME if 'at' has passed or is more than two seconds away.
+ */
+int
+privops_set_rtc_at(const struct timespec *at)
+{
+  struct timespec now;
+  int rv;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  if (now.tv_sec > at->tv_sec ||
+      (now.tv_sec == at->tv_sec && now.tv_nsec > at->tv_nsec) ||
+      at->tv_sec - now.tv_sec > 2)
+  {
+    return ETIME;
+  }
+
+  do
+    rv = clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, at, NULL);
+  while (rv == EINTR);
+
+  if (rv)
+    return rv;
+
+  return privops_set_rtc(at->tv_sec);
+}
+
+/* runs an RCLOCKD_* operation, 'tz_status' is for RCLOCKD_SET_TIME_TZ */
+int
+privops_run(int op, const struct timespec *ts, const char *tz,
+            int *tz_status)
+{
+  switch (op)
+  {
+    case RCLOCKD_SET_TIME:
+    {
+      if (!ts || ts->tv_nsec < 0 || ts->tv_nsec >= 1000000000)
+        return EINVAL;
+
+      return privops_set_time(ts);
+    }
+    case RCLOCKD_SET_TZ:
+    {
+      if (!tz || !tz[0] || !tz[1])
+        return EINVAL;
+
+      return privops_set_tz(tz);
+    }
+    case RCLOCKD_SET_RTC:
+    {
+      if (!ts || (!ts->tv_sec && !ts->tv_nsec))
+        return privops_set_rtc(time(NULL));
+
+      if (ts->tv_nsec < 0 || ts->tv_nsec >= 1000000000)
+        return EINVAL;
+
+      return privops_set_rtc_at(ts);
+    }
+    case RCLOCKD_ADJ_TIME:
+    {
+      /* glibc takes up to about 2145 s */
+      if (!ts || ts->tv_nsec < 0 || ts->tv_nsec >= 1000000000 ||
+          ts->tv_sec < -2000 || ts->tv_sec >= 2000)
+      {
+        return EINVAL;
+      }
+
+      return privops_adj_time(ts);
+    }
+    case RCLOCKD_SET_TIME_TZ:
+    {
+      if (!tz_status)
+        return EINVAL;
+
+      /* both are tried, the time right after the zone */
+      *tz_status = privops_run(RCLOCKD_SET_TZ, NULL, tz, NULL);
+
+      return privops_run(RCLOCKD_SET_TIME, ts, NULL, NULL);
+    }
+    default:
+      return EINVAL;
+  }
+}
@@ -0,0 +1,18 @@
+#ifndef PRIVOPS_H
+#define PRIVOPS_H
+
+#include <time.h>
+#include <stdbool.h>
+
+int privops_set_time(const struct timespec *ts);
+int privops_set_rtc(time_t sec);
+int privops_set_rtc_at(const struct timespec *at);
+int privops_set_tz(const char *tz);
+int privops_adj_time(const struct timespec *delta);
+#ifdef CLOCKD_INPROCESS_PRIVILEGED
+int privops_caps(bool dac_override);
+#endif
+int privops_run(int op, const struct timespec *ts, const char *tz,
+                int *tz_status);
+
+#endif // PRIVOPS_H
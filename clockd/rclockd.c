@@ -1,8 +1,5 @@
-#include <sys/ioctl.h>
 #include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/time.h>
-#include <fcntl.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <time.h>
 #include <ctype.h>
@@ -11,9 +8,10 @@
 #include <errno.h>
 #include <string.h>
 
-#include <linux/rtc.h>
-
 #include "logging.h"
+#include "internal_time_utils.h"
+#include "rclockd.h"
+#include "privops.h"
 
 bool clockd_debug_mode = false;
 
@@ -34,106 +32,100 @@ set_uid(__uid_t uid, const char *f)
 static int
 set_time(const char *s)
 {
-  unsigned long sec = strtoul(s, 0, 10);
-  __uid_t uid = SET_UID(getuid());
-  struct timeval tv;
-  int rv = -1;
-
-  tv.tv_sec = sec;
-  tv.tv_usec = 0;
+  struct timespec ts;
+  int rv;
 
-  if (settimeofday(&tv, NULL))
-  {
-    time_t timer = sec;
-    int fd = open("/dev/rtc", O_RDWR);
+  ts.tv_sec = strtoul(s, 0, 10);
+  ts.tv_nsec = 0;
 
-    if (fd != -1)
-    {
-      struct tm *tm = gmtime(&timer);
-
-      if (tm)
-      {
-        if (ioctl(fd, RTC_SET_TIME, tm) >= 0)
-        {
-          rv = 0;
-          DO_LOG(LOG_DEBUG, "time set successfully to %lu", sec);
-        }
-        else
-          DO_LOG(LOG_ERR, "ioctl(RTC_SET_TIME) error %s", strerror(errno));
-      }
-      else
-        DO_LOG(LOG_ERR, "gmtime() failed");
-
-      close(fd);
-    }
-    else
-      DO_LOG(LOG_ERR, "open(%s) error %s", "/dev/rtc", strerror(errno));
-  }
-  else
-    DO_LOG(LOG_ERR, "settimeofday() failed (%s)", strerror(errno));
+  rv = privops_set_time(&ts);
 
-  SET_UID(uid);
+  /* the system time is set, a missing RTC is not an error */
+  if (!rv)
+    privops_set_rtc(ts.tv_sec);
 
   return rv;
 }
 
+/* serves clockd on 'fd' until clockd closes it */
 static int
-set_tz(const char *s)
+serve(int fd)
 {
-  char path[256];
-  struct stat stat_buf;
-  __uid_t uid = SET_UID(getuid());
-  int rv = -1;
+  struct rclockd_req req;
+  struct rclockd_rsp rsp;
+  ssize_t len;
 
-  if (s[1] == '/')
-    snprintf(path, sizeof(path), "%s", s + 1);
-  else
-    snprintf(path, sizeof(path), "/usr/share/zoneinfo/%s", s + 1);
+  while (1)
+  {
+    len = recv(fd, &req, sizeof(req), 0);
 
-  DO_LOG(LOG_DEBUG, "set_tz(), path=%s", path);
+    if (len == -1 && errno == EINTR)
+      continue;
 
-  if (stat(path, &stat_buf))
-  {
-    rename("/etc/localtime", "/etc/localtime.save");
+    if (len <= 0)
+      break;
 
-    if (!symlink(path, "/etc/localtime"))
-    {
-      rv = 0;
-      DO_LOG(LOG_DEBUG, "timezone changed to '%s'", path);
-    }
+    memset(&rsp, 0, sizeof(rsp));
+    rsp.version = RCLOCKD_VERSION;
+    rsp.op = req.op;
+    rsp.seq = req.seq;
+
+    if (len != sizeof(req) || req.version != RCLOCKD_VERSION)
+      rsp.status = EPROTO;
     else
     {
-      int st = rename("/etc/localtime.save", "/etc/localtime");
-
-      DO_LOG(LOG_ERR, "set_tz()/symlink (%s), path=%s, %s",
-             st ? "not recovered" : "recovered", path, strerror(errno));
+      struct timespec ts;
+      int tz_status = 0;
+
+      ts.tv_sec = req.sec;
+      ts.tv_nsec = req.nsec;
+      req.tz[sizeof(req.tz) - 1] = 0;
+      rsp.status = privops_run(req.op, &ts, req.tz, &tz_status);
+      rsp.tz_status = tz_status;
     }
-  }
-  else
-    DO_LOG(LOG_ERR, "set_tz()/stat, path=%s, %s", path, strerror(errno));
 
-  SET_UID(uid);
+    if (send(fd, &rsp, sizeof(rsp), MSG_NOSIGNAL) != sizeof(rsp))
+      break;
+  }
 
-  return rv;
+  return len ? 1 : 0;
 }
 
 int main(int argc, char **argv)
 {
-  int rv;
+  int rv = 0;
+  int i;
 
-  if (argc != 3 || strcmp(argv[1], "clockd"))
+  if (argc < 3 || strcmp(argv[1], "clockd"))
   {
     fprintf(stderr, "%s is for clockd usage only\n", argv[0]);
     exit(2);
   }
 
-  if (isdigit(argv[2][0]))
-    rv = set_time(argv[2]);
-  else
-    rv = set_tz(argv[2]);
+  if (argc == 3 && !strcmp(argv[2], "--serve"))
+  {
+    if (getuid() && setuid(0))
+    {
+      DO_LOG(LOG_ERR, "setuid(0) failed %s", strerror(errno));
+      exit(1);
+    }
 
-  if (!rv)
-    exit(0);
+    exit(serve(STDIN_FILENO));
+  }
+
+  SET_UID(getuid());
+
+  /* zone and/or time, in one run */
+  for (i = 2; i < argc; i++)
+  {
+    if (isdigit(argv[i][0]))
+    {
+      if (set_time(argv[i]))
+        rv |= INTERNAL_SET_TIME_FAILED;
+    }
+    else if (privops_set_tz(argv[i]))
+      rv |= INTERNAL_SET_TZ_FAILED;
+  }
 
-  exit(1);
+  exit(rv);
 }
@@ -0,0 +1,46 @@
+#ifndef RCLOCKD_H
+#define RCLOCKD_H
+
+#include <stdint.h>
+
+/*
+ * Protocol between clockd and "rclockd clockd --serve", which keeps
+ * running with clockd's end of a SOCK_SEQPACKET socketpair as stdin.
+ * One packet per request and per response, fixed layout. The status is
+ * 0 or the errno of the failed operation.
+ */
+
+#define RCLOCKD_PATH "/usr/bin/rclockd"
+#define RCLOCKD_VERSION 2
+#define RCLOCKD_TZ_SIZE 256
+
+enum rclockd_op
+{
+  RCLOCKD_SET_TIME = 1,  /* CLOCK_REALTIME to sec.nsec */
+  RCLOCKD_SET_TZ,        /* /etc/localtime to tz */
+  RCLOCKD_SET_RTC,       /* RTC to the system time, at sec.nsec if set */
+  RCLOCKD_ADJ_TIME,      /* slew CLOCK_REALTIME by sec.nsec, may be < 0 */
+  RCLOCKD_SET_TIME_TZ    /* /etc/localtime to tz, then CLOCK_REALTIME */
+};
+
+struct rclockd_req
+{
+  uint16_t version;
+  uint16_t op;
+  uint32_t seq;
+  int64_t sec;
+  int32_t nsec;
+  int32_t reserved;
+  char tz[RCLOCKD_TZ_SIZE];
+};
+
+struct rclockd_rsp
+{
+  uint16_t version;
+  uint16_t op;
+  uint32_t seq;
+  int32_t status;
+  int32_t tz_status;     /* RCLOCKD_SET_TIME_TZ zone, 'status' is the time */
+};
+
+#endif // RCLOCKD_H
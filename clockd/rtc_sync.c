@@ -0,0 +1,258 @@
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "logging.h"
+#include "internal_time_utils.h"
+#include "worker.h"
+#include "rtc_sync.h"
+
+/*
+ * Writes the RTC from the system time. Requests are coalesced into one
+ * write, no sooner than RTC_SYNC_MIN_INTERVAL after the previous one. The
+ * write is queued RTC_SYNC_LEAD ms before a second boundary and done
+ * exactly at it, the RTC only keeps whole seconds. Besides requests, the
+ * RTC is written every 'period' seconds.
+ */
+
+#define RTC_SYNC_LEAD 50
+#define RTC_SYNC_MIN_INTERVAL 10
+
+struct rtc_sync_job
+{
+  struct timespec at;
+  int64_t latency;  /* ns from 'at' to the end of the write */
+};
+
+struct rtc_sync_stats
+{
+  unsigned int writes;
+  unsigned int failures;
+  unsigned int missed;
+  unsigned int coalesced;
+  int64_t latency_min;
+  int64_t latency_max;
+  int64_t latency_sum;
+};
+
+static rtc_sync_written_func rtc_written = NULL;
+static bool rtc_dirty = false;
+static bool rtc_running = false;
+static guint rtc_timer_id = 0;
+static guint rtc_period_id = 0;
+static gint64 rtc_last_write = 0;
+static struct rtc_sync_stats stats;
+
+static void rtc_sync_schedule(void);
+
+static int64_t
+rtc_sync_ns(clockid_t clock_id)
+{
+  struct timespec ts;
+
+  clock_gettime(clock_id, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+rtc_sync_job(void *data)
+{
+  struct rtc_sync_job *job = data;
+  int64_t at = (int64_t)job->at.tv_sec * 1000000000 + job->at.tv_nsec;
+  int64_t at_mono = rtc_sync_ns(CLOCK_MONOTONIC) +
+      (at - rtc_sync_ns(CLOCK_REALTIME));
+  int rv = internal_set_rtc(&job->at);
+
+  job->latency = rtc_sync_ns(CLOCK_MONOTONIC) - at_mono;
+
+  return rv;
+}
+
+static void
+rtc_sync_done(int rv, void *data)
+{
+  struct rtc_sync_job *job = data;
+  int64_t us = job->latency / 1000;
+
+  rtc_running = false;
+
+  if (!rv)
+  {
+    if (!stats.writes || us < stats.latency_min)
+      stats.latency_min = us;
+
+    if (us > stats.latency_max)
+      stats.latency_max = us;
+
+    stats.latency_sum += us;
+    stats.writes++;
+    rtc_last_write = g_get_monotonic_time();
+    DO_LOG(LOG_DEBUG, "RTC set to %lld, took %lld us",
+           (long long)job->at.tv_sec, (long long)us);
+
+    if (rtc_written)
+      rtc_written(job->at.tv_sec);
+  }
+  else if (rv == ETIME)
+  {
+    /* the worker was busy past the second, try the next one */
+    stats.missed++;
+    rtc_dirty = true;
+  }
+  else
+  {
+    stats.failures++;
+    DO_LOG(LOG_WARNING, "RTC not set (%s)", strerror(rv));
+  }
+
+  rtc_sync_schedule();
+}
+
+static gboolean
+rtc_sync_timer(gpointer user_data)
+{
+  struct rtc_sync_job *job;
+  struct timespec now;
+
+  rtc_timer_id = 0;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  /* woken up early or late, the worker must not wait most of a second */
+  if (1000000000 - now.tv_nsec > 2 * RTC_SYNC_LEAD * 1000000)
+  {
+    rtc_sync_schedule();
+    return FALSE;
+  }
+
+  job = g_new0(struct rtc_sync_job, 1);
+  job->at.tv_sec = now.tv_sec + 1;
+  rtc_dirty = false;
+  rtc_running = true;
+  worker_push(rtc_sync_job, rtc_sync_done, job, g_free);
+
+  return FALSE;
+}
+
+static void
+rtc_sync_schedule(void)
+{
+  struct timespec now;
+  gint64 wait;
+  gint64 since;
+
+  if (!rtc_dirty || rtc_running || rtc_timer_id)
+    return;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  wait = (1000000000 - now.tv_nsec) / 1000000 - RTC_SYNC_LEAD;
+
+  if (wait < 0)
+    wait += 1000;
+
+  since = g_get_monotonic_time() - rtc_last_write;
+
+  if (rtc_last_write && since < RTC_SYNC_MIN_INTERVAL * G_USEC_PER_SEC)
+  {
+    /* whole seconds keep the alignment */
+    wait += ((RTC_SYNC_MIN_INTERVAL * G_USEC_PER_SEC - since) /
+             G_USEC_PER_SEC + 1) * 1000;
+  }
+
+  rtc_timer_id = g_timeout_add(wait, rtc_sync_timer, NULL);
+}
+
+/* at quit, aligned unless the worker gets to it too late */
+static int
+rtc_sync_last(void *data)
+{
+  struct rtc_sync_job *job = data;
+  int rv = internal_set_rtc(&job->at);
+
+  if (rv == ETIME)
+    rv = internal_set_rtc(NULL);
+
+  return rv;
+}
+
+static gboolean
+rtc_sync_periodic(gpointer user_data)
+{
+  rtc_dirty = true;
+  rtc_sync_schedule();
+
+  return TRUE;
+}
+
+/* the system time has been set */
+void
+rtc_sync_request(void)
+{
+  if (rtc_dirty || rtc_running)
+    stats.coalesced++;
+
+  rtc_dirty = true;
+  rtc_sync_schedule();
+}
+
+/*
+ * Every 'period' seconds the RTC is written anyway, 0 for never.
+ * 'written' is called after each write.
+ */
+void
+rtc_sync_init(unsigned int period, rtc_sync_written_func written)
+{
+  memset(&stats, 0, sizeof(stats));
+  rtc_written = written;
+
+  if (period)
+    rtc_period_id = g_timeout_add_seconds(period, rtc_sync_periodic, NULL);
+}
+
+/*
+ * Before worker_quit(). With 'flush' or a write pending, the RTC is
+ * written at the next second. Returns the time it is written at, 0 if
+ * it is not.
+ */
+time_t
+rtc_sync_quit(bool flush)
+{
+  time_t at = 0;
+
+  if (rtc_period_id)
+  {
+    g_source_remove(rtc_period_id);
+    rtc_period_id = 0;
+  }
+
+  if (rtc_timer_id)
+  {
+    g_source_remove(rtc_timer_id);
+    rtc_timer_id = 0;
+  }
+
+  if (flush || rtc_dirty)
+  {
+    struct rtc_sync_job *job = g_new0(struct rtc_sync_job, 1);
+
+    clock_gettime(CLOCK_REALTIME, &job->at);
+    job->at.tv_sec++;
+    job->at.tv_nsec = 0;
+    at = job->at.tv_sec;
+    worker_push(rtc_sync_last, NULL, job, g_free);
+    rtc_dirty = false;
+  }
+
+  DO_LOG(LOG_INFO, "RTC writes %u, failed %u, missed %u, coalesced %u, "
+         "latency min/avg/max %lld/%lld/%lld us", stats.writes,
+         stats.failures, stats.missed, stats.coalesced,
+         (long long)stats.latency_min,
+         (long long)(stats.writes ? stats.latency_sum / stats.writes : 0),
+         (long long)stats.latency_max);
+
+  return at;
+}
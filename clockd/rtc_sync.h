@@ -0,0 +1,14 @@
+#ifndef RTC_SYNC_H
+#define RTC_SYNC_H
+
+#include <stdbool.h>
+#include <time.h>
+
+/* the RTC has been set to the system time at 'at' */
+typedef void (*rtc_sync_written_func)(time_t at);
+
+void rtc_sync_init(unsigned int period, rtc_sync_written_func written);
+time_t rtc_sync_quit(bool flush);
+void rtc_sync_request(void);
+
+#endif // RTC_SYNC_H
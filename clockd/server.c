@@ -12,6 +12,10 @@
 #include <time.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <grp.h>
 
 #include <glib.h>
 #include <dbus/dbus-glib-lowlevel.h>
@@ -23,20 +27,35 @@
 #include "logging.h"
 #include "server.h"
 #include "clock_dbus.h"
+#include "libtime.h"
 #include "mcc_tz_utils.h"
 #include "internal_time_utils.h"
+#include "worker.h"
+#include "sock_server.h"
+#include "state.h"
+#include "conf_watch.h"
+#include "zone_index.h"
+#include "rtc_sync.h"
+#include "drift.h"
+#include "slew.h"
 
 #define CLOCKD_CONFIGURATION_FILE "/home/user/.clockd.conf"
+#define CLOCKD_CONFIGURATION_SIZE 1024
 
 struct server_callback
 {
   const char *member;
   DBusMessage *(*callback)(DBusMessage *method_call);
+  /* callback only uses the state snapshot, may run in the reader thread */
+  bool reader;
+  /* changes state, rate limited per sender and run after cheaper requests */
+  bool limited;
 };
 
 static DBusMessage *server_activate_net_time_cb(DBusMessage *msg);
 static DBusMessage *server_is_net_time_changed_cb(DBusMessage *msg);
 static DBusMessage *server_set_time_cb(DBusMessage *msg);
+static DBusMessage *server_set_time_ex_cb(DBusMessage *msg);
 static DBusMessage *server_set_tz_cb(DBusMessage *msg);
 static DBusMessage *server_set_autosync_cb(DBusMessage *msg);
 static DBusMessage *server_set_time_format_cb(DBusMessage *msg);
@@ -46,12 +65,18 @@ static DBusMessage *server_get_tz_cb(DBusMessage *msg);
 static DBusMessage *server_get_autosync_cb(DBusMessage *msg);
 static DBusMessage *server_have_opertime_cb(DBusMessage *msg);
 static DBusMessage *server_get_time_cb(DBusMessage *msg);
+static DBusMessage *server_subscribe_cb(DBusMessage *msg);
+static DBusMessage *server_apply_settings_cb(DBusMessage *msg);
 
 static int server_set_time(time_t tick);
 static void next_dst_change(time_t tick, bool keep_alarm_timer);
 static void server_set_operator_tz_cb(const char *tz);
 static int set_network_time(bool save_config);
 static int set_net_timezone(const char *tzname);
+static void server_send_reply(DBusConnection *conn, DBusMessage *reply);
+static void server_schedule_flush(void);
+static void server_commit(void);
+static void server_conf_reload(void);
 
 static bool net_time_setting = false;
 static bool autosync = false;
@@ -59,6 +84,13 @@ static bool was_dst = false;
 static bool net_time_disabled_env = false;
 static time_t net_time_changed_time = 0;
 static clock_t net_time_last_changed_ticks = 0;
+/* last network time and the system time it came at, kept in the state */
+static time_t nitz_time = 0;
+static time_t nitz_received = 0;
+/* RTC drift and the last RTC write, kept in the state */
+static struct drift drift;
+static time_t rtc_written = 0;
+static char boot_id[40];
 static guint alarm_timer_id;
 
 static char saved_server_opertime_tz[CLOCKD_TZ_SIZE] = {0,};
@@ -67,26 +99,188 @@ static char restore_tz[CLOCKD_TZ_SIZE] = {0,};
 static char default_tz[CLOCKD_TZ_SIZE] = {0,};
 static char time_format[CLOCKD_GET_TIMEFMT_SIZE] = {0,};
 
+/* shared, for the csd and mce signals clockd listens to */
 static DBusConnection *dbus_connection = NULL;
+/* owns com.nokia.clockd: methods and every signal clockd sends */
 static DBusConnection *dbus_system_connection = NULL;
 
+enum server_reply_id
+{
+  SERVER_REPLY_TZ,
+  SERVER_REPLY_TIMEFMT,
+  SERVER_REPLY_DEFAULT_TZ,
+  SERVER_REPLY_AUTOSYNC,
+  SERVER_REPLY_HAVE_OPERTIME,
+  SERVER_REPLY_COUNT
+};
+
+/*
+ * Immutable copy of the state served by getters, with the replies
+ * pre-marshalled. Replaced as a whole on every change.
+ */
+struct server_snapshot
+{
+  gint ref;
+  char tz[CLOCKD_TZ_SIZE];
+  char time_format[CLOCKD_GET_TIMEFMT_SIZE];
+  char default_tz[CLOCKD_TZ_SIZE];
+  bool autosync;
+  bool have_opertime;
+  DBusMessage *replies[SERVER_REPLY_COUNT];
+};
+
+static struct server_snapshot *snapshot = NULL;
+static GMutex snapshot_lock;
+
+/* reader thread serving the method connection */
+static GThread *reader_thread = NULL;
+static GMainContext *reader_context = NULL;
+static GMainLoop *reader_loop = NULL;
+static guint reader_flush_id = 0;
+
+/* setter token bucket of a D-Bus sender or socket uid, reader thread only */
+struct server_bucket
+{
+  double tokens;
+  gint64 stamp;
+  guint throttled;
+};
+
+#define SERVER_BUCKET_BURST 10.0
+/* tokens per second */
+#define SERVER_BUCKET_RATE 2.0
+/* senders tracked before the idle ones are dropped */
+#define SERVER_BUCKET_MAX 64
+
+static GHashTable *buckets = NULL;
+static guint requests_admitted = 0;
+static guint requests_throttled = 0;
+
+/* besides root, this user may use setters over the socket */
+static uid_t sock_setter_uid = 0;
+
+struct server_sock_req
+{
+  struct sock_client *client;
+  struct clock_sock_req req;
+};
+
 static const struct server_callback server_callbacks[] =
 {
-  {CLOCKD_SET_TIME, server_set_time_cb},
-  {CLOCKD_GET_TIME, server_get_time_cb},
-  {CLOCKD_ACTIVATE_NET_TIME, server_activate_net_time_cb},
-  {CLOCKD_NET_TIME_CHANGED, server_is_net_time_changed_cb},
-  {CLOCKD_GET_TIMEFMT, server_get_time_format_cb},
-  {CLOCKD_SET_TIMEFMT, server_set_time_format_cb},
-  {CLOCKD_GET_DEFAULT_TZ, server_get_default_tz_cb},
-  {CLOCKD_GET_TZ, server_get_tz_cb},
-  {CLOCKD_SET_TZ, server_set_tz_cb},
-  {CLOCKD_GET_AUTOSYNC, server_get_autosync_cb},
-  {CLOCKD_SET_AUTOSYNC, server_set_autosync_cb},
-  {CLOCKD_HAVE_OPERTIME, server_have_opertime_cb},
-  {NULL, NULL}
+  {CLOCKD_SET_TIME, server_set_time_cb, false, true},
+  {CLOCKD_SET_TIME_EX, server_set_time_ex_cb, false, true},
+  {CLOCKD_GET_TIME, server_get_time_cb, true, false},
+  {CLOCKD_ACTIVATE_NET_TIME, server_activate_net_time_cb, false, true},
+  {CLOCKD_NET_TIME_CHANGED, server_is_net_time_changed_cb, false, false},
+  {CLOCKD_GET_TIMEFMT, server_get_time_format_cb, true, false},
+  {CLOCKD_SET_TIMEFMT, server_set_time_format_cb, false, true},
+  {CLOCKD_GET_DEFAULT_TZ, server_get_default_tz_cb, true, false},
+  {CLOCKD_GET_TZ, server_get_tz_cb, true, false},
+  {CLOCKD_SET_TZ, server_set_tz_cb, false, true},
+  {CLOCKD_GET_AUTOSYNC, server_get_autosync_cb, true, false},
+  {CLOCKD_SET_AUTOSYNC, server_set_autosync_cb, false, true},
+  {CLOCKD_HAVE_OPERTIME, server_have_opertime_cb, true, false},
+  {CLOCKD_SUBSCRIBE, server_subscribe_cb, false, false},
+  {CLOCKD_APPLY_SETTINGS, server_apply_settings_cb, false, true},
+  {NULL, NULL, false, false}
+};
+
+/* power of two, larger than the number of methods */
+#define SERVER_METHOD_SLOTS 32
+
+static const struct server_callback *server_methods[SERVER_METHOD_SLOTS];
+static unsigned int server_method_seed;
+static guint flush_id = 0;
+
+/* changes to notify when the replies are flushed, CLOCKD_CHANGE_* */
+static unsigned int change_mask = 0;
+static time_t change_time = 0;
+
+/*
+ * time_changed_ex state. The generation is saved with the state, signals
+ * sent after the last save are lost with a crash: a start skips ahead.
+ */
+#define CHANGE_GENERATION_SKIP 0x10000
+static dbus_uint64_t change_generation = 0;
+static int64_t change_step_base = 0;
+
+/* unique name -> CLOCKD_CHANGE_* mask, main thread only */
+static GHashTable *subscribers = NULL;
+
+#define SERVER_MAX_SUBSCRIBERS 256
+#define NAME_OWNER_MATCH_RULE \
+  "type='signal',sender='" DBUS_SERVICE_DBUS "'," \
+  "interface='" DBUS_INTERFACE_DBUS "',member='NameOwnerChanged'," \
+  "arg0='%s',arg2=''"
+
+/* returned by a method callback that replies later */
+static char server_rsp_deferred;
+#define SERVER_RSP_DEFERRED ((DBusMessage *)&server_rsp_deferred)
+
+struct server_conf
+{
+  struct state state;
+  uid_t uid;
+  gid_t gid;
+};
+
+#define CONF_TIME_FORMAT 0x01
+#define CONF_AUTOSYNC    0x02
+#define CONF_NET_TZ      0x04
+#define CONF_RESTORE_TZ  0x08
+
+/* values read from .clockd.conf, 'have' tells which were there */
+struct conf_values
+{
+  unsigned int have;
+  char time_format[CLOCKD_GET_TIMEFMT_SIZE];
+  bool autosync;
+  char net_tz[CLOCKD_TZ_SIZE];
+  char restore_tz[CLOCKD_TZ_SIZE];
+};
+
+/* set_time request, from D-Bus ('msg') or from the socket ('client') */
+struct server_set_time_req
+{
+  DBusMessage *msg;
+  struct sock_client *client;
+  uint32_t seq;
+  int64_t realtime_ns;
+  int64_t monotonic_ns;  /* when realtime_ns was valid */
+};
+
+/* mutations waiting for server_commit() */
+struct server_commit
+{
+  unsigned int mask;
+  bool save;
+  bool set_time;
+  int64_t realtime_ns;
+  int64_t monotonic_ns;
+  time_t tick;  /* the time set, in seconds */
+  char tz[CLOCKD_TZ_SIZE];
+  GSList *time_reqs;
 };
 
+static struct server_commit pending;
+static guint commit_id = 0;
+/* ms to collect changes before committing them, CLOCKD_COMMIT_DELAY */
+static guint commit_delay = 0;
+
+static guint save_id = 0;
+/* ms to collect changes before writing the configuration, CLOCKD_SAVE_DELAY */
+static guint save_delay = 2000;
+/* save jobs pushed to the worker and not done yet */
+static guint saves_running = 0;
+/* a reload waits for them */
+static bool conf_reload_deferred = false;
+/* text of our last configuration write, set by the worker */
+static GMutex conf_written_lock;
+static char conf_written[CLOCKD_CONFIGURATION_SIZE];
+/* owner of the configuration file, user:users */
+static uid_t conf_uid = (uid_t)-1;
+static gid_t conf_gid = (gid_t)-1;
+
 static DBusMessage *
 server_new_rsp(DBusMessage *msg, int type, ...)
 {
@@ -102,6 +296,133 @@ server_new_rsp(DBusMessage *msg, int type, ...)
   return rsp;
 }
 
+static DBusMessage *
+server_new_template(int type, const void *value)
+{
+  DBusMessage *msg = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+
+  if (msg)
+  {
+    dbus_message_set_no_reply(msg, TRUE);
+
+    if (!dbus_message_append_args(msg, type, value, DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref(msg);
+      msg = NULL;
+    }
+  }
+
+  return msg;
+}
+
+static void
+server_snapshot_unref(struct server_snapshot *snap)
+{
+  int i;
+
+  if (!g_atomic_int_dec_and_test(&snap->ref))
+    return;
+
+  for (i = 0; i < SERVER_REPLY_COUNT; i++)
+  {
+    if (snap->replies[i])
+      dbus_message_unref(snap->replies[i]);
+  }
+
+  g_free(snap);
+}
+
+static struct server_snapshot *
+server_snapshot_get(void)
+{
+  struct server_snapshot *snap;
+
+  g_mutex_lock(&snapshot_lock);
+  snap = snapshot;
+
+  if (snap)
+    g_atomic_int_inc(&snap->ref);
+
+  g_mutex_unlock(&snapshot_lock);
+
+  return snap;
+}
+
+static void
+server_snapshot_set(struct server_snapshot *snap)
+{
+  struct server_snapshot *old;
+
+  g_mutex_lock(&snapshot_lock);
+  old = snapshot;
+  snapshot = snap;
+  g_mutex_unlock(&snapshot_lock);
+
+  if (old)
+    server_snapshot_unref(old);
+}
+
+/* main thread only, call whenever a value served by a getter changes */
+static void
+server_state_changed(void)
+{
+  struct server_snapshot *snap = g_new0(struct server_snapshot, 1);
+  const char *s;
+  dbus_bool_t b;
+
+  snap->ref = 1;
+  snprintf(snap->tz, sizeof(snap->tz), "%s", server_tz);
+  snprintf(snap->time_format, sizeof(snap->time_format), "%s", time_format);
+  snprintf(snap->default_tz, sizeof(snap->default_tz), "%s", default_tz);
+  snap->autosync = autosync;
+  snap->have_opertime = net_time_setting;
+
+  s = snap->tz;
+  snap->replies[SERVER_REPLY_TZ] = server_new_template(DBUS_TYPE_STRING, &s);
+  s = snap->time_format;
+  snap->replies[SERVER_REPLY_TIMEFMT] =
+      server_new_template(DBUS_TYPE_STRING, &s);
+  s = snap->default_tz;
+  snap->replies[SERVER_REPLY_DEFAULT_TZ] =
+      server_new_template(DBUS_TYPE_STRING, &s);
+  b = snap->autosync;
+  snap->replies[SERVER_REPLY_AUTOSYNC] =
+      server_new_template(DBUS_TYPE_BOOLEAN, &b);
+  b = snap->have_opertime;
+  snap->replies[SERVER_REPLY_HAVE_OPERTIME] =
+      server_new_template(DBUS_TYPE_BOOLEAN, &b);
+
+  server_snapshot_set(snap);
+}
+
+/* copies the pre-marshalled reply of the current snapshot, thread safe */
+static DBusMessage *
+server_cached_rsp(DBusMessage *msg, enum server_reply_id id)
+{
+  struct server_snapshot *snap = server_snapshot_get();
+  DBusMessage *rsp = NULL;
+
+  if (snap && snap->replies[id])
+    rsp = dbus_message_copy(snap->replies[id]);
+
+  if (snap)
+    server_snapshot_unref(snap);
+
+  if (rsp)
+  {
+    const char *sender = dbus_message_get_sender(msg);
+
+    if (!dbus_message_set_reply_serial(rsp, dbus_message_get_serial(msg)) ||
+        (sender && !dbus_message_set_destination(rsp, sender)))
+    {
+      dbus_message_unref(rsp);
+      rsp = NULL;
+    }
+  }
+
+  return rsp;
+}
+
 static int
 server_send_time_change_indication(time_t t)
 {
@@ -120,7 +441,7 @@ server_send_time_change_indication(time_t t)
     if (dbus_message_append_args(msg, DBUS_TYPE_INT64, &dbus64_tick,
                                  DBUS_TYPE_INVALID))
     {
-      if (dbus_connection_send(dbus_connection, msg, 0))
+      if (dbus_connection_send(dbus_system_connection, msg, 0))
         DO_LOG(LOG_DEBUG, "sent D-Bus signal %s", "changed");
       else
         DO_LOG(LOG_ERR, "dbus_connection_send failed");
@@ -142,7 +463,7 @@ server_send_time_change_indication(time_t t)
     if (dbus_message_append_args(msg, DBUS_TYPE_INT32, &dbus32_tick,
                                  DBUS_TYPE_INVALID))
     {
-      if (dbus_connection_send(dbus_connection, msg, 0))
+      if (dbus_connection_send(dbus_system_connection, msg, 0))
       {
         DO_LOG(LOG_DEBUG, "sent D-Bus signal %s", "time_changed");
         rv = 0;
@@ -161,168 +482,711 @@ server_send_time_change_indication(time_t t)
   return rv;
 }
 
-static int save_conf()
+/* 0 if 'path' holds exactly 'len' bytes of 'buf' */
+static int
+conf_compare(const char *path, const char *buf, size_t len)
 {
-  FILE *fp;
-  char buf[256];
-  int rv;
+  char old[CLOCKD_CONFIGURATION_SIZE];
+  ssize_t bytes;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
 
-  unlink(CLOCKD_CONFIGURATION_FILE);
+  if (fd == -1)
+    return -1;
 
-  fp = fopen(CLOCKD_CONFIGURATION_FILE, "w");
+  bytes = read(fd, old, sizeof(old));
+  close(fd);
 
-  if (!fp)
-  {
-    DO_LOG(LOG_ERR, "failed to open configuration file %s (%s)",
-           CLOCKD_CONFIGURATION_FILE, strerror(errno));
+  if (bytes < 0 || (size_t)bytes != len)
     return -1;
-  }
 
-  snprintf(buf, sizeof(buf), "/bin/chown user:users %s",
-           CLOCKD_CONFIGURATION_FILE);
+  return memcmp(old, buf, len);
+}
 
-  if (system(buf) == -1)
-    DO_LOG(LOG_ERR, "execute %s failed(%s)", buf, strerror(errno));
+/*
+ * Saves the state record and exports it to the text configuration, which
+ * osso-backup saves and restores. The text is only written if it changed.
+ */
+static int
+save_conf_job(void *data)
+{
+  struct server_conf *conf = data;
+  char buf[CLOCKD_CONFIGURATION_SIZE];
+  char link[256];
+  int len;
+  int rv = 0;
 
-  memset(buf, 0, sizeof(buf));
+  memset(link, 0, sizeof(link));
 
-  if (readlink("/etc/localtime", buf, sizeof(buf)) <= 0 ||
-      !strcmp(buf, "/etc/localtime"))
+  if (readlink("/etc/localtime", link, sizeof(link) - 1) <= 0 ||
+      !strcmp(link, "/etc/localtime"))
   {
-    buf[0] = 0;
+    link[0] = 0;
   }
 
-  rv = fprintf(fp, "time_format=%s\nautosync=%d\nnet_tz=%s\nsystem_tz=%s\n",
-               time_format, (int)autosync, server_tz[0] == ':' ? "" : server_tz, buf);
-  if (rv == -1)
+  len = snprintf(buf, sizeof(buf),
+                 "time_format=%s\nautosync=%d\nnet_tz=%s\nsystem_tz=%s\n",
+                 conf->state.time_format, conf->state.autosync,
+                 conf->state.tz, link);
+
+  if (len < 0 || (size_t)len >= sizeof(buf))
   {
-    DO_LOG(LOG_ERR, "failed to write %s (%s)", CLOCKD_CONFIGURATION_FILE,
-           strerror(errno));
+    DO_LOG(LOG_ERR, "configuration too long");
+    rv = -1;
+  }
+  else if (!conf_compare(CLOCKD_CONFIGURATION_FILE, buf, len))
+  {
+    DO_LOG(LOG_DEBUG, "configuration file %s unchanged",
+           CLOCKD_CONFIGURATION_FILE);
+  }
+  else if (state_replace_file(CLOCKD_CONFIGURATION_FILE, buf, len, conf->uid,
+                              conf->gid))
+  {
+    rv = -1;
   }
   else
   {
-    rv = 0;
-    DO_LOG(LOG_DEBUG, "configuration file %s saved", CLOCKD_CONFIGURATION_FILE);
+    DO_LOG(LOG_DEBUG, "configuration file %s saved",
+           CLOCKD_CONFIGURATION_FILE);
+  }
+
+  /* for server_conf_reload() to recognize our own write */
+  if (!rv)
+  {
+    g_mutex_lock(&conf_written_lock);
+    memcpy(conf_written, buf, len + 1);
+    g_mutex_unlock(&conf_written_lock);
   }
 
-  fclose(fp);
+  /* after the text, a newer state file means the text was imported */
+  if (state_save(&conf->state))
+    rv = -1;
 
   return rv;
 }
 
 static int
-handle_csd_net_time_change(DBusMessage *msg)
+zone_exists(const char *tz)
 {
-  bool time_changed;
-  bool tz_changed;
-  int rv = -1;
-  /* diff, quarters of an hour, between the local time and GMT, ‑47...+48 */
-  int tz_q;
-  int is_dst;
-  char buf[64] = {0, };
-  DBusMessageIter iter;
-  struct tm tm_net;
-  struct tm tm_utc;
-  struct tm tm_old;
-  char etc_gmt[] = "Etc/GMT";
-  char *tz = NULL;
-  time_t time_utc;
-  time_t now;
-  char *old_tz = NULL;
+  char path[256];
+  struct stat stat_buf;
+  int rv = zone_index_find(tz, NULL);
 
-  memset(&tm_net, 0, sizeof(tm_net));
-  dbus_message_iter_init(msg, &iter);
+  if (rv != -1)
+    return rv;
 
-  if (decode_ctm(&iter, &tm_net) == -1)
+  if (tz[1] == '/')
+    snprintf(path, sizeof(path), "%s", tz + 1);
+  else
+    snprintf(path, sizeof(path), "/usr/share/zoneinfo/%s", tz + 1);
+
+  return !stat(path, &stat_buf);
+}
+
+static void
+server_send_subscribers(unsigned int mask, time_t t)
+{
+  dbus_int64_t dbus_tick = t;
+  GHashTableIter iter;
+  gpointer name;
+  gpointer value;
+
+  if (!subscribers || !dbus_system_connection)
+    return;
+
+  g_hash_table_iter_init(&iter, subscribers);
+
+  while (g_hash_table_iter_next(&iter, &name, &value))
   {
-    DO_LOG(LOG_ERR, "handle_csd_net_time_change(), decode_ctm failed");
-    goto out;
+    dbus_uint32_t dbus_mask = mask & GPOINTER_TO_UINT(value);
+    DBusMessage *msg;
+
+    if (!dbus_mask)
+      continue;
+
+    msg = dbus_message_new_signal(CLOCKD_PATH, CLOCKD_INTERFACE,
+                                  CLOCKD_CHANGED);
+
+    if (msg && dbus_message_set_destination(msg, name) &&
+        dbus_message_append_args(msg, DBUS_TYPE_UINT32, &dbus_mask,
+                                 DBUS_TYPE_INT64, &dbus_tick,
+                                 DBUS_TYPE_INVALID))
+    {
+      if (!dbus_connection_send(dbus_system_connection, msg, NULL))
+        DO_LOG(LOG_ERR, "dbus_connection_send failed");
+    }
+    else
+      DO_LOG(LOG_ERR, "failed to create %s signal", CLOCKD_CHANGED);
+
+    if (msg)
+      dbus_message_unref(msg);
   }
+}
 
-  log_tm("NET", &tm_net);
-  tz_q = tm_net.tm_yday;
+static int64_t
+server_clock_ns(clockid_t clock_id)
+{
+  struct timespec ts;
 
-  is_dst = tm_net.tm_isdst;
+  if (clock_gettime(clock_id, &ts))
+    return 0;
 
-  now = internal_get_time();
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-  if (now == -1 || !localtime_r(&now, &tm_old))
-    goto out;
+/* CLOCK_REALTIME - CLOCK_MONOTONIC, changes only when the time is stepped */
+static int64_t
+server_clock_offset(dbus_int64_t *realtime, dbus_int64_t *monotonic)
+{
+  *realtime = server_clock_ns(CLOCK_REALTIME);
+  *monotonic = server_clock_ns(CLOCK_MONOTONIC);
 
-  log_tm("OLD", &tm_old);
-  memset(&tm_utc, 0, sizeof(tm_utc));
-  tm_utc.tm_year = tm_net.tm_year;
-  tm_utc.tm_mon = tm_net.tm_mon;
-  tm_utc.tm_mday = tm_net.tm_mday;
-  tm_utc.tm_hour = tm_net.tm_hour;
-  tm_utc.tm_min = tm_net.tm_min;
-  tm_utc.tm_sec = tm_net.tm_sec;
+  return *realtime - *monotonic;
+}
 
-  time_utc = internal_mktime_in(&tm_utc, NULL);
-  if (time_utc == -1)
-  {
-    DO_LOG(LOG_ERR, "handle_csd_net_time_change(), time evaluation failed");
-    goto out;
-  }
+static void
+server_send_time_changed_ex(unsigned int mask)
+{
+  struct server_snapshot *snap = server_snapshot_get();
+  dbus_uint32_t dbus_mask = mask;
+  dbus_int64_t delta = 0;
+  dbus_int64_t realtime;
+  dbus_int64_t monotonic;
+  dbus_int64_t boottime;
+  int64_t offset;
+  dbus_bool_t dbus_autosync;
+  const char *tz;
+  const char *fmt;
+  DBusMessage *msg;
 
-  log_tm("UTC", &tm_utc);
+  if (!snap)
+    return;
 
-  if (!localtime_r(&time_utc, &tm_old))
-    goto out;
+  dbus_autosync = snap->autosync;
+  tz = snap->tz;
+  fmt = snap->time_format;
+  offset = server_clock_offset(&realtime, &monotonic);
+#ifdef CLOCK_BOOTTIME
+  boottime = server_clock_ns(CLOCK_BOOTTIME);
+#else
+  boottime = monotonic;
+#endif
 
-  log_tm("synced OLD", &tm_old);
+  if (mask & CLOCKD_CHANGE_TIME)
+  {
+    delta = offset - change_step_base;
+    change_step_base = offset;
+  }
 
-  if (tz_q == 100)
+  change_generation++;
+
+  msg = dbus_message_new_signal(CLOCKD_PATH, CLOCKD_INTERFACE,
+                                CLOCKD_TIME_CHANGED_EX);
+
+  if (msg && dbus_message_append_args(msg,
+                                      DBUS_TYPE_UINT64, &change_generation,
+                                      DBUS_TYPE_UINT32, &dbus_mask,
+                                      DBUS_TYPE_STRING, &tz,
+                                      DBUS_TYPE_STRING, &fmt,
+                                      DBUS_TYPE_BOOLEAN, &dbus_autosync,
+                                      DBUS_TYPE_INT64, &delta,
+                                      DBUS_TYPE_INT64, &realtime,
+                                      DBUS_TYPE_INT64, &monotonic,
+                                      DBUS_TYPE_INT64, &boottime,
+                                      DBUS_TYPE_INVALID))
   {
-    DO_LOG(LOG_DEBUG,
-           "Let's keep current tz since network does not send info about it");
-    tz = saved_server_opertime_tz;
+    if (dbus_connection_send(dbus_system_connection, msg, NULL))
+      DO_LOG(LOG_DEBUG, "sent D-Bus signal %s", CLOCKD_TIME_CHANGED_EX);
+    else
+      DO_LOG(LOG_ERR, "dbus_connection_send failed");
   }
   else
+    DO_LOG(LOG_ERR, "failed to create %s signal", CLOCKD_TIME_CHANGED_EX);
+
+  if (msg)
+    dbus_message_unref(msg);
+
+  server_snapshot_unref(snap);
+}
+
+/* broadcasts the legacy signals, subscribers get only what they asked for */
+static void
+server_send_change(unsigned int mask, time_t t)
+{
+  if (was_dst != internal_get_dst(t))
+    mask |= CLOCKD_CHANGE_DST;
+
+  server_send_time_change_indication(t);
+  server_send_time_changed_ex(mask);
+  server_send_subscribers(mask, t);
+}
+
+/* 't' is the new time if it has been set, 0 otherwise */
+static void
+server_notify_change(unsigned int mask, time_t t)
+{
+  if (!change_mask || t)
+    change_time = t;
+
+  change_mask |= mask;
+  server_schedule_flush();
+}
+
+static void
+server_watch_name(const char *name, bool watch)
+{
+  char rule[256];
+
+  if (!dbus_connection)
+    return;
+
+  snprintf(rule, sizeof(rule), NAME_OWNER_MATCH_RULE, name);
+
+  if (watch)
+    dbus_bus_add_match(dbus_connection, rule, NULL);
+  else
+    dbus_bus_remove_match(dbus_connection, rule, NULL);
+}
+
+static bool
+server_subscribe(const char *name, unsigned int mask)
+{
+  bool known;
+
+  if (!subscribers)
   {
-    mcc_tz_guess_tz_for_country_by_dst_and_offset(
-                                   &tm_utc, is_dst, 15 * 60  * tz_q, &tz);
+    subscribers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                        NULL);
   }
 
-  if (!tz)
-  {
-    int tz_diff_m = 15 * tz_q;
-    char sign = tz_diff_m > 0 ? '-' : '+';
-    int abs_m = abs(tz_diff_m);
-    int h = abs_m / 60;
-    int m = abs_m % 60;
+  known = g_hash_table_lookup_extended(subscribers, name, NULL, NULL);
 
-    if (m)
-      snprintf(buf, sizeof(buf), ":Etc/GMT%c%d:%d", sign, h, m);
-    else
+  if (!mask)
+  {
+    if (known)
     {
-      if (!h)
-        snprintf(buf, sizeof(buf), ":Etc/GMT");
-      else
-        snprintf(buf, sizeof(buf), ":Etc/GMT%c%d", sign, h);
+      g_hash_table_remove(subscribers, name);
+      server_watch_name(name, false);
     }
 
-    tz = buf;
-    DO_LOG(LOG_WARNING, "TZ guessing failed. \"%s\" TZ will be used", tz);
+    return true;
   }
 
-  internal_tz_set(&old_tz, tz);
-  localtime_r(&time_utc, &tm_net);
-  internal_tz_res(&old_tz);
+  if (!known)
+  {
+    if (g_hash_table_size(subscribers) >= SERVER_MAX_SUBSCRIBERS)
+    {
+      DO_LOG(LOG_WARNING, "too many subscribers, %s rejected", name);
+      return false;
+    }
 
-  log_tm("NEW", &tm_net);
+    server_watch_name(name, true);
+  }
 
-  DO_LOG(LOG_DEBUG, "timeoff: %+ld", time_utc - now);
-  DO_LOG(LOG_DEBUG, "gmtoff: %ld -> %ld", tm_old.tm_gmtoff, tm_net.tm_gmtoff);
+  g_hash_table_insert(subscribers, g_strdup(name), GUINT_TO_POINTER(mask));
+  DO_LOG(LOG_DEBUG, "%s subscribed to changes 0x%x", name, mask);
 
-  net_time_changed_time = time_utc;
-  net_time_last_changed_ticks = times(0);
+  return true;
+}
 
-  if (tz == saved_server_opertime_tz ||
-      (((saved_server_opertime_tz[0] && !strstr(saved_server_opertime_tz, etc_gmt)) || strstr(tz, etc_gmt)) &&
-      tm_old.tm_gmtoff == tm_net.tm_gmtoff && mcc_tz_is_tz_name_in_country_tz_list(saved_server_opertime_tz)))
+static void
+set_time_reply(const struct server_set_time_req *req, dbus_bool_t success)
+{
+  if (req->msg)
   {
-    DO_LOG(LOG_DEBUG, "Corner case, saved_server_opertime_tz is kept unchanged");
+    DBusMessage *rsp = server_new_rsp(req->msg, DBUS_TYPE_BOOLEAN, &success,
+                                      DBUS_TYPE_INVALID);
+
+    if (rsp)
+    {
+      server_send_reply(dbus_system_connection, rsp);
+      dbus_message_unref(rsp);
+    }
+  }
+  else
+  {
+    struct clock_sock_rsp rsp;
+
+    memset(&rsp, 0, sizeof(rsp));
+    rsp.op = CLOCK_SOCK_SET_TIME;
+    rsp.seq = req->seq;
+    rsp.value = success;
+    sock_client_reply(req->client, &rsp);
+  }
+}
+
+static void
+set_time_req_free(void *data)
+{
+  struct server_set_time_req *req = data;
+
+  if (req->msg)
+    dbus_message_unref(req->msg);
+
+  if (req->client)
+    sock_client_unref(req->client);
+
+  g_free(req);
+}
+
+static void
+server_commit_free(void *data)
+{
+  struct server_commit *c = data;
+
+  g_slist_free_full(c->time_reqs, set_time_req_free);
+  g_free(c);
+}
+
+static int
+server_commit_job(void *data)
+{
+  struct server_commit *c = data;
+  struct timespec ts;
+  int64_t target;
+
+  if (!c->set_time)
+    return c->tz[0] ? internal_set_time_tz(NULL, c->tz) : 0;
+
+  /*
+   * add the time since the caller's stamp, spent in the request and the
+   * commit delay, right before zone and time are set together
+   */
+  target = c->realtime_ns +
+      (server_clock_ns(CLOCK_MONOTONIC) - c->monotonic_ns);
+  ts.tv_sec = target / 1000000000;
+  ts.tv_nsec = target % 1000000000;
+  c->tick = ts.tv_sec;
+
+  return internal_set_time_tz(&ts, c->tz[0] ? c->tz : NULL);
+}
+
+static void
+server_commit_done(int rv, void *data)
+{
+  struct server_commit *c = data;
+  GSList *l;
+
+  for (l = c->time_reqs; l; l = l->next)
+    set_time_reply(l->data, !(rv & INTERNAL_SET_TIME_FAILED));
+
+  /* syslog() follows /etc/localtime, TZ is ":/etc/localtime" */
+  if (c->tz[0] && !(rv & INTERNAL_SET_TZ_FAILED))
+    tzset();
+
+  if (c->set_time)
+  {
+    if (rv & INTERNAL_SET_TIME_FAILED)
+      c->mask &= ~CLOCKD_CHANGE_TIME;
+    else
+    {
+      slew_stepped();
+      rtc_sync_request();
+      next_dst_change(c->tick, 0);
+      dump_date(server_tz);
+    }
+  }
+
+  if (c->mask & CLOCKD_CHANGE_TIME)
+    server_notify_change(c->mask, c->set_time ? c->tick : internal_get_time());
+  else if (c->mask)
+    server_notify_change(c->mask, 0);
+}
+
+static gboolean
+server_commit_idle(gpointer user_data)
+{
+  commit_id = 0;
+  server_commit();
+
+  return FALSE;
+}
+
+static void
+save_conf_done(int rv, void *data)
+{
+  saves_running--;
+
+  if (!saves_running && conf_reload_deferred)
+    server_conf_reload();
+}
+
+/* queues the configuration write, after any zone change already queued */
+static void
+server_save(void)
+{
+  struct server_conf *conf;
+
+  if (save_id)
+  {
+    g_source_remove(save_id);
+    save_id = 0;
+  }
+
+  conf = g_new0(struct server_conf, 1);
+  snprintf(conf->state.time_format, sizeof(conf->state.time_format), "%s",
+           time_format);
+  conf->state.autosync = autosync;
+  snprintf(conf->state.tz, sizeof(conf->state.tz), "%s",
+           server_tz[0] == ':' ? "" : server_tz);
+  conf->state.nitz_time = nitz_time;
+  conf->state.nitz_received = nitz_received;
+  conf->state.good_time = internal_get_time();
+  conf->state.rtc_written = rtc_written;
+  conf->state.drift_span = drift.span;
+  conf->state.drift_sum = drift.sum;
+  conf->state.drift_ppb = drift.ppb;
+  conf->state.drift_samples = drift.samples;
+  conf->state.change_generation = change_generation;
+  snprintf(conf->state.boot_id, sizeof(conf->state.boot_id), "%s", boot_id);
+  conf->uid = conf_uid;
+  conf->gid = conf_gid;
+  saves_running++;
+  worker_push(save_conf_job, save_conf_done, conf, g_free);
+}
+
+static gboolean
+server_save_idle(gpointer user_data)
+{
+  save_id = 0;
+  server_save();
+
+  return FALSE;
+}
+
+/* a burst of commits results in one write, with the state at its end */
+static void
+server_save_schedule(void)
+{
+  if (!save_id)
+    save_id = g_timeout_add(save_delay, server_save_idle, NULL);
+}
+
+static void
+server_commit_schedule(void)
+{
+  if (commit_id)
+    return;
+
+  if (commit_delay)
+    commit_id = g_timeout_add(commit_delay, server_commit_idle, NULL);
+  else
+    commit_id = g_idle_add(server_commit_idle, NULL);
+}
+
+/*
+ * Applies what the handlers since the last commit have changed: one
+ * rclockd run for time and zone and one notification. The configuration
+ * write is scheduled, it follows after save_delay.
+ */
+static void
+server_commit(void)
+{
+  struct server_commit *c;
+
+  if (commit_id)
+  {
+    g_source_remove(commit_id);
+    commit_id = 0;
+  }
+
+  if (!pending.mask && !pending.save && !pending.set_time && !pending.tz[0])
+    return;
+
+  c = g_new(struct server_commit, 1);
+  *c = pending;
+  memset(&pending, 0, sizeof(pending));
+
+  if (c->set_time || c->tz[0])
+    worker_push(server_commit_job, server_commit_done, c, server_commit_free);
+
+  if (c->save)
+    server_save_schedule();
+
+  if (!c->set_time && !c->tz[0])
+  {
+    server_commit_done(0, c);
+    server_commit_free(c);
+  }
+}
+
+/* changes to notify at the next commit */
+static void
+server_pend_change(unsigned int mask)
+{
+  pending.mask |= mask;
+  server_commit_schedule();
+}
+
+/* writes the configuration at the next commit */
+static int
+save_conf()
+{
+  pending.save = true;
+  server_commit_schedule();
+
+  return 0;
+}
+
+/* updates /etc/localtime at the next commit */
+static void
+set_system_tz(const char *tz)
+{
+  const char *canonical;
+
+  /* link to the zone file itself, not to another link */
+  if (zone_index_find(tz, &canonical) == 1)
+    snprintf(pending.tz, sizeof(pending.tz), ":%s", canonical);
+  else
+    snprintf(pending.tz, sizeof(pending.tz), "%s", tz);
+
+  server_commit_schedule();
+}
+
+/*
+ * sets the time at the next commit to 'realtime_ns' plus the time since
+ * CLOCK_MONOTONIC was 'monotonic_ns', 'req' is replied once it is set
+ */
+static void
+server_pend_time(int64_t realtime_ns, int64_t monotonic_ns,
+                 struct server_set_time_req *req)
+{
+  pending.set_time = true;
+  pending.realtime_ns = realtime_ns;
+  pending.monotonic_ns = monotonic_ns;
+  pending.mask |= CLOCKD_CHANGE_TIME;
+  pending.save = true;
+
+  if (req)
+    pending.time_reqs = g_slist_append(pending.time_reqs, req);
+
+  server_commit_schedule();
+}
+
+/* replied once rclockd has set the time */
+static void
+server_apply_time(struct server_set_time_req *req)
+{
+  DO_LOG(LOG_DEBUG, "Setting time to %lld.%09lld",
+         (long long)(req->realtime_ns / 1000000000),
+         (long long)(req->realtime_ns % 1000000000));
+
+  /* not a trusted time, what the RTC lost before this boot stays unknown */
+  drift_reset(&drift);
+  server_pend_time(req->realtime_ns, req->monotonic_ns, req);
+}
+
+static int
+handle_csd_net_time_change(DBusMessage *msg)
+{
+  bool time_changed;
+  bool tz_changed;
+  int rv = -1;
+  /* diff, quarters of an hour, between the local time and GMT, ‑47...+48 */
+  int tz_q;
+  int is_dst;
+  char buf[64] = {0, };
+  DBusMessageIter iter;
+  struct tm tm_net;
+  struct tm tm_utc;
+  struct tm tm_old;
+  char etc_gmt[] = "Etc/GMT";
+  char *tz = NULL;
+  time_t time_utc;
+  time_t now;
+
+  memset(&tm_net, 0, sizeof(tm_net));
+  dbus_message_iter_init(msg, &iter);
+
+  if (decode_ctm(&iter, &tm_net) == -1)
+  {
+    DO_LOG(LOG_ERR, "handle_csd_net_time_change(), decode_ctm failed");
+    goto out;
+  }
+
+  log_tm("NET", &tm_net);
+  tz_q = tm_net.tm_yday;
+
+  is_dst = tm_net.tm_isdst;
+
+  now = internal_get_time();
+
+  if (now == -1 || !internal_localtime_in(now, &tm_old, NULL))
+    goto out;
+
+  log_tm("OLD", &tm_old);
+  memset(&tm_utc, 0, sizeof(tm_utc));
+  tm_utc.tm_year = tm_net.tm_year;
+  tm_utc.tm_mon = tm_net.tm_mon;
+  tm_utc.tm_mday = tm_net.tm_mday;
+  tm_utc.tm_hour = tm_net.tm_hour;
+  tm_utc.tm_min = tm_net.tm_min;
+  tm_utc.tm_sec = tm_net.tm_sec;
+
+  time_utc = internal_mktime_in(&tm_utc, NULL);
+  if (time_utc == -1)
+  {
+    DO_LOG(LOG_ERR, "handle_csd_net_time_change(), time evaluation failed");
+    goto out;
+  }
+
+  log_tm("UTC", &tm_utc);
+
+  if (!internal_localtime_in(time_utc, &tm_old, NULL))
+    goto out;
+
+  log_tm("synced OLD", &tm_old);
+
+  if (tz_q == 100)
+  {
+    DO_LOG(LOG_DEBUG,
+           "Let's keep current tz since network does not send info about it");
+    tz = saved_server_opertime_tz;
+  }
+  else
+  {
+    mcc_tz_guess_tz_for_country_by_dst_and_offset(
+                                   &tm_utc, is_dst, 15 * 60  * tz_q, &tz);
+  }
+
+  if (!tz)
+  {
+    int tz_diff_m = 15 * tz_q;
+    char sign = tz_diff_m > 0 ? '-' : '+';
+    int abs_m = abs(tz_diff_m);
+    int h = abs_m / 60;
+    int m = abs_m % 60;
+
+    if (m)
+      snprintf(buf, sizeof(buf), ":Etc/GMT%c%d:%d", sign, h, m);
+    else
+    {
+      if (!h)
+        snprintf(buf, sizeof(buf), ":Etc/GMT");
+      else
+        snprintf(buf, sizeof(buf), ":Etc/GMT%c%d", sign, h);
+    }
+
+    tz = buf;
+    DO_LOG(LOG_WARNING, "TZ guessing failed. \"%s\" TZ will be used", tz);
+  }
+
+  internal_localtime_in(time_utc, &tm_net, tz);
+
+  log_tm("NEW", &tm_net);
+
+  DO_LOG(LOG_DEBUG, "timeoff: %+ld", time_utc - now);
+  DO_LOG(LOG_DEBUG, "gmtoff: %ld -> %ld", tm_old.tm_gmtoff, tm_net.tm_gmtoff);
+
+  net_time_changed_time = time_utc;
+  net_time_last_changed_ticks = times(0);
+  nitz_time = time_utc;
+  nitz_received = now;
+
+  if (tz == saved_server_opertime_tz ||
+      (((saved_server_opertime_tz[0] && !strstr(saved_server_opertime_tz, etc_gmt)) || strstr(tz, etc_gmt)) &&
+      tm_old.tm_gmtoff == tm_net.tm_gmtoff && mcc_tz_is_tz_name_in_country_tz_list(saved_server_opertime_tz)))
+  {
+    DO_LOG(LOG_DEBUG, "Corner case, saved_server_opertime_tz is kept unchanged");
   }
   else
     snprintf(saved_server_opertime_tz, sizeof(saved_server_opertime_tz),
@@ -340,6 +1204,18 @@ handle_csd_net_time_change(DBusMessage *msg)
       (internal_tz_cmp(server_tz, saved_server_opertime_tz) ||
        !mcc_tz_is_tz_name_in_country_tz_list(server_tz));
 
+  /* the clock is right, that is worth a drift sample too */
+  if (!time_changed && autosync)
+    drift_sample(&drift, time_utc, now);
+
+  /* small offsets are slewed, nobody is told, unless a step is pending */
+  if (time_changed && autosync && !pending.set_time &&
+      !slew_start((int64_t)(time_utc - now) * 1000000000))
+  {
+    drift_sample(&drift, time_utc, now);
+    time_changed = false;
+  }
+
   if (time_changed && autosync && server_set_time(time_utc) == -1)
   {
     DO_LOG(LOG_ERR, "handle_csd_net_time_change(), time setting failed");
@@ -348,420 +1224,1089 @@ handle_csd_net_time_change(DBusMessage *msg)
 
   rv = 0;
 
-  if (tz_changed && autosync)
+  if (tz_changed && autosync)
+  {
+    snprintf(server_tz, sizeof(server_tz), "/%s", &saved_server_opertime_tz[1]);
+    server_state_changed();
+
+    if (set_net_timezone(server_tz) == -1)
+    {
+      DO_LOG(LOG_ERR, "handle_csd_net_time_change(), timezone setting failed");
+      rv = -1;
+    }
+
+    internal_set_local_tz(server_tz);
+  }
+
+  if (time_changed | tz_changed)
+  {
+    server_pend_change((time_changed ? CLOCKD_CHANGE_TIME : 0) |
+                       (tz_changed ? CLOCKD_CHANGE_TZ : 0));
+  }
+
+  save_conf();
+  dump_date(server_tz);
+
+out:
+  if (rv)
+    DO_LOG(LOG_ERR, "handle_csd_net_time_change() -> FAILED");
+  else
+    DO_LOG(LOG_DEBUG, "handle_csd_net_time_change() -> OK");
+
+  return rv;
+}
+
+/* pending network time and its zone, 0 if there is none */
+static time_t
+server_get_net_time(const char **tz)
+{
+  struct tms buffer;
+  clock_t now;
+
+  if (!net_time_changed_time)
+  {
+    *tz = "";
+    return 0;
+  }
+
+  now = times(&buffer);
+  *tz = saved_server_opertime_tz;
+
+  return net_time_changed_time +
+      (now - net_time_last_changed_ticks) / sysconf(_SC_CLK_TCK);
+}
+
+static DBusMessage *
+server_activate_net_time_cb(DBusMessage *msg)
+{
+  dbus_bool_t success = FALSE;
+
+  if (net_time_changed_time && !set_network_time(true))
+    success = TRUE;
+
+  return server_new_rsp(msg, DBUS_TYPE_BOOLEAN, &success, DBUS_TYPE_INVALID);
+}
+
+static DBusMessage *
+server_is_net_time_changed_cb(DBusMessage *msg)
+{
+  const char *tz;
+  dbus_int32_t net_time = server_get_net_time(&tz);
+
+  return server_new_rsp(msg, DBUS_TYPE_INT32, &net_time, DBUS_TYPE_STRING, &tz,
+                        DBUS_TYPE_INVALID);
+}
+
+static bool
+server_tz_valid(const char *tzname)
+{
+  if (!tzname || !*tzname || strlen(tzname) >= CLOCKD_TZ_SIZE)
+    return false;
+
+  if (*tzname == ':')
+    return zone_exists(tzname);
+
+  return !internal_check_timezone(tzname);
+}
+
+static bool
+server_autosync_valid(bool enabled)
+{
+  return !enabled || !net_time_disabled_env;
+}
+
+static bool
+server_time_format_valid(const char *timeformat)
+{
+  return timeformat && *timeformat &&
+      strlen(timeformat) < CLOCKD_GET_TIMEFMT_SIZE;
+}
+
+static bool
+server_apply_tz(const char *tzname)
+{
+  DO_LOG(LOG_DEBUG, "Setting time zone to %s", tzname ? tzname : "<null>");
+
+  if (!server_tz_valid(tzname))
+  {
+    DO_LOG(LOG_ERR, "invalid time zone '%s", tzname ? tzname : "<null>");
+    return false;
+  }
+
+  if (internal_set_local_tz(tzname))
+    return false;
+
+  if (*tzname == ':')
+    set_system_tz(tzname);
+
+  strcpy(server_tz, tzname);
+  server_state_changed();
+  dump_date(server_tz);
+  save_conf();
+  next_dst_change(time(0), 0);
+  server_pend_change(CLOCKD_CHANGE_TZ);
+
+  return true;
+}
+
+static bool
+server_apply_autosync(bool enabled)
+{
+  if (!server_autosync_valid(enabled))
+  {
+    DO_LOG(LOG_ERR, "server_apply_autosync(), feature disabled");
+    return false;
+  }
+
+  DO_LOG(LOG_DEBUG, "Network time autosync set to '%s' from '%s'",
+         enabled ? "on" : "off", autosync ? "on" : "off");
+
+  autosync = enabled;
+  server_state_changed();
+
+  if (autosync && net_time_changed_time)
+    set_network_time(false);
+
+  mcc_tz_setup_timezone_from_mcc_if_required();
+
+  if (save_conf())
+    return false;
+
+  server_pend_change(CLOCKD_CHANGE_AUTOSYNC);
+
+  return true;
+}
+
+static bool
+server_apply_time_format(const char *timeformat)
+{
+  DO_LOG(LOG_DEBUG, "Setting time format to %s",
+         timeformat ? timeformat : "<null>");
+
+  if (!server_time_format_valid(timeformat))
+    return false;
+
+  strcpy(time_format, timeformat);
+  server_state_changed();
+  DO_LOG(LOG_DEBUG, "time format changed to '%s'", timeformat);
+
+  if (save_conf())
+    return false;
+
+  server_pend_change(CLOCKD_CHANGE_FORMAT);
+
+  return true;
+}
+
+/*
+ * Sets the CLOCKD_CHANGE_TZ, _FORMAT and _AUTOSYNC settings selected by
+ * 'mask'. Nothing is changed unless all of them are valid, the changes
+ * are saved and notified with one commit.
+ */
+static bool
+server_apply_settings(unsigned int mask, const char *tzname,
+                      const char *timeformat, bool enabled)
+{
+  if (!mask ||
+      (mask & ~(CLOCKD_CHANGE_TZ | CLOCKD_CHANGE_FORMAT |
+                CLOCKD_CHANGE_AUTOSYNC)) ||
+      ((mask & CLOCKD_CHANGE_TZ) && !server_tz_valid(tzname)) ||
+      ((mask & CLOCKD_CHANGE_FORMAT) && !server_time_format_valid(timeformat)) ||
+      ((mask & CLOCKD_CHANGE_AUTOSYNC) && !server_autosync_valid(enabled)))
+  {
+    DO_LOG(LOG_ERR, "server_apply_settings(0x%x), invalid settings", mask);
+    return false;
+  }
+
+  if ((mask & CLOCKD_CHANGE_TZ) && !server_apply_tz(tzname))
+    return false;
+
+  if (mask & CLOCKD_CHANGE_FORMAT)
+    server_apply_time_format(timeformat);
+
+  if (mask & CLOCKD_CHANGE_AUTOSYNC)
+    server_apply_autosync(enabled);
+
+  return true;
+}
+
+static DBusMessage *
+server_set_time_cb(DBusMessage *msg)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  dbus_int32_t dbus_time = 0;
+  dbus_bool_t success = FALSE;
+
+  if (dbus_message_get_args(msg, &error, DBUS_TYPE_INT32, &dbus_time,
+                            DBUS_TYPE_INVALID))
+  {
+    struct server_set_time_req *req = g_new0(struct server_set_time_req, 1);
+
+    req->msg = dbus_message_ref(msg);
+    req->realtime_ns = (int64_t)dbus_time * 1000000000;
+    req->monotonic_ns = server_clock_ns(CLOCK_MONOTONIC);
+    server_apply_time(req);
+
+    return SERVER_RSP_DEFERRED;
+  }
+
+  DO_LOG(LOG_ERR, "server_set_time_cb() %s : %s : %s",
+         dbus_message_get_member(msg), error.name, error.message);
+
+  dbus_error_free(&error);
+
+  return server_new_rsp(msg, DBUS_TYPE_BOOLEAN, &success, DBUS_TYPE_INVALID);
+}
+
+/*
+ * set_time_ex(int64 realtime_ns, int64 monotonic_ns): the time was
+ * 'realtime_ns' when CLOCK_MONOTONIC was 'monotonic_ns', the time since
+ * then is added when the clock is set
+ */
+static DBusMessage *
+server_set_time_ex_cb(DBusMessage *msg)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  dbus_int64_t realtime_ns = 0;
+  dbus_int64_t monotonic_ns = 0;
+  dbus_bool_t success = FALSE;
+
+  if (!dbus_message_get_args(msg, &error, DBUS_TYPE_INT64, &realtime_ns,
+                             DBUS_TYPE_INT64, &monotonic_ns,
+                             DBUS_TYPE_INVALID))
+  {
+    DO_LOG(LOG_ERR, "server_set_time_ex_cb() %s : %s : %s",
+           dbus_message_get_member(msg), error.name, error.message);
+    dbus_error_free(&error);
+  }
+  else if (realtime_ns < 0 || monotonic_ns <= 0 ||
+           monotonic_ns > server_clock_ns(CLOCK_MONOTONIC))
+  {
+    DO_LOG(LOG_ERR, "server_set_time_ex_cb(), invalid time %lld at %lld",
+           (long long)realtime_ns, (long long)monotonic_ns);
+  }
+  else
+  {
+    struct server_set_time_req *req = g_new0(struct server_set_time_req, 1);
+
+    req->msg = dbus_message_ref(msg);
+    req->realtime_ns = realtime_ns;
+    req->monotonic_ns = monotonic_ns;
+    server_apply_time(req);
+
+    return SERVER_RSP_DEFERRED;
+  }
+
+  return server_new_rsp(msg, DBUS_TYPE_BOOLEAN, &success, DBUS_TYPE_INVALID);
+}
+
+static DBusMessage *
+server_set_tz_cb(DBusMessage *msg)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  const char *tzname = NULL;
+  dbus_bool_t success = FALSE;
+
+  if (dbus_message_get_args(msg, &error, DBUS_TYPE_STRING, &tzname,
+                            DBUS_TYPE_INVALID))
+  {
+    success = server_apply_tz(tzname);
+  }
+  else
+  {
+    DO_LOG(LOG_ERR, "server_set_tz_cb() %s : %s : %s",
+           dbus_message_get_member(msg), error.name, error.message);
+  }
+
+  dbus_error_free(&error);
+
+  return server_new_rsp(msg, DBUS_TYPE_BOOLEAN, &success, DBUS_TYPE_INVALID);
+}
+
+static DBusMessage *
+server_set_autosync_cb(DBusMessage *msg)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  dbus_bool_t enabled = FALSE;
+  dbus_bool_t success = FALSE;
+
+  if (dbus_message_get_args(msg, &error, DBUS_TYPE_BOOLEAN, &enabled,
+                            DBUS_TYPE_INVALID))
+  {
+    success = server_apply_autosync(enabled);
+  }
+  else
+  {
+    DO_LOG(LOG_ERR, "server_set_autosync_cb() %s : %s : %s",
+           dbus_message_get_member(msg), error.name, error.message);
+  }
+
+  dbus_error_free(&error);
+
+  return server_new_rsp(msg, DBUS_TYPE_BOOLEAN, &success, DBUS_TYPE_INVALID);
+}
+
+static DBusMessage *
+server_set_time_format_cb(DBusMessage *msg)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  char *timeformat = NULL;
+  dbus_bool_t success = FALSE;
+
+  if (dbus_message_get_args(msg, &error, DBUS_TYPE_STRING, &timeformat,
+                            DBUS_TYPE_INVALID))
+  {
+    success = server_apply_time_format(timeformat);
+  }
+  else
+  {
+    DO_LOG(LOG_ERR, "server_set_time_format_cb() %s : %s : %s",
+           dbus_message_get_member(msg), error.name, error.message);
+  }
+
+  dbus_error_free(&error);
+
+  return server_new_rsp(msg, DBUS_TYPE_BOOLEAN, &success, DBUS_TYPE_INVALID);
+}
+
+static DBusMessage *
+server_apply_settings_cb(DBusMessage *msg)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  dbus_uint32_t mask = 0;
+  const char *tzname = NULL;
+  const char *timeformat = NULL;
+  dbus_bool_t enabled = FALSE;
+  dbus_bool_t success = FALSE;
+
+  if (dbus_message_get_args(msg, &error, DBUS_TYPE_UINT32, &mask,
+                            DBUS_TYPE_STRING, &tzname,
+                            DBUS_TYPE_STRING, &timeformat,
+                            DBUS_TYPE_BOOLEAN, &enabled,
+                            DBUS_TYPE_INVALID))
+  {
+    success = server_apply_settings(mask, tzname, timeformat, enabled);
+  }
+  else
+  {
+    DO_LOG(LOG_ERR, "server_apply_settings_cb() %s : %s : %s",
+           dbus_message_get_member(msg), error.name, error.message);
+  }
+
+  dbus_error_free(&error);
+
+  return server_new_rsp(msg, DBUS_TYPE_BOOLEAN, &success, DBUS_TYPE_INVALID);
+}
+
+static DBusMessage *
+server_get_time_format_cb(DBusMessage *msg)
+{
+  return server_cached_rsp(msg, SERVER_REPLY_TIMEFMT);
+}
+
+static DBusMessage *
+server_get_default_tz_cb(DBusMessage *msg)
+{
+  return server_cached_rsp(msg, SERVER_REPLY_DEFAULT_TZ);
+}
+
+static DBusMessage *
+server_get_tz_cb(DBusMessage *msg)
+{
+  return server_cached_rsp(msg, SERVER_REPLY_TZ);
+}
+
+static DBusMessage *
+server_get_autosync_cb(DBusMessage *msg)
+{
+  return server_cached_rsp(msg, SERVER_REPLY_AUTOSYNC);
+}
+
+static DBusMessage *
+server_have_opertime_cb(DBusMessage *msg)
+{
+  return server_cached_rsp(msg, SERVER_REPLY_HAVE_OPERTIME);
+}
+
+static DBusMessage *
+server_get_time_cb(DBusMessage *msg)
+{
+  dbus_int32_t t = internal_get_time();
+
+  return server_new_rsp(msg, DBUS_TYPE_INT32, &t, DBUS_TYPE_INVALID);
+}
+
+static DBusMessage *
+server_subscribe_cb(DBusMessage *msg)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  const char *sender = dbus_message_get_sender(msg);
+  dbus_uint32_t mask = 0;
+  dbus_bool_t success = FALSE;
+
+  if (dbus_message_get_args(msg, &error, DBUS_TYPE_UINT32, &mask,
+                            DBUS_TYPE_INVALID))
+  {
+    if (sender)
+      success = server_subscribe(sender, mask & CLOCKD_CHANGE_ALL);
+  }
+  else
+  {
+    DO_LOG(LOG_ERR, "server_subscribe_cb() %s : %s : %s",
+           dbus_message_get_member(msg), error.name, error.message);
+  }
+
+  dbus_error_free(&error);
+
+  return server_new_rsp(msg, DBUS_TYPE_BOOLEAN, &success, DBUS_TYPE_INVALID);
+}
+
+static DBusHandlerResult
+server_filter(DBusConnection *conn, DBusMessage *msg, void *user_data)
+{
+  if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (dbus_message_is_signal(msg, CSD_INTERFACE, CSD_NETWORK_TIMEINFO_CHANGE))
+  {
+    if (dbus_message_has_path(msg, CSD_PATH))
+      handle_csd_net_time_change(msg);
+  }
+  else if (dbus_message_is_signal(msg, CSD_INTERFACE,
+                                  CSD_REGISTRATION_STATUS_CHANGE))
+  {
+    if (dbus_message_has_path(msg, CSD_PATH))
+    {
+      DO_LOG(LOG_DEBUG, "CSD_REGISTRATION_STATUS_CHANGE received");
+      mcc_tz_handle_registration_status_reply(msg);
+    }
+  }
+  else if (dbus_message_is_signal(msg, MCE_INTERFACE, MCE_MODE_CHANGE) &&
+           dbus_message_has_path(msg, MCE_PATH) && net_time_changed_time)
+  {
+    DO_LOG(LOG_DEBUG, "got MCE normal/flight mode change indication");
+    net_time_changed_time = 0;
+  }
+  else if (dbus_message_is_signal(msg, DBUS_INTERFACE_DBUS,
+                                  "NameOwnerChanged") &&
+           dbus_message_has_sender(msg, DBUS_SERVICE_DBUS))
+  {
+    const char *name = NULL;
+    const char *old_owner = NULL;
+    const char *new_owner = NULL;
+
+    if (dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_STRING, &old_owner,
+                              DBUS_TYPE_STRING, &new_owner,
+                              DBUS_TYPE_INVALID) && !*new_owner)
+    {
+      server_subscribe(name, 0);
+    }
+  }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static unsigned int
+server_method_hash(unsigned int seed, const char *member)
+{
+  unsigned int h = 2166136261u ^ seed;
+
+  while (*member)
+  {
+    h ^= (unsigned char)*member++;
+    h *= 16777619u;
+  }
+
+  return h & (SERVER_METHOD_SLOTS - 1);
+}
+
+/* pick a seed that maps every member to its own slot */
+static int
+server_init_methods(void)
+{
+  unsigned int seed;
+  int i;
+
+  for (seed = 0; seed < 65536; seed++)
   {
-    snprintf(server_tz, sizeof(server_tz), "/%s", &saved_server_opertime_tz[1]);
+    memset(server_methods, 0, sizeof(server_methods));
 
-    if (set_net_timezone(server_tz) == -1)
+    for (i = 0; server_callbacks[i].member; i++)
     {
-      DO_LOG(LOG_ERR, "handle_csd_net_time_change(), timezone setting failed");
-      rv = -1;
-    }
-
-    internal_setenv_tz(server_tz);
-  }
+      unsigned int slot = server_method_hash(seed, server_callbacks[i].member);
 
-  if (time_changed | tz_changed)
-    server_send_time_change_indication(time_changed ? internal_get_time() : 0);
+      if (server_methods[slot])
+        break;
 
-  save_conf();
-  dump_date(server_tz);
+      server_methods[slot] = &server_callbacks[i];
+    }
 
-out:
-  if (rv)
-    DO_LOG(LOG_ERR, "handle_csd_net_time_change() -> FAILED");
-  else
-    DO_LOG(LOG_DEBUG, "handle_csd_net_time_change() -> OK");
+    if (!server_callbacks[i].member)
+    {
+      server_method_seed = seed;
+      return 0;
+    }
+  }
 
-  return rv;
+  return -1;
 }
 
-static DBusMessage *
-server_activate_net_time_cb(DBusMessage *msg)
+static const struct server_callback *
+server_find_method(const char *member)
 {
-  dbus_bool_t success = FALSE;
+  const struct server_callback *cb =
+      server_methods[server_method_hash(server_method_seed, member)];
 
-  if (net_time_changed_time && !set_network_time(true))
-    success = TRUE;
+  if (cb && !strcmp(cb->member, member))
+    return cb;
 
-  return server_new_rsp(msg, DBUS_TYPE_BOOLEAN, &success, DBUS_TYPE_INVALID);
+  return NULL;
 }
 
-static DBusMessage *
-server_is_net_time_changed_cb(DBusMessage *msg)
+static gboolean
+server_flush_idle(gpointer user_data)
 {
-  dbus_int32_t net_time;
-  char *tz = saved_server_opertime_tz;
+  flush_id = 0;
 
-  if (net_time_changed_time)
+  /* after the replies of the setters that caused it */
+  if (change_mask)
   {
-    struct tms buffer;
-    clock_t now = times(&buffer);
-    net_time = (now - net_time_last_changed_ticks) / sysconf(_SC_CLK_TCK);
-    net_time += net_time_changed_time;
-  }
-  else
-  {
-    net_time = 0;
-    tz = "";
+    unsigned int mask = change_mask;
+
+    change_mask = 0;
+    server_send_change(mask, change_time);
   }
 
-  return server_new_rsp(msg, DBUS_TYPE_INT32, &net_time, DBUS_TYPE_STRING, &tz,
-                        DBUS_TYPE_INVALID);
+  if (dbus_system_connection)
+    dbus_connection_flush(dbus_system_connection);
+
+  if (dbus_connection && dbus_connection != dbus_system_connection)
+    dbus_connection_flush(dbus_connection);
+
+  return FALSE;
 }
 
-static DBusMessage *
-server_set_time_cb(DBusMessage *msg)
+/* replies and signals of one main loop iteration are written together */
+static void
+server_schedule_flush(void)
 {
-  DBusMessage *rsp;
-  DBusError error = DBUS_ERROR_INIT;
-  dbus_int32_t dbus_time = 0;
-  dbus_bool_t success = FALSE;
+  if (!flush_id)
+    flush_id = g_idle_add(server_flush_idle, NULL);
+}
 
-  if (dbus_message_get_args(msg, &error, DBUS_TYPE_INT32, &dbus_time,
-                            DBUS_TYPE_INVALID))
+static void
+server_send_reply(DBusConnection *conn, DBusMessage *reply)
+{
+  dbus_connection_send(conn, reply, NULL);
+  server_schedule_flush();
+}
+
+/* runs a method callback in the main thread and sends the reply */
+static void
+server_dispatch(DBusConnection *conn, DBusMessage *msg)
+{
+  const char *member = dbus_message_get_member(msg);
+  const struct server_callback *cb = server_find_method(member);
+  DBusMessage *reply;
+
+  if (cb)
   {
-    DO_LOG(LOG_DEBUG, "Setting time to %lu", (unsigned long)dbus_time);
+    reply = cb->callback(msg);
 
-    if (!server_set_time(dbus_time))
-      success = TRUE;
+    if (reply == SERVER_RSP_DEFERRED)
+      return;
   }
   else
   {
-    DO_LOG(LOG_ERR, "server_set_time_cb() %s : %s : %s",
-           dbus_message_get_member(msg), error.name, error.message);
+    DO_LOG(LOG_DEBUG, "server_dispatch() unknown member %s", member);
+    reply = dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_METHOD, member);
   }
 
-  dbus_error_free(&error);
-  rsp = server_new_rsp(msg, DBUS_TYPE_BOOLEAN, &success, DBUS_TYPE_INVALID);
+  if (!reply && !dbus_message_get_no_reply(msg))
+    reply = dbus_message_new_error(msg, DBUS_ERROR_FAILED, member);
 
-  if (success)
+  if (reply)
   {
-    dump_date(server_tz);
-    save_conf();
-    server_send_time_change_indication(dbus_time);
+    server_send_reply(conn, reply);
+    dbus_message_unref(reply);
   }
-
-  return rsp;
 }
 
-static DBusMessage *
-server_set_tz_cb(DBusMessage *msg)
+static gboolean
+server_dispatch_idle(gpointer user_data)
 {
-  DBusMessage *rsp;
-  DBusError error = DBUS_ERROR_INIT;
-  const char *tzname = NULL;
-  dbus_bool_t success = FALSE;
+  DBusMessage *msg = user_data;
 
-  if (dbus_message_get_args(msg, &error, DBUS_TYPE_STRING, &tzname,
-                            DBUS_TYPE_INVALID))
-  {
-    DO_LOG(LOG_DEBUG, "Setting time zone to %s", tzname ? tzname : "<null>");
+  if (dbus_system_connection)
+    server_dispatch(dbus_system_connection, msg);
 
-    if (tzname && *tzname && strlen(tzname) < CLOCKD_TZ_SIZE)
-    {
-      if (*tzname == ':')
-      {
-        if (!internal_set_tz(tzname))
-          success = 1;
-      }
-      else
-        success = !internal_check_timezone(tzname);
+  dbus_message_unref(msg);
 
-      if (success)
-      {
-        if (internal_setenv_tz(tzname))
-          success = FALSE;
-        else
-        {
-          strcpy(server_tz, tzname);
-          dump_date(server_tz);
-        }
-      }
-    }
-    else
-      DO_LOG(LOG_ERR, "invalid time zone '%s", tzname ? tzname : "<null>");
+  return FALSE;
+}
 
-    save_conf();
+static gboolean
+reader_flush_idle(gpointer user_data)
+{
+  reader_flush_id = 0;
+  dbus_connection_flush(dbus_system_connection);
 
-    if (success)
-      next_dst_change(time(0), 0);
-  }
-  else
+  return FALSE;
+}
+
+/* reader thread only */
+static void
+reader_send_reply(DBusConnection *conn, DBusMessage *reply)
+{
+  dbus_connection_send(conn, reply, NULL);
+
+  if (!reader_flush_id)
   {
-    DO_LOG(LOG_ERR, "server_set_tz_cb() %s : %s : %s",
-           dbus_message_get_member(msg), error.name, error.message);
-  }
+    GSource *source = g_idle_source_new();
 
-  dbus_error_free(&error);
+    g_source_set_callback(source, reader_flush_idle, NULL, NULL);
+    reader_flush_id = g_source_attach(source, reader_context);
+    g_source_unref(source);
+  }
+}
 
-  rsp = server_new_rsp(msg, DBUS_TYPE_BOOLEAN, &success, DBUS_TYPE_INVALID);
+static void
+server_bucket_refill(struct server_bucket *b, gint64 now)
+{
+  b->tokens += (double)(now - b->stamp) * SERVER_BUCKET_RATE / G_USEC_PER_SEC;
 
-  if ( success )
-    server_send_time_change_indication(0);
+  if (b->tokens > SERVER_BUCKET_BURST)
+    b->tokens = SERVER_BUCKET_BURST;
 
-  return rsp;
+  b->stamp = now;
 }
 
-static DBusMessage *
-server_set_autosync_cb(DBusMessage *msg)
+static void
+server_buckets_prune(gint64 now)
 {
-  DBusMessage *rsp;
-  DBusError error = DBUS_ERROR_INIT;
-  dbus_bool_t enabled = FALSE;
-  dbus_bool_t success = FALSE;
+  GHashTableIter iter;
+  gpointer value;
 
-  if (dbus_message_get_args(msg, &error, DBUS_TYPE_BOOLEAN, &enabled,
-                            DBUS_TYPE_INVALID))
+  g_hash_table_iter_init(&iter, buckets);
+
+  while (g_hash_table_iter_next(&iter, NULL, &value))
   {
-    if (enabled && net_time_disabled_env)
-      DO_LOG(LOG_ERR, "server_set_autosync_cb(), feature disabled");
-    else
-    {
-      DO_LOG(LOG_DEBUG, "Network time autosync set to '%s' from '%s'",
-             enabled ? "on" : "off", autosync ? "on" : "off");
+    struct server_bucket *b = value;
 
-      autosync = enabled;
+    server_bucket_refill(b, now);
 
-      if (autosync && net_time_changed_time)
-        set_network_time(false);
+    if (b->tokens >= SERVER_BUCKET_BURST)
+      g_hash_table_iter_remove(&iter);
+  }
+}
 
-      mcc_tz_setup_timezone_from_mcc_if_required();
+/* token bucket admission of a setter request from 'sender' */
+static bool
+server_admit(const char *sender)
+{
+  gint64 now = g_get_monotonic_time();
+  struct server_bucket *b;
 
-      if (!save_conf())
-        success = TRUE;
-    }
+  if (!buckets)
+    buckets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+  b = g_hash_table_lookup(buckets, sender);
+
+  if (!b)
+  {
+    if (g_hash_table_size(buckets) >= SERVER_BUCKET_MAX)
+      server_buckets_prune(now);
+
+    b = g_new0(struct server_bucket, 1);
+    b->tokens = SERVER_BUCKET_BURST;
+    b->stamp = now;
+    g_hash_table_insert(buckets, g_strdup(sender), b);
   }
   else
+    server_bucket_refill(b, now);
+
+  if (b->tokens < 1.0)
   {
-    DO_LOG(LOG_ERR, "server_set_autosync_cb() %s : %s : %s",
-           dbus_message_get_member(msg), error.name, error.message);
+    requests_throttled++;
+
+    if (!b->throttled++)
+    {
+      DO_LOG(LOG_WARNING, "%s exceeds the setter limit (%u/%u throttled)",
+             sender, requests_throttled,
+             requests_throttled + requests_admitted);
+    }
+
+    return false;
   }
 
-  rsp = server_new_rsp(msg, DBUS_TYPE_BOOLEAN, &success, DBUS_TYPE_INVALID);
-  dbus_error_free(&error);
+  if (b->throttled)
+  {
+    DO_LOG(LOG_INFO, "%s no longer throttled, %u requests refused", sender,
+           b->throttled);
+    b->throttled = 0;
+  }
 
-  if (success)
-    server_send_time_change_indication(0);
+  b->tokens -= 1.0;
+  requests_admitted++;
 
-  return rsp;
+  return true;
 }
 
-static DBusMessage *
-server_set_time_format_cb(DBusMessage *msg)
+/*
+ * Runs in the reader thread if there is one. Getters are answered from
+ * the snapshot right away, everything else is passed to the main loop
+ * so that state changes stay serialized.
+ */
+static DBusHandlerResult
+server_method_handler(DBusConnection *conn, DBusMessage *msg, void *user_data)
 {
-  DBusMessage *rsp;
-  DBusError error = DBUS_ERROR_INIT;
-  char *timeformat = NULL;
-  dbus_bool_t success = FALSE;
-
-  timeformat = 0;
+  const char *iface = dbus_message_get_interface(msg);
+  const char *member = dbus_message_get_member(msg);
+  const struct server_callback *cb;
 
-  if (dbus_message_get_args(msg, &error, DBUS_TYPE_STRING, &timeformat,
-                            DBUS_TYPE_INVALID))
+  if (!iface || !member || strcmp(iface, "com.nokia.clockd") ||
+      dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL)
   {
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  }
 
-    DO_LOG(LOG_DEBUG, "Setting time format to %s",
-           timeformat ? timeformat : "<null>");
+  cb = server_find_method(member);
 
-    if (timeformat && *timeformat &&
-        strlen(timeformat) < CLOCKD_GET_TIMEFMT_SIZE)
+  if (cb && cb->limited && !server_admit(dbus_message_get_sender(msg) ?
+                                         dbus_message_get_sender(msg) : ""))
+  {
+    DBusMessage *reply = dbus_message_new_error(msg,
+                                                CLOCKD_ERROR_LIMITS_EXCEEDED,
+                                                member);
+
+    if (reply)
     {
-      strcpy(time_format, timeformat);
-      DO_LOG(LOG_DEBUG, "time format changed to '%s'", timeformat);
+      if (reader_thread)
+        reader_send_reply(conn, reply);
+      else
+        server_send_reply(conn, reply);
 
-      if (!save_conf())
-        success = TRUE;
+      dbus_message_unref(reply);
     }
+
+    return DBUS_HANDLER_RESULT_HANDLED;
   }
-  else
+
+  if (!reader_thread)
   {
-    DO_LOG(LOG_ERR, "server_set_time_format_cb() %s : %s : %s",
-           dbus_message_get_member(msg), error.name, error.message);
+    server_dispatch(conn, msg);
+    return DBUS_HANDLER_RESULT_HANDLED;
   }
 
-  dbus_error_free(&error);
-  rsp = server_new_rsp(msg, DBUS_TYPE_BOOLEAN, &success, DBUS_TYPE_INVALID);
+  if (cb && cb->reader)
+  {
+    DBusMessage *reply = cb->callback(msg);
 
-  if (success)
-    server_send_time_change_indication(0);
+    if (!reply && !dbus_message_get_no_reply(msg))
+      reply = dbus_message_new_error(msg, DBUS_ERROR_FAILED, member);
 
-  return rsp;
+    if (reply)
+    {
+      reader_send_reply(conn, reply);
+      dbus_message_unref(reply);
+    }
+  }
+  else
+  {
+    /* main loop events and cheap requests go before the setters */
+    g_idle_add_full(cb && cb->limited ? G_PRIORITY_DEFAULT_IDLE :
+                                        G_PRIORITY_DEFAULT,
+                    server_dispatch_idle, dbus_message_ref(msg), NULL);
+  }
+
+  return DBUS_HANDLER_RESULT_HANDLED;
 }
 
-static DBusMessage *
-server_get_time_format_cb(DBusMessage *msg)
+static bool
+server_sock_limited(int op)
 {
-  const char *s = time_format;
-
-  return server_new_rsp(msg, DBUS_TYPE_STRING, &s, DBUS_TYPE_INVALID);
+  switch (op)
+  {
+    case CLOCK_SOCK_SET_TIME:
+    case CLOCK_SOCK_SET_TZ:
+    case CLOCK_SOCK_SET_TIMEFMT:
+    case CLOCK_SOCK_SET_AUTOSYNC:
+    case CLOCK_SOCK_ACTIVATE_NET_TIME:
+      return true;
+    default:
+      return false;
+  }
 }
 
-static DBusMessage *
-server_get_default_tz_cb(DBusMessage *msg)
+static bool
+server_sock_may_set(const struct ucred *cred)
 {
-  const char *s = default_tz;
-
-  return server_new_rsp(msg, DBUS_TYPE_STRING, &s, DBUS_TYPE_INVALID);
+  return !cred->uid || cred->uid == sock_setter_uid;
 }
 
-static DBusMessage *
-server_get_tz_cb(DBusMessage *msg)
+/* main thread, requests that need the live state or change it */
+static void
+server_sock_dispatch(struct sock_client *client,
+                     const struct clock_sock_req *req)
 {
-  const char *s = server_tz;
+  struct server_set_time_req *set_time_req;
+  struct clock_sock_rsp rsp;
+  const char *tz;
 
-  return server_new_rsp(msg, DBUS_TYPE_STRING, &s, DBUS_TYPE_INVALID);
-}
+  memset(&rsp, 0, sizeof(rsp));
+  rsp.op = req->op;
+  rsp.seq = req->seq;
 
-static DBusMessage *
-server_get_autosync_cb(DBusMessage *msg)
-{
-  dbus_bool_t as = !!autosync;
+  if (req->op != CLOCK_SOCK_NET_TIME_CHANGED &&
+      !server_sock_may_set(sock_client_cred(client)))
+  {
+    DO_LOG(LOG_WARNING, "socket request %d from uid %u denied", (int)req->op,
+           (unsigned)sock_client_cred(client)->uid);
+    rsp.status = -EPERM;
+    sock_client_reply(client, &rsp);
+    return;
+  }
+
+  switch (req->op)
+  {
+    case CLOCK_SOCK_SET_TIME:
+      if (req->value < 0 || req->value > INT64_MAX / 1000000000)
+        break;
+
+      set_time_req = g_new0(struct server_set_time_req, 1);
+      set_time_req->client = sock_client_ref(client);
+      set_time_req->seq = req->seq;
+      set_time_req->realtime_ns = req->value * 1000000000;
+      set_time_req->monotonic_ns = server_clock_ns(CLOCK_MONOTONIC);
+      server_apply_time(set_time_req);
+      return;
+    case CLOCK_SOCK_SET_TZ:
+      rsp.value = server_apply_tz(req->str);
+      break;
+    case CLOCK_SOCK_SET_TIMEFMT:
+      rsp.value = server_apply_time_format(req->str);
+      break;
+    case CLOCK_SOCK_SET_AUTOSYNC:
+      rsp.value = server_apply_autosync(req->value != 0);
+      break;
+    case CLOCK_SOCK_ACTIVATE_NET_TIME:
+      rsp.value = net_time_changed_time && !set_network_time(true);
+      break;
+    case CLOCK_SOCK_NET_TIME_CHANGED:
+      rsp.value = server_get_net_time(&tz);
+      snprintf(rsp.str, sizeof(rsp.str), "%s", tz);
+      break;
+    default:
+      rsp.status = -ENOSYS;
+      break;
+  }
 
-  return server_new_rsp(msg, DBUS_TYPE_BOOLEAN, &as, DBUS_TYPE_INVALID);
+  sock_client_reply(client, &rsp);
 }
 
-static DBusMessage *
-server_have_opertime_cb(DBusMessage *msg)
+static gboolean
+server_sock_dispatch_idle(gpointer user_data)
 {
-  dbus_bool_t nt = net_time_setting;
+  struct server_sock_req *sock_req = user_data;
+
+  server_sock_dispatch(sock_req->client, &sock_req->req);
+  sock_client_unref(sock_req->client);
+  g_free(sock_req);
 
-  return server_new_rsp(msg, DBUS_TYPE_BOOLEAN, &nt, DBUS_TYPE_INVALID);
+  return FALSE;
 }
 
-static DBusMessage *
-server_get_time_cb(DBusMessage *msg)
+static int
+server_sock_get(const struct server_snapshot *snap, int op,
+                struct clock_sock_rsp *rsp)
 {
-  dbus_int32_t t = internal_get_time();
+  switch (op)
+  {
+    case CLOCK_SOCK_GET_TZ:
+      snprintf(rsp->str, sizeof(rsp->str), "%s", snap->tz);
+      break;
+    case CLOCK_SOCK_GET_TIMEFMT:
+      snprintf(rsp->str, sizeof(rsp->str), "%s", snap->time_format);
+      break;
+    case CLOCK_SOCK_GET_DEFAULT_TZ:
+      snprintf(rsp->str, sizeof(rsp->str), "%s", snap->default_tz);
+      break;
+    case CLOCK_SOCK_GET_AUTOSYNC:
+      rsp->value = snap->autosync;
+      break;
+    case CLOCK_SOCK_HAVE_OPERTIME:
+      rsp->value = snap->have_opertime;
+      break;
+    default:
+      return -1;
+  }
 
-  return server_new_rsp(msg, DBUS_TYPE_INT32, &t, DBUS_TYPE_INVALID);
+  return 0;
 }
 
-static DBusHandlerResult
-server_filter(DBusConnection *conn, DBusMessage *msg, void *user_data)
+/*
+ * Runs where the D-Bus method handler runs. Getters are answered from
+ * the snapshot, the rest goes to the main loop.
+ */
+static void
+server_sock_request(struct sock_client *client,
+                    const struct clock_sock_req *req)
 {
-  const char *iface = dbus_message_get_interface(msg);
-  const char *member = dbus_message_get_member(msg);
-  const char *path = dbus_message_get_path(msg);
-  int i;
+  struct server_snapshot *snap;
+  struct clock_sock_rsp rsp;
 
-  if (!iface || !member || !path)
-    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-
-  if (!strcmp(iface, CSD_INTERFACE) && !strcmp(path, CSD_PATH))
-  {
-    if (!strcmp(member, CSD_NETWORK_TIMEINFO_CHANGE) &&
-        dbus_message_is_signal(msg, CSD_INTERFACE, CSD_NETWORK_TIMEINFO_CHANGE))
-    {
-        handle_csd_net_time_change(msg);
-    }
-    else if (!strcmp(member, CSD_REGISTRATION_STATUS_CHANGE)
-             && dbus_message_is_signal(msg, CSD_INTERFACE,
-                                       CSD_REGISTRATION_STATUS_CHANGE))
-    {
-      DO_LOG(LOG_DEBUG, "CSD_REGISTRATION_STATUS_CHANGE received");
-      mcc_tz_handle_registration_status_reply(msg);
-    }
+  memset(&rsp, 0, sizeof(rsp));
+  rsp.op = req->op;
+  rsp.seq = req->seq;
 
-    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-  }
-  else if (!strcmp(iface, MCE_INTERFACE) && !strcmp(path, MCE_PATH) &&
-           !strcmp(member, MCE_MODE_CHANGE) &&
-           dbus_message_is_signal(msg, MCE_INTERFACE, MCE_MODE_CHANGE) &&
-           net_time_changed_time)
+  if (req->op == CLOCK_SOCK_GET_TIME)
+    rsp.value = internal_get_time();
+  else if ((snap = server_snapshot_get()) && !server_sock_get(snap, req->op,
+                                                              &rsp))
   {
-    DO_LOG(LOG_DEBUG, "got MCE normal/flight mode change indication");
-    net_time_changed_time = 0;
+    server_snapshot_unref(snap);
   }
-  else if (!strcmp(iface, "com.nokia.clockd") &&
-           !strcmp(path, "/com/nokia/clockd"))
+  else
   {
-    DBusMessage *reply = NULL;
+    bool limited = server_sock_limited(req->op);
 
-    if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_CALL)
+    if (snap)
+      server_snapshot_unref(snap);
+
+    if (limited)
     {
-      for (i = 0; ; i++)
+      char sender[32];
+
+      snprintf(sender, sizeof(sender), "uid:%u",
+               (unsigned)sock_client_cred(client)->uid);
+
+      if (!server_admit(sender))
       {
-        if (!server_callbacks[i].member)
-        {
-          DO_LOG(LOG_DEBUG, "server_filter() unknown member %s", member);
-          reply =
-              dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_METHOD, member);
-          break;
-        }
-
-        if (!strcmp(server_callbacks[i].member, member))
-        {
-          reply = server_callbacks[i].callback(msg);
-          break;
-        }
+        rsp.status = -EAGAIN;
+        sock_client_reply(client, &rsp);
+        return;
       }
     }
 
-    if (!reply && !dbus_message_get_no_reply(msg))
-      reply = dbus_message_new_error(msg, DBUS_ERROR_FAILED, member);
-
-    if (reply)
+    if (reader_thread)
     {
-      dbus_connection_send(conn, reply, NULL);
-      dbus_connection_flush(conn);
-      dbus_message_unref(reply);
+      struct server_sock_req *sock_req = g_new0(struct server_sock_req, 1);
+
+      sock_req->client = sock_client_ref(client);
+      sock_req->req = *req;
+      g_idle_add_full(limited ? G_PRIORITY_DEFAULT_IDLE : G_PRIORITY_DEFAULT,
+                      server_sock_dispatch_idle, sock_req, NULL);
     }
+    else
+      server_sock_dispatch(client, req);
+
+    return;
+  }
+
+  sock_client_reply(client, &rsp);
+}
+
+static gpointer
+reader_main(gpointer user_data)
+{
+  g_main_context_push_thread_default(reader_context);
+  g_main_loop_run(reader_loop);
+  g_main_context_pop_thread_default(reader_context);
+
+  return NULL;
+}
 
-    return DBUS_HANDLER_RESULT_HANDLED;
+static int
+reader_init(DBusConnection *conn)
+{
+  reader_context = g_main_context_new();
+  reader_loop = g_main_loop_new(reader_context, FALSE);
+  dbus_connection_setup_with_g_main(conn, reader_context);
+  reader_thread = g_thread_try_new("reader", reader_main, NULL, NULL);
+
+  if (!reader_thread)
+  {
+    DO_LOG(LOG_WARNING, "reader thread creation failed, serving all calls "
+           "from the main loop");
+    dbus_connection_setup_with_g_main(conn, NULL);
+    g_main_loop_unref(reader_loop);
+    reader_loop = NULL;
+    g_main_context_unref(reader_context);
+    reader_context = NULL;
+    return -1;
   }
 
-  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  return 0;
 }
 
-static int
-set_net_timezone(const char *tzname)
+static gboolean
+reader_quit_idle(gpointer user_data)
 {
-  char buf[256];
-  struct stat stat_buf;
+  g_main_loop_quit(reader_loop);
 
-  memset(buf, 0, sizeof(buf));
+  return FALSE;
+}
 
-  DO_LOG(LOG_DEBUG, "set_net_timezone: tz = %s", tzname ? tzname : "NULL");
+static void
+reader_quit(void)
+{
+  if (reader_thread)
+  {
+    GSource *source = g_idle_source_new();
+
+    g_source_set_callback(source, reader_quit_idle, NULL, NULL);
+    g_source_attach(source, reader_context);
+    g_source_unref(source);
+    g_thread_join(reader_thread);
+    reader_thread = NULL;
+  }
 
-  if (!tzname)
-    goto err;
+  if (reader_loop)
+  {
+    g_main_loop_unref(reader_loop);
+    reader_loop = NULL;
+  }
+}
 
-  snprintf(buf, sizeof(buf), "/usr/share/zoneinfo/%s", tzname + 1);
-  if (stat(buf, &stat_buf))
-    goto err;
+static const DBusObjectPathVTable server_vtable =
+{
+  .message_function = server_method_handler
+};
 
-  DO_LOG(LOG_DEBUG, "zone '%s' exists", buf);
+static int
+set_net_timezone(const char *tzname)
+{
+  DO_LOG(LOG_DEBUG, "set_net_timezone: tz = %s", tzname ? tzname : "NULL");
 
-  if (!internal_set_tz(tzname))
+  if (!tzname || !zone_exists(tzname))
   {
-    next_dst_change(time(0), 0);
-    return 0;
+    DO_LOG(LOG_WARNING, "zone '%s' not defined", tzname ? tzname : "NULL");
+    return -1;
   }
 
-err:
+  DO_LOG(LOG_DEBUG, "zone '%s' exists", tzname);
 
-  DO_LOG(LOG_WARNING, "zone '%s' not defined", buf);
+  set_system_tz(tzname);
+  next_dst_change(time(0), 0);
 
-  return -1;
+  return 0;
 }
 
+/* failures are only logged, the time is set at the next commit */
 static int
 server_set_time(time_t tick)
 {
-  int rv;
-
-  rv = internal_set_time(tick);
-  next_dst_change(tick, 0);
+  drift_sample(&drift, tick, internal_get_time());
+  server_pend_time((int64_t)tick * 1000000000,
+                   server_clock_ns(CLOCK_MONOTONIC), NULL);
 
-  return rv;
+  return 0;
 }
 
 static void
 server_set_operator_tz_cb(const char *tz)
 {
-  int st;
-
   if (tz)
   {
     DO_LOG(LOG_DEBUG, "server_set_operator_tz_cb(): tz = %s", tz);
@@ -769,16 +2314,13 @@ server_set_operator_tz_cb(const char *tz)
     snprintf(saved_server_opertime_tz, sizeof(saved_server_opertime_tz), ":%s",
              tz);
     snprintf(server_tz, sizeof(server_tz) - 1, "/%s", &saved_server_opertime_tz[1]);
-    st = internal_set_tz(server_tz);
-
-    DO_LOG(LOG_DEBUG,
-           "server_set_operator_tz_cb(): set_tz returned error code =  %d", st);
-
-    internal_setenv_tz(server_tz);
+    server_state_changed();
+    set_system_tz(server_tz);
+    internal_set_local_tz(server_tz);
     dump_date(server_tz);
     save_conf();
     next_dst_change(time(0), false);
-    server_send_time_change_indication(0);
+    server_pend_change(CLOCKD_CHANGE_TZ);
   }
   else
     DO_LOG(LOG_ERR, "server_set_operator_tz_cb(): tz = <null> !!!");
@@ -793,7 +2335,7 @@ handle_alarm()
   if (was_dst != internal_get_dst(0))
   {
     DO_LOG(LOG_INFO, "DST changed to %s", internal_get_dst(0) ? "on" : "off");
-    server_send_time_change_indication(internal_get_time());
+    server_notify_change(CLOCKD_CHANGE_DST, internal_get_time());
   }
 
   next_dst_change(time(0), false);
@@ -848,6 +2390,7 @@ set_network_time(bool save_config)
 {
   struct tms buffer;
   clock_t now = times(&buffer);
+  unsigned int mask = CLOCKD_CHANGE_TIME;
   time_t t;
   int rv = -1;
 
@@ -859,8 +2402,10 @@ set_network_time(bool save_config)
         internal_tz_cmp(&server_tz[1], &saved_server_opertime_tz[1]))
     {
       snprintf(server_tz, sizeof(server_tz), "/%s", &saved_server_opertime_tz[1]);
+      server_state_changed();
       set_net_timezone(server_tz);
-      internal_setenv_tz(server_tz);
+      internal_set_local_tz(server_tz);
+      mask |= CLOCKD_CHANGE_TZ;
     }
 
     dump_date(server_tz);
@@ -868,7 +2413,7 @@ set_network_time(bool save_config)
     if (save_config)
     {
       save_conf();
-      server_send_time_change_indication(t);
+      server_pend_change(mask);
     }
 
     rv = 0;
@@ -880,23 +2425,100 @@ set_network_time(bool save_config)
 void
 server_quit(void)
 {
+  bool set_time = pending.set_time;
+  time_t written;
+
   DO_LOG(LOG_DEBUG, "shutting down");
 
+  conf_watch_quit();
+  server_commit();
+
+  /* the commit's completion does not run any more */
+  slew_quit();
+  written = rtc_sync_quit(set_time);
+
+  if (written)
+    rtc_written = written;
+
+  /* the RTC runs alone from here, the drift model needs to know since when */
+  if (save_id || written)
+    server_save();
+
+  worker_quit();
+  internal_rclockd_quit();
+  zone_index_quit();
+
+  reader_quit();
+  sock_server_quit();
+
+  DO_LOG(LOG_INFO, "setters admitted %u, throttled %u", requests_admitted,
+         requests_throttled);
+
+  if (buckets)
+  {
+    g_hash_table_destroy(buckets);
+    buckets = NULL;
+  }
+
   if (dbus_connection)
   {
     mcc_tz_utils_quit();
     dbus_bus_remove_match(dbus_connection, MCE_MATCH_RULE, 0);
     dbus_bus_remove_match(dbus_connection, CSD_TIMEINFO_CHANGE_MATCH_RULE, 0);
+
+    if (subscribers)
+    {
+      GHashTableIter iter;
+      gpointer name;
+
+      g_hash_table_iter_init(&iter, subscribers);
+
+      while (g_hash_table_iter_next(&iter, &name, NULL))
+        server_watch_name(name, false);
+    }
+
+    dbus_connection_remove_filter(dbus_connection, server_filter, 0);
     dbus_connection_unref(dbus_connection);
     dbus_connection = 0;
   }
 
   if (dbus_system_connection)
   {
-    dbus_connection_remove_filter(dbus_system_connection, server_filter, 0);
+    if (flush_id)
+    {
+      g_source_remove(flush_id);
+      flush_id = 0;
+    }
+
+    dbus_connection_flush(dbus_system_connection);
+    dbus_connection_unregister_object_path(dbus_system_connection,
+                                           "/com/nokia/clockd");
+    dbus_connection_close(dbus_system_connection);
     dbus_connection_unref(dbus_system_connection);
     dbus_system_connection = 0;
   }
+
+  if (reader_context)
+  {
+    g_main_context_unref(reader_context);
+    reader_context = NULL;
+  }
+
+  server_snapshot_set(NULL);
+
+  if (subscribers)
+  {
+    g_hash_table_destroy(subscribers);
+    subscribers = NULL;
+  }
+}
+
+static void
+server_zone_data_changed(void)
+{
+  DO_LOG(LOG_INFO, "time zone data changed");
+  next_dst_change(time(0), 0);
+  server_pend_change(CLOCKD_CHANGE_ZONEDATA);
 }
 
 static void
@@ -951,6 +2573,89 @@ server_init_time_format()
   }
 }
 
+static void
+server_init_commit_delay()
+{
+  const char *s = getenv("CLOCKD_COMMIT_DELAY");
+
+  if (s)
+  {
+    commit_delay = strtoul(s, NULL, 10);
+
+    if (commit_delay > 1000)
+      commit_delay = 1000;
+
+    DO_LOG(LOG_DEBUG, "changes are committed after %u ms", commit_delay);
+  }
+}
+
+static void
+server_init_save_delay()
+{
+  const char *s = getenv("CLOCKD_SAVE_DELAY");
+
+  if (s)
+  {
+    save_delay = strtoul(s, NULL, 10);
+
+    if (save_delay > 60000)
+      save_delay = 60000;
+
+    DO_LOG(LOG_DEBUG, "configuration is saved after %u ms", save_delay);
+  }
+}
+
+/* s between RTC writes when the time is not set, CLOCKD_RTC_PERIOD */
+static unsigned int
+server_init_rtc_period()
+{
+  const char *s = getenv("CLOCKD_RTC_PERIOD");
+  unsigned int period = 3600;
+
+  if (s)
+  {
+    period = strtoul(s, NULL, 10);
+    DO_LOG(LOG_DEBUG, "RTC written every %u s", period);
+  }
+
+  return period;
+}
+
+/* ms, smaller network time offsets are slewed, CLOCKD_SLEW_THRESHOLD */
+static unsigned int
+server_init_slew_threshold()
+{
+  const char *s = getenv("CLOCKD_SLEW_THRESHOLD");
+  unsigned int threshold = 2000;
+
+  if (s)
+  {
+    threshold = strtoul(s, NULL, 10);
+
+    /* at 500 ppm, 10 s take more than five hours */
+    if (threshold > 10000)
+      threshold = 10000;
+
+    DO_LOG(LOG_DEBUG, "offsets below %u ms are slewed", threshold);
+  }
+
+  return threshold;
+}
+
+/* saved, so that a power loss leaves the last write known */
+static void
+server_rtc_written(time_t at)
+{
+  rtc_written = at;
+  save_conf();
+}
+
+static void
+server_slew_step(int64_t realtime_ns, int64_t monotonic_ns)
+{
+  server_pend_time(realtime_ns, monotonic_ns, NULL);
+}
+
 static void
 server_init_default_tz()
 {
@@ -963,12 +2668,23 @@ server_init_default_tz()
   }
 }
 
+static void
+server_init_conf_owner()
+{
+  struct passwd *pw = getpwnam("user");
+  struct group *gr = getgrnam("users");
+
+  if (pw)
+    conf_uid = pw->pw_uid;
+
+  if (gr)
+    conf_gid = gr->gr_gid;
+}
+
 static int
-read_conf()
+conf_load(gchar **text)
 {
   struct stat st;
-  FILE *fp;
-  char line[512];
 
   /* FIXME - hardcoded home directory */
   if (stat("/home/user/", &st))
@@ -977,79 +2693,279 @@ read_conf()
            strerror(errno));
   }
 
-  fp = fopen("/home/user/.clockd.conf", "r");
-
-  if (!fp)
+  if (!g_file_get_contents(CLOCKD_CONFIGURATION_FILE, text, NULL, NULL))
   {
-    DO_LOG(LOG_DEBUG, "failed to read file %s (%s)", "/home/user/.clockd.conf",
-           strerror(errno));
+    DO_LOG(LOG_DEBUG, "failed to read file %s", CLOCKD_CONFIGURATION_FILE);
     return -1;
   }
 
-  line[sizeof(line) - 1] = 0;
+  return 0;
+}
 
-  while (1)
-  {
-    char *p = NULL;
+/* 'text' is modified */
+static void
+conf_parse(gchar *text, struct conf_values *v)
+{
+  char *line;
+  char *next = text;
 
-    do
-    {
-      if (!fgets(line, sizeof(line) - 1, fp))
-      {
-        DO_LOG(LOG_DEBUG, "configuration file %s read",
-               "/home/user/.clockd.conf");
-        fclose(fp);
-        return 0;
-      }
+  memset(v, 0, sizeof(*v));
 
-      if (line[0] == '#')
-        continue;
+  while ((line = strsep(&next, "\n")))
+  {
+    char *p;
 
-      p = strrchr(line, '\n');
-      if (p)
-        *p = 0;
+    if (line[0] == '#')
+      continue;
 
-      p = strrchr(line, '\r');
-      if (p)
-        *p = 0;
+    p = strrchr(line, '\r');
+    if (p)
+      *p = 0;
 
-      p = strchr(line, '=');
-    }
-    while (!p);
+    p = strchr(line, '=');
+    if (!p)
+      continue;
 
     *p = 0;
     p++;
 
     if (!strcmp(line, "time_format"))
     {
-      snprintf(time_format, sizeof(time_format), "%s", p);
-      DO_LOG(LOG_DEBUG, "read_conf: %s=%s", "time_format", time_format);
+      snprintf(v->time_format, sizeof(v->time_format), "%s", p);
+      v->have |= CONF_TIME_FORMAT;
+      DO_LOG(LOG_DEBUG, "read_conf: %s=%s", "time_format", v->time_format);
     }
     else if (!strcmp(line, "autosync"))
     {
-      if (!net_time_disabled_env)
-      {
-        autosync = atoi(p) > 0;
-        DO_LOG(LOG_DEBUG, "read_conf: %s=%d", "autosync", autosync);
-      }
-      else
-        DO_LOG(LOG_DEBUG, "read_conf: autosync disabled by env");
+      v->autosync = atoi(p) > 0;
+      v->have |= CONF_AUTOSYNC;
+      DO_LOG(LOG_DEBUG, "read_conf: %s=%d", "autosync", v->autosync);
     }
     else if (!strcmp(line, "net_tz"))
     {
-      snprintf(server_tz, sizeof(server_tz), "%s", p);
-      DO_LOG(LOG_DEBUG, "read_conf: %s=%s", "net_tz", server_tz);
+      snprintf(v->net_tz, sizeof(v->net_tz), "%s", p);
+      v->have |= CONF_NET_TZ;
+      DO_LOG(LOG_DEBUG, "read_conf: %s=%s", "net_tz", v->net_tz);
     }
     else if (!strcmp(line, "restore_tz"))
     {
-      snprintf(restore_tz, sizeof(restore_tz), "%s", p);
-      DO_LOG(LOG_DEBUG, "read_conf: %s=%s", "restore_tz", restore_tz);
+      snprintf(v->restore_tz, sizeof(v->restore_tz), "%s", p);
+      v->have |= CONF_RESTORE_TZ;
+      DO_LOG(LOG_DEBUG, "read_conf: %s=%s", "restore_tz", v->restore_tz);
     }
   }
+}
+
+static int
+read_conf()
+{
+  struct conf_values v;
+  gchar *text;
+
+  if (conf_load(&text))
+    return -1;
+
+  conf_parse(text, &v);
+  g_free(text);
+
+  if (v.have & CONF_TIME_FORMAT)
+    snprintf(time_format, sizeof(time_format), "%s", v.time_format);
+
+  if (v.have & CONF_AUTOSYNC)
+  {
+    if (!net_time_disabled_env)
+      autosync = v.autosync;
+    else
+      DO_LOG(LOG_DEBUG, "read_conf: autosync disabled by env");
+  }
+
+  if (v.have & CONF_NET_TZ)
+    snprintf(server_tz, sizeof(server_tz), "%s", v.net_tz);
+
+  if (v.have & CONF_RESTORE_TZ)
+    snprintf(restore_tz, sizeof(restore_tz), "%s", v.restore_tz);
+
+  DO_LOG(LOG_DEBUG, "configuration file %s read", CLOCKD_CONFIGURATION_FILE);
 
   return 0;
 }
 
+/*
+ * Applies a configuration file changed by someone else, osso-backup
+ * restore or an admin, like one apply_settings call: one commit, one
+ * notification. Our own writes are recognized by their content.
+ */
+static void
+server_conf_reload(void)
+{
+  struct conf_values v;
+  unsigned int mask = 0;
+  const char *tz = NULL;
+  gchar *text;
+  bool own;
+
+  /* the file may be about to be replaced by a save */
+  if (save_id || pending.save || saves_running)
+  {
+    conf_reload_deferred = true;
+    return;
+  }
+
+  conf_reload_deferred = false;
+
+  if (conf_load(&text))
+    return;
+
+  g_mutex_lock(&conf_written_lock);
+  own = !strcmp(text, conf_written);
+  g_mutex_unlock(&conf_written_lock);
+
+  if (own)
+  {
+    g_free(text);
+    return;
+  }
+
+  conf_parse(text, &v);
+  g_free(text);
+
+  if ((v.have & CONF_TIME_FORMAT) && strcmp(v.time_format, time_format))
+  {
+    if (server_time_format_valid(v.time_format))
+      mask |= CLOCKD_CHANGE_FORMAT;
+    else
+      DO_LOG(LOG_WARNING, "reload: invalid time format ignored");
+  }
+
+  if ((v.have & CONF_AUTOSYNC) && v.autosync != autosync)
+  {
+    if (server_autosync_valid(v.autosync))
+      mask |= CLOCKD_CHANGE_AUTOSYNC;
+    else
+      DO_LOG(LOG_DEBUG, "reload: autosync disabled by env");
+  }
+
+  if (v.have & CONF_RESTORE_TZ)
+    tz = v.restore_tz;
+  else if ((v.have & CONF_NET_TZ) && v.net_tz[0])
+    tz = v.net_tz;
+
+  if (tz && strcmp(tz, server_tz))
+  {
+    if (server_tz_valid(tz))
+      mask |= CLOCKD_CHANGE_TZ;
+    else
+      DO_LOG(LOG_WARNING, "reload: invalid time zone '%s' ignored", tz);
+  }
+
+  DO_LOG(LOG_INFO, "configuration file %s changed, applying 0x%x",
+         CLOCKD_CONFIGURATION_FILE, mask);
+
+  if (mask)
+    server_apply_settings(mask, tz, v.time_format, v.autosync);
+
+  /* rewritten without restore_tz, so it is not applied again */
+  if (v.have & CONF_RESTORE_TZ)
+    save_conf();
+}
+
+static void
+server_init_boot_id(void)
+{
+  FILE *fp = fopen("/proc/sys/kernel/random/boot_id", "r");
+
+  if (fp)
+  {
+    if (fgets(boot_id, sizeof(boot_id), fp))
+      boot_id[strcspn(boot_id, "\n")] = 0;
+
+    fclose(fp);
+  }
+}
+
+static bool
+server_conf_is_newer(void)
+{
+  struct stat conf_st;
+  struct stat state_st;
+
+  if (stat(CLOCKD_CONFIGURATION_FILE, &conf_st))
+    return false;
+
+  if (stat(STATE_FILE, &state_st))
+    return true;
+
+  if (conf_st.st_mtim.tv_sec != state_st.st_mtim.tv_sec)
+    return conf_st.st_mtim.tv_sec > state_st.st_mtim.tv_sec;
+
+  return conf_st.st_mtim.tv_nsec > state_st.st_mtim.tv_nsec;
+}
+
+/*
+ * Loads the state record. The text configuration is imported instead if
+ * there is no valid record or the text was changed after the record was
+ * saved, by osso-backup restore for instance.
+ */
+static void
+server_load_state(void)
+{
+  struct state st;
+
+  if (server_conf_is_newer() || state_load(&st))
+  {
+    if (!read_conf())
+    {
+      DO_LOG(LOG_INFO, "configuration imported from %s",
+             CLOCKD_CONFIGURATION_FILE);
+      save_conf();
+    }
+
+    return;
+  }
+
+  snprintf(time_format, sizeof(time_format), "%s", st.time_format);
+
+  if (!net_time_disabled_env)
+    autosync = st.autosync > 0;
+
+  snprintf(server_tz, sizeof(server_tz), "%s", st.tz);
+  nitz_time = st.nitz_time;
+  nitz_received = st.nitz_received;
+  rtc_written = st.rtc_written;
+  drift.span = st.drift_span;
+  drift.sum = st.drift_sum;
+  drift.ppb = st.drift_ppb;
+  drift.samples = st.drift_samples;
+  change_generation = st.change_generation + CHANGE_GENERATION_SKIP;
+
+  /* the RTC lost its time, do not start before the last save */
+  if (st.good_time > internal_get_time())
+  {
+    DO_LOG(LOG_WARNING, "system time is before the last saved time %lld",
+           (long long)st.good_time);
+    drift_reset(&drift);
+    server_pend_time(st.good_time * 1000000000,
+                     server_clock_ns(CLOCK_MONOTONIC), NULL);
+    save_conf();
+  }
+  else if (strcmp(st.boot_id, boot_id))
+  {
+    /* the clock has been read from the RTC, alone since its last write */
+    int64_t correction = drift_boot(&drift, st.rtc_written,
+                                    internal_get_time());
+
+    if (correction)
+    {
+      DO_LOG(LOG_INFO, "correcting the time by %lld ms for RTC drift",
+             (long long)(correction / 1000000));
+      server_pend_time(server_clock_ns(CLOCK_REALTIME) + correction,
+                       server_clock_ns(CLOCK_MONOTONIC), NULL);
+    }
+
+    save_conf();
+  }
+}
+
 static int
 get_autosync(void)
 {
@@ -1060,25 +2976,63 @@ int
 server_init()
 {
   DBusError error = DBUS_ERROR_INIT;
+  dbus_int64_t realtime;
+  dbus_int64_t monotonic;
+  struct passwd *pw;
   int retries;
   int rv = -1;
 
   DO_LOG(LOG_INFO, "starting up");
 
+  /* before the first thread */
+  internal_tz_init();
+
+  server_init_conf_owner();
+
+#ifdef CLOCKD_INPROCESS_PRIVILEGED
+  /* the socket in /run and the state directory need root */
+  sock_server_bind();
+
+  if (!state_dir_init(conf_uid, conf_gid) &&
+      !internal_privileged_init(conf_uid, conf_gid))
+  {
+    /* clockd is the owner of the configuration now, no chown */
+    conf_uid = (uid_t)-1;
+    conf_gid = (gid_t)-1;
+  }
+#endif
+
+  dbus_threads_init_default();
+
+  if (worker_init())
+    DO_LOG(LOG_WARNING, "no worker thread, running jobs synchronously");
+
+  rtc_sync_init(server_init_rtc_period(), server_rtc_written);
+  slew_init(server_init_slew_threshold(), server_slew_step);
+
+  if (zone_index_init(server_zone_data_changed))
+    DO_LOG(LOG_WARNING, "zone index not updated on time zone data changes");
+
   server_init_autosync();
   server_init_time_format();
   server_init_default_tz();
-  read_conf();
+  server_init_commit_delay();
+  server_init_save_delay();
+  server_init_boot_id();
+  server_load_state();
+
+  if (conf_watch_init(CLOCKD_CONFIGURATION_FILE, server_conf_reload))
+    DO_LOG(LOG_WARNING, "%s changes need a restart", CLOCKD_CONFIGURATION_FILE);
 
   if (restore_tz[0])
   {
-    internal_set_tz(restore_tz);
+    set_system_tz(restore_tz);
     restore_tz[0] = 0;
     save_conf();
   }
 
   if (server_tz[0])
-    internal_setenv_tz(server_tz);
+    internal_set_local_tz(server_tz);
   else
   {
     char buf[512];
@@ -1097,7 +3051,7 @@ server_init()
         snprintf(server_tz, sizeof(server_tz), ":%s", buf);
     }
 
-    internal_setenv_tz(":/etc/localtime");
+    internal_set_local_tz(":/etc/localtime");
   }
 
   DO_LOG(LOG_DEBUG,
@@ -1108,11 +3062,13 @@ server_init()
          time_format);
 
   was_dst = internal_get_dst(0);
+  change_step_base = server_clock_offset(&realtime, &monotonic);
   retries = 0;
 
   while (1)
   {
-    dbus_system_connection = dbus_bus_get(DBUS_BUS_SYSTEM, &error);
+    /* private, so that it can be served from the reader thread */
+    dbus_system_connection = dbus_bus_get_private(DBUS_BUS_SYSTEM, &error);
 
     if (dbus_system_connection)
       break;
@@ -1148,16 +3104,39 @@ server_init()
     goto out;
   }
 
-  dbus_connection_setup_with_g_main(dbus_system_connection, 0);
   dbus_connection_set_exit_on_disconnect(dbus_system_connection, 0);
 
-  if (!dbus_connection_add_filter(dbus_system_connection, server_filter, 0, 0))
+  if (server_init_methods())
   {
-    DO_LOG(LOG_ERR, "server_init(%s), dbus_connection_add_filter failed",
+    DO_LOG(LOG_ERR, "server_init(%s), no method hash seed found",
            "com.nokia.clockd");
     goto out;
   }
 
+  server_state_changed();
+
+  if (!dbus_connection_register_object_path(dbus_system_connection,
+                                            "/com/nokia/clockd",
+                                            &server_vtable, NULL))
+  {
+    DO_LOG(LOG_ERR,
+           "server_init(%s), dbus_connection_register_object_path failed",
+           "com.nokia.clockd");
+    goto out;
+  }
+
+  if (reader_init(dbus_system_connection))
+    dbus_connection_setup_with_g_main(dbus_system_connection, 0);
+
+  pw = getpwnam("user");
+
+  if (pw)
+    sock_setter_uid = pw->pw_uid;
+
+  if (sock_server_init(reader_context, server_sock_request))
+    DO_LOG(LOG_WARNING, "socket interface %s not available",
+           CLOCKD_SOCKET_PATH);
+
   dbus_connection = dbus_bus_get(DBUS_BUS_SYSTEM, &error);
 
   if (!dbus_connection)
@@ -1168,6 +3147,13 @@ server_init()
 
   dbus_connection_setup_with_g_main(dbus_connection, 0);
   dbus_connection_set_exit_on_disconnect(dbus_connection, 0);
+
+  if (!dbus_connection_add_filter(dbus_connection, server_filter, 0, 0))
+  {
+    DO_LOG(LOG_ERR, "server_init(%s), dbus_connection_add_filter failed",
+           "com.nokia.clockd");
+    goto out;
+  }
   /* FIXME - error handling */
   dbus_bus_add_match(dbus_connection, CSD_TIMEINFO_CHANGE_MATCH_RULE, &error);
   dbus_bus_add_match(dbus_connection, MCE_MATCH_RULE, &error);
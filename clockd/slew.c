@@ -0,0 +1,211 @@
+#include <sys/time.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "logging.h"
+#include "internal_time_utils.h"
+#include "worker.h"
+#include "rtc_sync.h"
+#include "slew.h"
+
+/*
+ * Corrects small offsets by slewing the clock instead of stepping it:
+ * the time never jumps, backwards least of all, and clients are not
+ * told. The kernel slews at SLEW_RATE ppm, 'threshold' ms bounds how
+ * long a correction takes. Progress is read every SLEW_POLL seconds,
+ * that needs no privileges. Once done, the RTC follows.
+ */
+
+#define SLEW_RATE 500
+#define SLEW_POLL 30
+
+struct slew_job
+{
+  int64_t offset;
+  int64_t realtime;   /* CLOCK_REALTIME when the offset was measured */
+  int64_t monotonic;  /* and CLOCK_MONOTONIC */
+};
+
+struct slew_stats
+{
+  unsigned int slews;
+  unsigned int completed;
+  unsigned int replaced;
+  unsigned int stepped;
+  unsigned int failures;
+};
+
+static int64_t slew_threshold = 0;
+static slew_step_func slew_step = NULL;
+static guint slew_poll_id = 0;
+static gint64 slew_started = 0;
+static int64_t slew_offset = 0;
+static struct slew_stats stats;
+
+static int64_t
+slew_ns(clockid_t clock_id)
+{
+  struct timespec ts;
+
+  clock_gettime(clock_id, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+slew_stop(void)
+{
+  if (slew_poll_id)
+  {
+    g_source_remove(slew_poll_id);
+    slew_poll_id = 0;
+  }
+
+  slew_offset = 0;
+}
+
+static gboolean
+slew_poll(gpointer user_data)
+{
+  struct timeval left;
+  int64_t us;
+
+  if (adjtime(NULL, &left))
+  {
+    DO_LOG(LOG_WARNING, "adjtime() failed (%s), slew not tracked",
+           strerror(errno));
+    slew_poll_id = 0;
+    slew_offset = 0;
+    return FALSE;
+  }
+
+  us = (int64_t)left.tv_sec * 1000000 + left.tv_usec;
+
+  if (us)
+  {
+    DO_LOG(LOG_DEBUG, "slew %lld us of %lld us left", (long long)us,
+           (long long)(slew_offset / 1000));
+    return TRUE;
+  }
+
+  DO_LOG(LOG_INFO, "slew by %lld ms done in %lld s",
+         (long long)(slew_offset / 1000000),
+         (long long)((g_get_monotonic_time() - slew_started) /
+                     G_USEC_PER_SEC));
+  stats.completed++;
+  slew_poll_id = 0;
+  slew_offset = 0;
+  rtc_sync_request();
+
+  return FALSE;
+}
+
+static int
+slew_job(void *data)
+{
+  struct slew_job *job = data;
+  struct timespec delta;
+
+  /* tv_nsec must not be negative */
+  delta.tv_sec = job->offset / 1000000000;
+  delta.tv_nsec = job->offset % 1000000000;
+
+  if (delta.tv_nsec < 0)
+  {
+    delta.tv_sec--;
+    delta.tv_nsec += 1000000000;
+  }
+
+  return internal_adj_time(&delta);
+}
+
+static void
+slew_done(int rv, void *data)
+{
+  struct slew_job *job = data;
+
+  if (!rv)
+  {
+    if (slew_poll_id)
+      stats.replaced++;
+    else
+      slew_poll_id = g_timeout_add_seconds(SLEW_POLL, slew_poll, NULL);
+
+    stats.slews++;
+    slew_started = g_get_monotonic_time();
+    slew_offset = job->offset;
+
+    return;
+  }
+
+  DO_LOG(LOG_WARNING, "slew by %lld ms failed (%s), stepping",
+         (long long)(job->offset / 1000000), strerror(rv));
+  stats.failures++;
+  slew_stop();
+  slew_step(job->realtime + job->offset, job->monotonic);
+}
+
+/*
+ * Corrects the clock by 'offset_ns' if it is below the threshold, 0 if
+ * so. Should slewing then fail, the clock is stepped. -1 means the
+ * caller has to step the clock.
+ */
+int
+slew_start(int64_t offset_ns)
+{
+  struct slew_job *job;
+
+  if (!offset_ns || (offset_ns < 0 ? -offset_ns : offset_ns) >= slew_threshold)
+    return -1;
+
+  DO_LOG(LOG_DEBUG, "slewing by %lld ms, about %lld s",
+         (long long)(offset_ns / 1000000),
+         (long long)((offset_ns < 0 ? -offset_ns : offset_ns) /
+                     (SLEW_RATE * 1000)));
+
+  job = g_new(struct slew_job, 1);
+  job->offset = offset_ns;
+  job->realtime = slew_ns(CLOCK_REALTIME);
+  job->monotonic = slew_ns(CLOCK_MONOTONIC);
+  worker_push(slew_job, slew_done, job, g_free);
+
+  return 0;
+}
+
+/* the clock has been stepped, that cancels a slew in progress */
+void
+slew_stepped(void)
+{
+  if (slew_poll_id)
+  {
+    DO_LOG(LOG_DEBUG, "slew cancelled by a step");
+    stats.stepped++;
+  }
+
+  slew_stop();
+}
+
+/* offsets below 'threshold' ms are slewed, 0 for never */
+void
+slew_init(unsigned int threshold, slew_step_func step)
+{
+  memset(&stats, 0, sizeof(stats));
+  slew_threshold = (int64_t)threshold * 1000000;
+  slew_step = step;
+}
+
+/* a slew in progress is left to the kernel */
+void
+slew_quit(void)
+{
+  slew_stop();
+
+  DO_LOG(LOG_INFO, "slews %u, completed %u, replaced %u, stepped %u, "
+         "failed %u", stats.slews, stats.completed, stats.replaced,
+         stats.stepped, stats.failures);
+}
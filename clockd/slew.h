@@ -0,0 +1,14 @@
+#ifndef SLEW_H
+#define SLEW_H
+
+#include <stdint.h>
+
+/* steps the clock when slewing fails, see server_pend_time() */
+typedef void (*slew_step_func)(int64_t realtime_ns, int64_t monotonic_ns);
+
+void slew_init(unsigned int threshold, slew_step_func step);
+void slew_quit(void);
+int slew_start(int64_t offset_ns);
+void slew_stepped(void);
+
+#endif // SLEW_H
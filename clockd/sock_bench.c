@@ -0,0 +1,182 @@
+/*
+ * Per call latency of a clockd getter over the socket and over D-Bus,
+ * against the running clockd. Both ask for the zone, one call at a time
+ * like libtime does.
+ *
+ *   sock_bench [calls]
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <dbus/dbus.h>
+
+#include "libtime.h"
+#include "clock_dbus.h"
+#include "clock_sock.h"
+
+static double
+bench_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+  double d = *(const double *)a - *(const double *)b;
+
+  return d < 0 ? -1 : d > 0;
+}
+
+static void
+bench_report(const char *name, double *us, int n)
+{
+  double sum = 0;
+  int i;
+
+  qsort(us, n, sizeof(*us), bench_cmp);
+
+  for (i = 0; i < n; i++)
+    sum += us[i];
+
+  printf("%-7s %8.1f %8.1f %8.1f %8.1f %8.1f\n", name, us[0], us[n / 2],
+         sum / n, us[n - n / 100 - 1], us[n - 1]);
+}
+
+static int
+bench_sock(double *us, int n)
+{
+  struct sockaddr_un addr;
+  struct clock_sock_req req;
+  struct clock_sock_rsp rsp;
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  int i;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", CLOCKD_SOCKET_PATH);
+
+  if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+  {
+    fprintf(stderr, "%s: %s\n", CLOCKD_SOCKET_PATH, strerror(errno));
+    return -1;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.version = CLOCK_SOCK_VERSION;
+  req.op = CLOCK_SOCK_GET_TZ;
+
+  for (i = 0; i < n; i++)
+  {
+    double t = bench_us();
+
+    req.seq = i + 1;
+
+    if (send(fd, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req) ||
+        recv(fd, &rsp, sizeof(rsp), 0) != sizeof(rsp) || rsp.status)
+    {
+      fprintf(stderr, "socket call %d failed\n", i);
+      close(fd);
+      return -1;
+    }
+
+    us[i] = bench_us() - t;
+  }
+
+  close(fd);
+
+  return 0;
+}
+
+static int
+bench_dbus(double *us, int n)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusConnection *conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, &error);
+  int rv = 0;
+  int i;
+
+  if (!conn)
+  {
+    fprintf(stderr, "D-Bus: %s\n", error.message);
+    dbus_error_free(&error);
+    return -1;
+  }
+
+  for (i = 0; i < n && !rv; i++)
+  {
+    double t = bench_us();
+    DBusMessage *req = dbus_message_new_method_call(CLOCKD_SERVICE,
+                                                    CLOCKD_PATH,
+                                                    CLOCKD_INTERFACE,
+                                                    CLOCKD_GET_TZ);
+    DBusMessage *rsp = NULL;
+
+    if (req)
+    {
+      rsp = dbus_connection_send_with_reply_and_block(conn, req, -1, &error);
+      dbus_message_unref(req);
+    }
+
+    if (rsp)
+    {
+      us[i] = bench_us() - t;
+      dbus_message_unref(rsp);
+    }
+    else
+    {
+      fprintf(stderr, "D-Bus call %d failed: %s\n", i,
+              dbus_error_is_set(&error) ? error.message : "no memory");
+      rv = -1;
+    }
+  }
+
+  dbus_error_free(&error);
+  dbus_connection_close(conn);
+  dbus_connection_unref(conn);
+
+  return rv;
+}
+
+int
+main(int argc, char **argv)
+{
+  int n = argc > 1 ? atoi(argv[1]) : 10000;
+  double *us = malloc(n * sizeof(*us));
+  int rv = 0;
+
+  if (n <= 0 || !us)
+  {
+    fprintf(stderr, "usage: %s [calls]\n", argv[0]);
+    return 2;
+  }
+
+  printf("%d %s calls, microseconds\n", n, CLOCKD_GET_TZ);
+  printf("%-7s %8s %8s %8s %8s %8s\n", "", "min", "median", "mean", "99%",
+         "max");
+
+  if (!bench_sock(us, n))
+    bench_report("socket", us, n);
+  else
+    rv = 1;
+
+  if (!bench_dbus(us, n))
+    bench_report("D-Bus", us, n);
+  else
+    rv = 1;
+
+  free(us);
+
+  return rv;
+}
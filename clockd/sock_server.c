@@ -0,0 +1,313 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#include <glib.h>
+
+#include "logging.h"
+#include "sock_server.h"
+
+/*
+ * Listener for the clockd socket protocol. Clients are reference counted
+ * so that a reply can be sent after the request has been passed to
+ * another thread; the descriptor is closed only with the last reference.
+ */
+
+struct sock_client
+{
+  gint ref;
+  int fd;
+  struct ucred cred;
+  bool counted;
+};
+
+/*
+ * The socket is open to everyone: clients are limited so that no local
+ * user can use up clockd's descriptors, and with them the D-Bus side.
+ * Root only counts against the total.
+ */
+#define SOCK_MAX_CLIENTS 512
+#define SOCK_MAX_CLIENTS_PER_UID 128
+
+static GMutex clients_lock;
+static GHashTable *clients_per_uid = NULL;
+static unsigned int clients = 0;
+
+static int listen_fd = -1;
+static GSource *listen_source = NULL;
+static GMainContext *sock_context = NULL;
+static sock_request_func request_func = NULL;
+
+static bool
+sock_client_count(struct sock_client *client)
+{
+  gpointer uid = GUINT_TO_POINTER(client->cred.uid);
+  unsigned int n;
+
+  g_mutex_lock(&clients_lock);
+
+  if (!clients_per_uid)
+    clients_per_uid = g_hash_table_new(NULL, NULL);
+
+  n = GPOINTER_TO_UINT(g_hash_table_lookup(clients_per_uid, uid));
+
+  if (clients < SOCK_MAX_CLIENTS &&
+      (!client->cred.uid || n < SOCK_MAX_CLIENTS_PER_UID))
+  {
+    g_hash_table_insert(clients_per_uid, uid, GUINT_TO_POINTER(n + 1));
+    clients++;
+    client->counted = true;
+  }
+
+  g_mutex_unlock(&clients_lock);
+
+  return client->counted;
+}
+
+static void
+sock_client_uncount(struct sock_client *client)
+{
+  gpointer uid = GUINT_TO_POINTER(client->cred.uid);
+  unsigned int n;
+
+  g_mutex_lock(&clients_lock);
+  n = GPOINTER_TO_UINT(g_hash_table_lookup(clients_per_uid, uid));
+
+  if (n > 1)
+    g_hash_table_insert(clients_per_uid, uid, GUINT_TO_POINTER(n - 1));
+  else
+    g_hash_table_remove(clients_per_uid, uid);
+
+  clients--;
+  g_mutex_unlock(&clients_lock);
+}
+
+struct sock_client *
+sock_client_ref(struct sock_client *client)
+{
+  g_atomic_int_inc(&client->ref);
+
+  return client;
+}
+
+void
+sock_client_unref(struct sock_client *client)
+{
+  if (g_atomic_int_dec_and_test(&client->ref))
+  {
+    if (client->counted)
+      sock_client_uncount(client);
+
+    close(client->fd);
+    g_free(client);
+  }
+}
+
+static void
+sock_client_unref_notify(gpointer data)
+{
+  sock_client_unref(data);
+}
+
+const struct ucred *
+sock_client_cred(const struct sock_client *client)
+{
+  return &client->cred;
+}
+
+int
+sock_client_reply(struct sock_client *client, struct clock_sock_rsp *rsp)
+{
+  rsp->version = CLOCK_SOCK_VERSION;
+  rsp->str[sizeof(rsp->str) - 1] = 0;
+
+  if (send(client->fd, rsp, sizeof(*rsp), MSG_NOSIGNAL | MSG_DONTWAIT) !=
+      sizeof(*rsp))
+  {
+    DO_LOG(LOG_DEBUG, "sock_client_reply() pid %d, %s", (int)client->cred.pid,
+           strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static gboolean
+sock_client_io(GIOChannel *channel, GIOCondition cond, gpointer data)
+{
+  struct sock_client *client = data;
+  struct clock_sock_req req;
+  ssize_t len;
+
+  if (!(cond & G_IO_IN))
+    return FALSE;
+
+  len = recv(client->fd, &req, sizeof(req), MSG_DONTWAIT);
+
+  if (len == -1 && (errno == EAGAIN || errno == EINTR))
+    return TRUE;
+
+  if (len <= 0)
+    return FALSE;
+
+  if (len != sizeof(req) || req.version != CLOCK_SOCK_VERSION)
+  {
+    struct clock_sock_rsp rsp;
+
+    memset(&rsp, 0, sizeof(rsp));
+    rsp.status = -EPROTO;
+
+    if (len >= 8)
+    {
+      rsp.op = req.op;
+      rsp.seq = req.seq;
+    }
+
+    sock_client_reply(client, &rsp);
+
+    return TRUE;
+  }
+
+  req.str[sizeof(req.str) - 1] = 0;
+  request_func(client, &req);
+
+  return TRUE;
+}
+
+static void
+sock_watch(int fd, GIOFunc func, gpointer data, GDestroyNotify notify,
+           GSource **source)
+{
+  GIOChannel *channel = g_io_channel_unix_new(fd);
+  GSource *src = g_io_create_watch(channel, G_IO_IN | G_IO_ERR | G_IO_HUP);
+
+  g_source_set_callback(src, (GSourceFunc)func, data, notify);
+  g_source_attach(src, sock_context);
+  g_io_channel_unref(channel);
+
+  if (source)
+    *source = src;
+  else
+    g_source_unref(src);
+}
+
+static gboolean
+sock_accept(GIOChannel *channel, GIOCondition cond, gpointer data)
+{
+  struct sock_client *client;
+  socklen_t len;
+  int fd;
+
+  fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+  if (fd == -1)
+  {
+    if (errno != EAGAIN && errno != EINTR)
+      DO_LOG(LOG_ERR, "sock_accept() %s", strerror(errno));
+
+    return TRUE;
+  }
+
+  client = g_new0(struct sock_client, 1);
+  client->ref = 1;
+  client->fd = fd;
+  len = sizeof(client->cred);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &client->cred, &len))
+  {
+    DO_LOG(LOG_ERR, "sock_accept() SO_PEERCRED %s", strerror(errno));
+    sock_client_unref(client);
+    return TRUE;
+  }
+
+  /* closed at once, libtime falls back to D-Bus */
+  if (!sock_client_count(client))
+  {
+    DO_LOG(LOG_DEBUG, "sock_accept() pid %d uid %d refused, too many clients",
+           (int)client->cred.pid, (int)client->cred.uid);
+    sock_client_unref(client);
+    return TRUE;
+  }
+
+  /* the watch owns the first reference */
+  sock_watch(fd, sock_client_io, client, sock_client_unref_notify, NULL);
+
+  return TRUE;
+}
+
+/*
+ * Creates the listening socket, sock_server_init() does if not called
+ * before. For clockd to bind in /run before giving up root.
+ */
+int
+sock_server_bind(void)
+{
+  struct sockaddr_un addr;
+
+  if (listen_fd != -1)
+    return 0;
+
+  listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     0);
+
+  if (listen_fd == -1)
+  {
+    DO_LOG(LOG_ERR, "sock_server_init() socket %s", strerror(errno));
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", CLOCKD_SOCKET_PATH);
+  unlink(CLOCKD_SOCKET_PATH);
+
+  /* anyone may connect, setters are checked against the peer credentials */
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      chmod(CLOCKD_SOCKET_PATH, 0666) || listen(listen_fd, 16))
+  {
+    DO_LOG(LOG_ERR, "sock_server_init() %s %s", CLOCKD_SOCKET_PATH,
+           strerror(errno));
+    close(listen_fd);
+    listen_fd = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+sock_server_init(GMainContext *context, sock_request_func func)
+{
+  if (sock_server_bind())
+    return -1;
+
+  sock_context = context;
+  request_func = func;
+  sock_watch(listen_fd, sock_accept, NULL, NULL, &listen_source);
+
+  return 0;
+}
+
+void
+sock_server_quit(void)
+{
+  if (listen_source)
+  {
+    g_source_destroy(listen_source);
+    g_source_unref(listen_source);
+    listen_source = NULL;
+  }
+
+  if (listen_fd != -1)
+  {
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(CLOCKD_SOCKET_PATH);
+  }
+}
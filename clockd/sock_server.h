@@ -0,0 +1,24 @@
+#ifndef SOCK_SERVER_H
+#define SOCK_SERVER_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include "clock_sock.h"
+
+struct sock_client;
+
+/* runs in the context given to sock_server_init() */
+typedef void (*sock_request_func)(struct sock_client *client,
+                                  const struct clock_sock_req *req);
+
+int sock_server_bind(void);
+int sock_server_init(GMainContext *context, sock_request_func func);
+void sock_server_quit(void);
+struct sock_client *sock_client_ref(struct sock_client *client);
+void sock_client_unref(struct sock_client *client);
+const struct ucred *sock_client_cred(const struct sock_client *client);
+int sock_client_reply(struct sock_client *client, struct clock_sock_rsp *rsp);
+
+#endif // SOCK_SERVER_H
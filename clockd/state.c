@@ -0,0 +1,208 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include "logging.h"
+#include "state.h"
+
+/*
+ * Binary state record, read with one read() at startup. A bad magic,
+ * version, size or checksum makes state_load() fail and clockd imports
+ * the text configuration instead. Both files are replaced atomically.
+ */
+
+#define STATE_MAGIC 0x444b4c43 /* "CLKD" */
+#define STATE_VERSION 1
+
+struct state_header
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;
+  uint32_t crc;
+  uint32_t reserved;
+};
+
+struct state_record
+{
+  struct state_header hdr;
+  struct state state;
+};
+
+/* generation of the last record loaded or saved, worker thread */
+static uint32_t state_generation = 0;
+
+/* CRC-32 (IEEE), the record is small enough to go without a table */
+static uint32_t
+state_crc(const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  uint32_t crc = 0xffffffff;
+  int i;
+
+  while (len--)
+  {
+    crc ^= *p++;
+
+    for (i = 0; i < 8; i++)
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+
+  return ~crc;
+}
+
+int
+state_load(struct state *st)
+{
+  struct state_record rec;
+  ssize_t bytes;
+  int fd = open(STATE_FILE, O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1)
+  {
+    DO_LOG(LOG_DEBUG, "failed to open state file %s (%s)", STATE_FILE,
+           strerror(errno));
+    return -1;
+  }
+
+  memset(&rec, 0, sizeof(rec));
+  bytes = read(fd, &rec, sizeof(rec));
+  close(fd);
+
+  if (bytes < (ssize_t)sizeof(rec.hdr) || rec.hdr.magic != STATE_MAGIC ||
+      rec.hdr.version != STATE_VERSION || rec.hdr.size != sizeof(rec.state) ||
+      bytes != (ssize_t)sizeof(rec))
+  {
+    DO_LOG(LOG_WARNING, "state file %s ignored, unknown format", STATE_FILE);
+    return -1;
+  }
+
+  if (rec.hdr.crc != state_crc(&rec.state, sizeof(rec.state)))
+  {
+    DO_LOG(LOG_WARNING, "state file %s ignored, bad checksum", STATE_FILE);
+    return -1;
+  }
+
+  rec.state.tz[sizeof(rec.state.tz) - 1] = 0;
+  rec.state.time_format[sizeof(rec.state.time_format) - 1] = 0;
+  rec.state.boot_id[sizeof(rec.state.boot_id) - 1] = 0;
+  *st = rec.state;
+  state_generation = st->generation;
+
+  DO_LOG(LOG_DEBUG, "state file %s loaded, generation %u", STATE_FILE,
+         st->generation);
+
+  return 0;
+}
+
+/* for a clockd that does not run as root, before it gives root up */
+int
+state_dir_init(uid_t uid, gid_t gid)
+{
+  if (mkdir(STATE_DIR, 0755) && errno != EEXIST)
+  {
+    DO_LOG(LOG_ERR, "failed to create %s (%s)", STATE_DIR, strerror(errno));
+    return -1;
+  }
+
+  if (chown(STATE_DIR, uid, gid))
+  {
+    DO_LOG(LOG_ERR, "failed to chown %s (%s)", STATE_DIR, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* runs in the worker thread */
+int
+state_save(struct state *st)
+{
+  struct state_record rec;
+
+  if (mkdir(STATE_DIR, 0755) && errno != EEXIST)
+  {
+    DO_LOG(LOG_ERR, "failed to create %s (%s)", STATE_DIR, strerror(errno));
+    return -1;
+  }
+
+  st->generation = ++state_generation;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.hdr.magic = STATE_MAGIC;
+  rec.hdr.version = STATE_VERSION;
+  rec.hdr.size = sizeof(rec.state);
+  rec.state = *st;
+  rec.hdr.crc = state_crc(&rec.state, sizeof(rec.state));
+
+  return state_replace_file(STATE_FILE, &rec, sizeof(rec), (uid_t)-1,
+                            (gid_t)-1);
+}
+
+/*
+ * Writes 'buf' to 'path'.tmp which replaces 'path' once its data is on
+ * disk, so 'path' is never seen empty or partially written, not even
+ * after a crash. The directory is synced too, callers debounce writes.
+ */
+int
+state_replace_file(const char *path, const void *buf, size_t len, uid_t uid,
+                   gid_t gid)
+{
+  char tmp[256];
+  char dir[256];
+  char *p;
+  int fd;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  /* left by a crash, maybe by another user */
+  unlink(tmp);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+  if (fd == -1)
+  {
+    DO_LOG(LOG_ERR, "failed to open %s (%s)", tmp, strerror(errno));
+    return -1;
+  }
+
+  if ((uid != (uid_t)-1 || gid != (gid_t)-1) && fchown(fd, uid, gid))
+    DO_LOG(LOG_WARNING, "failed to chown %s (%s)", tmp, strerror(errno));
+
+  if (write(fd, buf, len) != (ssize_t)len || fsync(fd))
+  {
+    DO_LOG(LOG_ERR, "failed to write %s (%s)", tmp, strerror(errno));
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+
+  close(fd);
+
+  if (rename(tmp, path))
+  {
+    DO_LOG(LOG_ERR, "failed to rename %s (%s)", tmp, strerror(errno));
+    unlink(tmp);
+    return -1;
+  }
+
+  snprintf(dir, sizeof(dir), "%s", path);
+  p = strrchr(dir, '/');
+
+  if (p && p != dir)
+  {
+    *p = 0;
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd != -1)
+    {
+      fsync(fd);
+      close(fd);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clock_dbus.h"
+
+/* tests build with their own */
+#ifndef STATE_DIR
+#define STATE_DIR "/var/lib/clockd"
+#endif
+#define STATE_FILE STATE_DIR "/state"
+
+/* persistent state, stored as is after a checksummed header */
+struct state
+{
+  char tz[CLOCKD_TZ_SIZE];                   /* network or user zone */
+  char time_format[CLOCKD_GET_TIMEFMT_SIZE];
+  int64_t nitz_time;                         /* last network time, UTC */
+  int64_t nitz_received;                     /* system time it came at */
+  int64_t good_time;                         /* system time when saved */
+  int32_t autosync;
+  uint32_t generation;                       /* bumped by state_save() */
+  int64_t rtc_written;                       /* system time of the write */
+  int64_t drift_span;                        /* see struct drift */
+  int64_t drift_sum;
+  int32_t drift_ppb;
+  int32_t drift_samples;
+  uint64_t change_generation;                /* last time_changed_ex */
+  char boot_id[40];                          /* boot of the last save */
+};
+
+int state_load(struct state *st);
+int state_save(struct state *st);
+int state_dir_init(uid_t uid, gid_t gid);
+int state_replace_file(const char *path, const void *buf, size_t len,
+                       uid_t uid, gid_t gid);
+
+#endif // STATE_H
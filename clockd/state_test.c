@@ -0,0 +1,135 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "logging.h"
+#include "state.h"
+#include "test.h"
+
+/* built with STATE_DIR in the build directory */
+
+bool clockd_debug_mode = false;
+
+/* offsets in the header, see state.c */
+#define HDR_VERSION 4
+#define HDR_SIZE 6
+#define HDR_CRC 8
+#define HDR_LEN 16
+
+static struct state saved;
+
+static void
+fill(struct state *st)
+{
+  memset(st, 0, sizeof(*st));
+  snprintf(st->tz, sizeof(st->tz), ":Europe/Helsinki");
+  snprintf(st->time_format, sizeof(st->time_format), "%%R");
+  st->nitz_time = 1700000000;
+  st->nitz_received = 1700000100;
+  st->good_time = 1700000200;
+  st->autosync = 1;
+  st->drift_ppb = -20000;
+  st->drift_samples = 3;
+  st->change_generation = 0x10005;
+}
+
+static int
+rewrite(long off, const void *data, size_t len)
+{
+  int fd = open(STATE_FILE, O_WRONLY);
+  int rv;
+
+  if (fd == -1)
+    return -1;
+
+  rv = pwrite(fd, data, len, off) == (ssize_t)len ? 0 : -1;
+  close(fd);
+
+  return rv;
+}
+
+static void
+test_save_load(void)
+{
+  struct state st;
+  uint32_t generation;
+
+  fill(&saved);
+  CHECK(!state_save(&saved));
+  generation = saved.generation;
+  CHECK(generation > 0);
+
+  memset(&st, 0xff, sizeof(st));
+  CHECK(!state_load(&st));
+  CHECK(!memcmp(&st, &saved, sizeof(st)));
+
+  /* generations go on from what was loaded */
+  CHECK(!state_save(&saved));
+  CHECK(saved.generation == generation + 1);
+  CHECK(access(STATE_FILE ".tmp", F_OK));
+}
+
+static void
+test_corrupt(void)
+{
+  struct state st;
+  uint16_t v16;
+  uint32_t v32;
+  char c = 'x';
+
+  /* a flipped byte of the state */
+  CHECK(!state_save(&saved));
+  CHECK(!rewrite(HDR_LEN + 3, &c, 1));
+  CHECK(state_load(&st) == -1);
+
+  /* a bad checksum */
+  CHECK(!state_save(&saved));
+  v32 = 0;
+  CHECK(!rewrite(HDR_CRC, &v32, sizeof(v32)));
+  CHECK(state_load(&st) == -1);
+
+  /* another version or layout */
+  CHECK(!state_save(&saved));
+  v16 = 2;
+  CHECK(!rewrite(HDR_VERSION, &v16, sizeof(v16)));
+  CHECK(state_load(&st) == -1);
+
+  CHECK(!state_save(&saved));
+  v16 = sizeof(struct state) - 8;
+  CHECK(!rewrite(HDR_SIZE, &v16, sizeof(v16)));
+  CHECK(state_load(&st) == -1);
+
+  /* cut short */
+  CHECK(!state_save(&saved));
+  CHECK(!truncate(STATE_FILE, HDR_LEN + sizeof(struct state) - 1));
+  CHECK(state_load(&st) == -1);
+
+  CHECK(!truncate(STATE_FILE, 2));
+  CHECK(state_load(&st) == -1);
+
+  CHECK(!unlink(STATE_FILE));
+  CHECK(state_load(&st) == -1);
+
+  /* good again */
+  CHECK(!state_save(&saved));
+  CHECK(!state_load(&st));
+}
+
+int
+main(void)
+{
+  mkdir(STATE_DIR, 0755);
+  unlink(STATE_FILE);
+
+  test_save_load();
+  test_corrupt();
+
+  unlink(STATE_FILE);
+  rmdir(STATE_DIR);
+
+  return TEST_RESULT;
+}
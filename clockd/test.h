@@ -0,0 +1,24 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+/*
+ * Unit checks run by "make check". A failed CHECK() is reported and the
+ * test goes on, main() returns TEST_RESULT.
+ */
+
+static int test_failures = 0;
+
+#define CHECK(__cond__) \
+do { \
+  if (!(__cond__)) \
+  { \
+    fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #__cond__); \
+    test_failures++; \
+  } \
+} while(0)
+
+#define TEST_RESULT (test_failures ? 1 : 0)
+
+#endif // TEST_H
@@ -0,0 +1,1008 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <locale.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "civil.h"
+#include "timefmt.h"
+
+/* Formats longer than this are passed to strftime() as they are */
+#define TIMEFMT_MAX_FMT_LEN 1024
+#define TIMEFMT_NAME_SIZE 128
+#define TIMEFMT_CACHE_SIZE 8
+
+struct timefmt_names
+{
+  int valid;
+  char locale[128];
+  char wday_abbr[7][TIMEFMT_NAME_SIZE];
+  char wday_full[7][TIMEFMT_NAME_SIZE];
+  char mon_abbr[12][TIMEFMT_NAME_SIZE];
+  char mon_full[12][TIMEFMT_NAME_SIZE];
+  char ampm[2][TIMEFMT_NAME_SIZE];
+};
+
+static const char digits2[201] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+static struct timefmt_names names;
+static struct timefmt_prog *cache[TIMEFMT_CACHE_SIZE];
+static unsigned int cache_next = 0;
+
+static void
+prog_add_lit(struct timefmt_prog *prog, size_t *pool_len, const char *s,
+             size_t len)
+{
+  struct timefmt_op *op = prog->nops ? &prog->ops[prog->nops - 1] : NULL;
+
+  if (!len)
+    return;
+
+  if (!op || op->code != TIMEFMT_OP_LIT || op->off + op->len != *pool_len)
+  {
+    op = &prog->ops[prog->nops++];
+    memset(op, 0, sizeof(*op));
+    op->code = TIMEFMT_OP_LIT;
+    op->off = *pool_len;
+  }
+
+  memcpy(&prog->pool[*pool_len], s, len);
+  *pool_len += len;
+  op->len += len;
+}
+
+static void
+prog_add_op(struct timefmt_prog *prog, int code, int field, int width,
+            char pad)
+{
+  struct timefmt_op *op = &prog->ops[prog->nops++];
+
+  memset(op, 0, sizeof(*op));
+  op->code = code;
+  op->field = field;
+  op->width = width;
+  op->pad = pad;
+
+  if (code == TIMEFMT_OP_NAME)
+    prog->uses_names = 1;
+}
+
+static void
+prog_add_strftime(struct timefmt_prog *prog, size_t *pool_len, const char *s,
+                  size_t len)
+{
+  struct timefmt_op *op = &prog->ops[prog->nops++];
+
+  memset(op, 0, sizeof(*op));
+  op->code = TIMEFMT_OP_STRFTIME;
+  op->off = *pool_len;
+  op->len = len;
+  memcpy(&prog->pool[*pool_len], s, len);
+  *pool_len += len;
+  prog->pool[(*pool_len)++] = 0;
+}
+
+/* returns 0 if the conversion has no fast path */
+static int
+prog_add_conversion(struct timefmt_prog *prog, size_t *pool_len, char c)
+{
+  switch (c)
+  {
+    case 'S':
+      prog_add_op(prog, TIMEFMT_OP_NUM, TIMEFMT_SEC, 2, '0');
+      break;
+    case 'M':
+      prog_add_op(prog, TIMEFMT_OP_NUM, TIMEFMT_MIN, 2, '0');
+      break;
+    case 'H':
+      prog_add_op(prog, TIMEFMT_OP_NUM, TIMEFMT_HOUR, 2, '0');
+      break;
+    case 'k':
+      prog_add_op(prog, TIMEFMT_OP_NUM, TIMEFMT_HOUR, 2, ' ');
+      break;
+    case 'I':
+      prog_add_op(prog, TIMEFMT_OP_NUM, TIMEFMT_HOUR12, 2, '0');
+      break;
+    case 'l':
+      prog_add_op(prog, TIMEFMT_OP_NUM, TIMEFMT_HOUR12, 2, ' ');
+      break;
+    case 'd':
+      prog_add_op(prog, TIMEFMT_OP_NUM, TIMEFMT_MDAY, 2, '0');
+      break;
+    case 'e':
+      prog_add_op(prog, TIMEFMT_OP_NUM, TIMEFMT_MDAY, 2, ' ');
+      break;
+    case 'm':
+      prog_add_op(prog, TIMEFMT_OP_NUM, TIMEFMT_MON, 2, '0');
+      break;
+    case 'Y':
+      prog_add_op(prog, TIMEFMT_OP_NUM, TIMEFMT_YEAR, 4, '0');
+      break;
+    case 'y':
+      prog_add_op(prog, TIMEFMT_OP_NUM, TIMEFMT_YEAR2, 2, '0');
+      break;
+    case 'C':
+      prog_add_op(prog, TIMEFMT_OP_NUM, TIMEFMT_CENTURY, 2, '0');
+      break;
+    case 'j':
+      prog_add_op(prog, TIMEFMT_OP_NUM, TIMEFMT_YDAY, 3, '0');
+      break;
+    case 'w':
+      prog_add_op(prog, TIMEFMT_OP_NUM, TIMEFMT_WDAY, 1, '0');
+      break;
+    case 'u':
+      prog_add_op(prog, TIMEFMT_OP_NUM, TIMEFMT_WDAY1, 1, '0');
+      break;
+    case 'a':
+      prog_add_op(prog, TIMEFMT_OP_NAME, TIMEFMT_WDAY_ABBR, 0, 0);
+      break;
+    case 'A':
+      prog_add_op(prog, TIMEFMT_OP_NAME, TIMEFMT_WDAY_FULL, 0, 0);
+      break;
+    case 'b':
+    case 'h':
+      prog_add_op(prog, TIMEFMT_OP_NAME, TIMEFMT_MON_ABBR, 0, 0);
+      break;
+    case 'B':
+      prog_add_op(prog, TIMEFMT_OP_NAME, TIMEFMT_MON_FULL, 0, 0);
+      break;
+    case 'p':
+      prog_add_op(prog, TIMEFMT_OP_NAME, TIMEFMT_AMPM, 0, 0);
+      break;
+    case 'z':
+      prog_add_op(prog, TIMEFMT_OP_TZOFF, 0, 0, 0);
+      break;
+    case 'D':
+      prog_add_conversion(prog, pool_len, 'm');
+      prog_add_lit(prog, pool_len, "/", 1);
+      prog_add_conversion(prog, pool_len, 'd');
+      prog_add_lit(prog, pool_len, "/", 1);
+      prog_add_conversion(prog, pool_len, 'y');
+      break;
+    case 'F':
+      prog_add_conversion(prog, pool_len, 'Y');
+      prog_add_lit(prog, pool_len, "-", 1);
+      prog_add_conversion(prog, pool_len, 'm');
+      prog_add_lit(prog, pool_len, "-", 1);
+      prog_add_conversion(prog, pool_len, 'd');
+      break;
+    case 'T':
+      prog_add_conversion(prog, pool_len, 'H');
+      prog_add_lit(prog, pool_len, ":", 1);
+      prog_add_conversion(prog, pool_len, 'M');
+      prog_add_lit(prog, pool_len, ":", 1);
+      prog_add_conversion(prog, pool_len, 'S');
+      break;
+    case 'R':
+      prog_add_conversion(prog, pool_len, 'H');
+      prog_add_lit(prog, pool_len, ":", 1);
+      prog_add_conversion(prog, pool_len, 'M');
+      break;
+    case 'n':
+      prog_add_lit(prog, pool_len, "\n", 1);
+      break;
+    case 't':
+      prog_add_lit(prog, pool_len, "\t", 1);
+      break;
+    case '%':
+      prog_add_lit(prog, pool_len, "%", 1);
+      break;
+    default:
+      return 0;
+  }
+
+  return 1;
+}
+
+struct timefmt_prog *
+timefmt_compile(const char *fmt)
+{
+  struct timefmt_prog *prog;
+  size_t len = strlen(fmt);
+  size_t max_ops = 3 * len + 1;
+  size_t pool_len = 0;
+  const char *p = fmt;
+
+  if (len > TIMEFMT_MAX_FMT_LEN)
+    return NULL;
+
+  prog = calloc(1, sizeof(*prog));
+
+  if (!prog)
+    return NULL;
+
+  prog->fmt = strdup(fmt);
+  prog->pool = malloc(2 * len + 1);
+  prog->ops = malloc(max_ops * sizeof(*prog->ops));
+
+  if (!prog->fmt || !prog->pool || !prog->ops)
+  {
+    timefmt_free(prog);
+    return NULL;
+  }
+
+  while (*p)
+  {
+    const char *q;
+
+    if (*p != '%')
+    {
+      for (q = p; *q && *q != '%'; q++);
+
+      prog_add_lit(prog, &pool_len, p, q - p);
+      p = q;
+      continue;
+    }
+
+    /* flags, field width and E/O modifiers are left to strftime() */
+    for (q = p + 1; *q && strchr("_-0^#", *q); q++);
+    for (; *q >= '0' && *q <= '9'; q++);
+    for (; *q == 'E' || *q == 'O'; q++);
+
+    if (!*q)
+    {
+      prog_add_strftime(prog, &pool_len, p, q - p);
+      break;
+    }
+
+    if (q != p + 1 || !prog_add_conversion(prog, &pool_len, *q))
+      prog_add_strftime(prog, &pool_len, p, q + 1 - p);
+
+    p = q + 1;
+  }
+
+  return prog;
+}
+
+void
+timefmt_free(struct timefmt_prog *prog)
+{
+  if (prog)
+  {
+    free(prog->fmt);
+    free(prog->pool);
+    free(prog->ops);
+    free(prog);
+  }
+}
+
+static int
+names_refresh(void)
+{
+  const char *locale = setlocale(LC_TIME, NULL);
+  struct tm tm;
+  int i;
+
+  if (!locale || strlen(locale) >= sizeof(names.locale))
+    return 0;
+
+  if (names.valid && !strcmp(names.locale, locale))
+    return 1;
+
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_mday = 1;
+
+  for (i = 0; i < 7; i++)
+  {
+    tm.tm_wday = i;
+    strftime(names.wday_abbr[i], TIMEFMT_NAME_SIZE, "%a", &tm);
+    strftime(names.wday_full[i], TIMEFMT_NAME_SIZE, "%A", &tm);
+  }
+
+  for (i = 0; i < 12; i++)
+  {
+    tm.tm_mon = i;
+    strftime(names.mon_abbr[i], TIMEFMT_NAME_SIZE, "%b", &tm);
+    strftime(names.mon_full[i], TIMEFMT_NAME_SIZE, "%B", &tm);
+  }
+
+  for (i = 0; i < 2; i++)
+  {
+    tm.tm_hour = 12 * i;
+    strftime(names.ampm[i], TIMEFMT_NAME_SIZE, "%p", &tm);
+  }
+
+  strcpy(names.locale, locale);
+  names.valid = 1;
+
+  return 1;
+}
+
+static int
+tm_in_range(const struct tm *tm)
+{
+  return tm->tm_year >= 1000 - 1900 && tm->tm_year <= 9999 - 1900 &&
+      (unsigned)tm->tm_mon < 12 && tm->tm_mday >= 1 && tm->tm_mday <= 31 &&
+      (unsigned)tm->tm_hour < 24 && (unsigned)tm->tm_min < 60 &&
+      (unsigned)tm->tm_sec <= 60 && (unsigned)tm->tm_wday < 7 &&
+      (unsigned)tm->tm_yday < 366;
+}
+
+static unsigned int
+field_value(const struct tm *tm, int field)
+{
+  switch (field)
+  {
+    case TIMEFMT_SEC:
+      return tm->tm_sec;
+    case TIMEFMT_MIN:
+      return tm->tm_min;
+    case TIMEFMT_HOUR:
+      return tm->tm_hour;
+    case TIMEFMT_HOUR12:
+      return tm->tm_hour % 12 ? tm->tm_hour % 12 : 12;
+    case TIMEFMT_MDAY:
+      return tm->tm_mday;
+    case TIMEFMT_MON:
+      return tm->tm_mon + 1;
+    case TIMEFMT_YEAR:
+      return tm->tm_year + 1900;
+    case TIMEFMT_YEAR2:
+      return (tm->tm_year + 1900) % 100;
+    case TIMEFMT_CENTURY:
+      return (tm->tm_year + 1900) / 100;
+    case TIMEFMT_YDAY:
+      return tm->tm_yday + 1;
+    case TIMEFMT_WDAY:
+      return tm->tm_wday;
+    case TIMEFMT_WDAY1:
+      return tm->tm_wday ? tm->tm_wday : 7;
+  }
+
+  return 0;
+}
+
+static const char *
+field_name(const struct tm *tm, int field)
+{
+  switch (field)
+  {
+    case TIMEFMT_WDAY_ABBR:
+      return names.wday_abbr[tm->tm_wday];
+    case TIMEFMT_WDAY_FULL:
+      return names.wday_full[tm->tm_wday];
+    case TIMEFMT_MON_ABBR:
+      return names.mon_abbr[tm->tm_mon];
+    case TIMEFMT_MON_FULL:
+      return names.mon_full[tm->tm_mon];
+    case TIMEFMT_AMPM:
+      return names.ampm[tm->tm_hour > 11];
+  }
+
+  return "";
+}
+
+static char *
+put_num(char *p, unsigned int v, int width, char pad)
+{
+  switch (width)
+  {
+    case 1:
+      *p++ = '0' + v;
+      break;
+    case 2:
+      if (v < 10 && pad != '0')
+      {
+        p[0] = pad;
+        p[1] = '0' + v;
+      }
+      else
+        memcpy(p, &digits2[2 * v], 2);
+
+      p += 2;
+      break;
+    case 3:
+      *p++ = '0' + v / 100;
+      memcpy(p, &digits2[2 * (v % 100)], 2);
+      p += 2;
+      break;
+    case 4:
+      memcpy(p, &digits2[2 * (v / 100)], 2);
+      memcpy(p + 2, &digits2[2 * (v % 100)], 2);
+      p += 4;
+      break;
+  }
+
+  return p;
+}
+
+static int
+is_time_of_day_op(const struct timefmt_op *op)
+{
+  if (op->code == TIMEFMT_OP_NUM)
+  {
+    return op->field == TIMEFMT_SEC || op->field == TIMEFMT_MIN ||
+        op->field == TIMEFMT_HOUR || op->field == TIMEFMT_HOUR12;
+  }
+
+  return op->code == TIMEFMT_OP_NAME && op->field == TIMEFMT_AMPM;
+}
+
+size_t
+timefmt_exec_layout(const struct timefmt_prog *prog, const struct tm *tm,
+                    char *s, size_t max, unsigned short *offs)
+{
+  char *p = s;
+  char *end;
+  size_t i;
+
+  if (!max)
+    return 0;
+
+  if (!tm_in_range(tm) || (prog->uses_names && !names_refresh()))
+    return strftime(s, max, prog->fmt, tm);
+
+  /* leave room for the terminating NUL */
+  end = s + max - 1;
+
+  for (i = 0; i < prog->nops; i++)
+  {
+    const struct timefmt_op *op = &prog->ops[i];
+    const char *src = NULL;
+    char tmp[256];
+    size_t len = 0;
+
+    if (offs)
+      offs[i] = p - s;
+
+    switch (op->code)
+    {
+      case TIMEFMT_OP_LIT:
+        src = &prog->pool[op->off];
+        len = op->len;
+        break;
+      case TIMEFMT_OP_NUM:
+        if (end - p < op->width)
+          return 0;
+
+        p = put_num(p, field_value(tm, op->field), op->width, op->pad);
+        continue;
+      case TIMEFMT_OP_NAME:
+        src = field_name(tm, op->field);
+        len = strlen(src);
+        break;
+      case TIMEFMT_OP_TZOFF:
+      {
+        long off = tm->tm_gmtoff;
+
+        if (tm->tm_isdst < 0)
+          continue;
+
+        if (end - p < 5)
+          return 0;
+
+        *p++ = off < 0 ? '-' : '+';
+        off = labs(off) / 60;
+        p = put_num(p, (off / 60) % 100, 2, '0');
+        p = put_num(p, off % 60, 2, '0');
+        continue;
+      }
+      case TIMEFMT_OP_STRFTIME:
+        src = tmp;
+        len = strftime(tmp, sizeof(tmp), &prog->pool[op->off], tm);
+        break;
+    }
+
+    if ((size_t)(end - p) < len)
+      return 0;
+
+    memcpy(p, src, len);
+    p += len;
+  }
+
+  *p = 0;
+
+  return p - s;
+}
+
+size_t
+timefmt_exec(const struct timefmt_prog *prog, const struct tm *tm, char *s,
+             size_t max)
+{
+  return timefmt_exec_layout(prog, tm, s, max, NULL);
+}
+
+int
+timefmt_can_patch(const struct timefmt_prog *prog, const struct tm *tm)
+{
+  size_t i;
+
+  if (!tm_in_range(tm) || (prog->uses_names && !names_refresh()))
+    return 0;
+
+  for (i = 0; i < prog->nops; i++)
+  {
+    const struct timefmt_op *op = &prog->ops[i];
+
+    if (op->code == TIMEFMT_OP_STRFTIME)
+      return 0;
+
+    /* AM/PM may change the record width in some locales */
+    if (op->code == TIMEFMT_OP_NAME && op->field == TIMEFMT_AMPM &&
+        strlen(names.ampm[0]) != strlen(names.ampm[1]))
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+void
+timefmt_patch(const struct timefmt_prog *prog, const struct tm *tm, char *s,
+              const unsigned short *offs)
+{
+  size_t i;
+
+  for (i = 0; i < prog->nops; i++)
+  {
+    const struct timefmt_op *op = &prog->ops[i];
+
+    if (!is_time_of_day_op(op))
+      continue;
+
+    if (op->code == TIMEFMT_OP_NUM)
+      put_num(&s[offs[i]], field_value(tm, op->field), op->width, op->pad);
+    else
+    {
+      const char *name = field_name(tm, op->field);
+
+      memcpy(&s[offs[i]], name, strlen(name));
+    }
+  }
+}
+
+struct parse_state
+{
+  const char *p;
+  const char *end;
+  int have_year;
+  int have_year2;
+  int have_century;
+  int have_date;
+  int yday;
+  int hour12;
+  int pm;
+};
+
+static int
+parse_num(struct parse_state *st, int min_digits, int max_digits, long *v)
+{
+  const char *p = st->p;
+  long val = 0;
+  int n = 0;
+
+  while (n < max_digits && p < st->end && (unsigned)(*p - '0') <= 9)
+  {
+    val = val * 10 + (*p++ - '0');
+    n++;
+  }
+
+  if (n < min_digits)
+    return -1;
+
+  st->p = p;
+  *v = val;
+
+  return 0;
+}
+
+static int
+parse_lit(struct parse_state *st, const char *lit, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+  {
+    if (isspace((unsigned char)lit[i]))
+    {
+      while (st->p < st->end && isspace((unsigned char)*st->p))
+        st->p++;
+    }
+    else if (st->p < st->end &&
+             tolower((unsigned char)*st->p) == tolower((unsigned char)lit[i]))
+    {
+      st->p++;
+    }
+    else
+      return -1;
+  }
+
+  return 0;
+}
+
+/* full names are tried first, as abbreviations are usually their prefixes */
+static int
+parse_name(struct parse_state *st, char (*full)[TIMEFMT_NAME_SIZE],
+           char (*abbr)[TIMEFMT_NAME_SIZE], int count, int *v)
+{
+  size_t avail = st->end - st->p;
+  int pass;
+  int i;
+
+  for (pass = 0; pass < 2; pass++)
+  {
+    char (*list)[TIMEFMT_NAME_SIZE] = pass ? abbr : full;
+
+    if (!list)
+      continue;
+
+    for (i = 0; i < count; i++)
+    {
+      size_t len = strlen(list[i]);
+
+      if (len && len <= avail && !strncasecmp(st->p, list[i], len))
+      {
+        st->p += len;
+        *v = i;
+        return 0;
+      }
+    }
+  }
+
+  return -1;
+}
+
+static int
+parse_tzoff(struct parse_state *st, struct timefmt_parsed *out)
+{
+  long hh;
+  long mm = 0;
+  int sign;
+
+  if (st->p < st->end && (*st->p == 'Z' || *st->p == 'z'))
+  {
+    st->p++;
+    out->has_offset = 1;
+    out->offset = 0;
+    return 0;
+  }
+
+  if (st->p >= st->end || (*st->p != '+' && *st->p != '-'))
+    return -1;
+
+  sign = *st->p++ == '-' ? -1 : 1;
+
+  if (parse_num(st, 2, 2, &hh))
+    return -1;
+
+  if (st->p < st->end && *st->p == ':')
+  {
+    st->p++;
+
+    if (parse_num(st, 2, 2, &mm))
+      return -1;
+  }
+  else if (st->end - st->p >= 2 && (unsigned)(st->p[0] - '0') <= 9)
+    parse_num(st, 2, 2, &mm);
+
+  if (hh > 24 || mm > 59)
+    return -1;
+
+  out->has_offset = 1;
+  out->offset = sign * (hh * 3600 + mm * 60);
+
+  return 0;
+}
+
+static int
+parse_fraction(struct parse_state *st, struct timefmt_parsed *out)
+{
+  long scale = 100000000;
+
+  if (st->p >= st->end || (*st->p != '.' && *st->p != ','))
+    return 0;
+
+  st->p++;
+
+  if (st->p >= st->end || (unsigned)(*st->p - '0') > 9)
+    return -1;
+
+  /* digits beyond nanoseconds are accepted and dropped */
+  for (; st->p < st->end && (unsigned)(*st->p - '0') <= 9; st->p++)
+  {
+    out->nsec += (*st->p - '0') * scale;
+    scale /= 10;
+  }
+
+  return 0;
+}
+
+static int
+parse_epoch(struct parse_state *st, struct timefmt_parsed *out)
+{
+  long long v = 0;
+  int sign = 1;
+  int n = 0;
+
+  if (st->p < st->end && (*st->p == '-' || *st->p == '+'))
+    sign = *st->p++ == '-' ? -1 : 1;
+
+  while (st->p < st->end && (unsigned)(*st->p - '0') <= 9 && n < 18)
+  {
+    v = v * 10 + (*st->p++ - '0');
+    n++;
+  }
+
+  if (!n)
+    return -1;
+
+  out->has_epoch = 1;
+  out->epoch = sign * v;
+
+  return 0;
+}
+
+static int
+parse_num_op(struct parse_state *st, const struct timefmt_op *op,
+             struct timefmt_parsed *out)
+{
+  long v;
+
+  if (op->pad == ' ' && st->p < st->end && *st->p == ' ')
+    st->p++;
+
+  if (parse_num(st, 1, op->width, &v))
+    return -1;
+
+  switch (op->field)
+  {
+    case TIMEFMT_SEC:
+      out->sec = v;
+      break;
+    case TIMEFMT_MIN:
+      out->min = v;
+      break;
+    case TIMEFMT_HOUR:
+      out->hour = v;
+      st->hour12 = 0;
+      break;
+    case TIMEFMT_HOUR12:
+      if (!v || v > 12)
+        return -1;
+
+      out->hour = v % 12;
+      st->hour12 = 1;
+      break;
+    case TIMEFMT_MDAY:
+      out->mday = v;
+      st->have_date = 1;
+      break;
+    case TIMEFMT_MON:
+      out->mon = v;
+      st->have_date = 1;
+      break;
+    case TIMEFMT_YEAR:
+      out->year = v;
+      st->have_year = 1;
+      break;
+    case TIMEFMT_YEAR2:
+      st->have_year2 = 1;
+      out->year = v;
+      break;
+    case TIMEFMT_CENTURY:
+      st->have_century = v + 1;
+      break;
+    case TIMEFMT_YDAY:
+      if (!v || v > 366)
+        return -1;
+
+      st->yday = v;
+      break;
+    case TIMEFMT_WDAY:
+      if (v > 6)
+        return -1;
+
+      break;
+    case TIMEFMT_WDAY1:
+      if (!v || v > 7)
+        return -1;
+
+      break;
+  }
+
+  return 0;
+}
+
+static int
+parse_strptime(const struct timefmt_prog *prog, const char *s, size_t len,
+               struct timefmt_parsed *out)
+{
+  char buf[512];
+  const char *end;
+  struct tm tm;
+  size_t i;
+
+  if (len >= sizeof(buf))
+    len = sizeof(buf) - 1;
+
+  memcpy(buf, s, len);
+  buf[len] = 0;
+
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_year = 70;
+  tm.tm_mday = 1;
+  end = strptime(buf, prog->fmt, &tm);
+
+  if (!end)
+    return -1;
+
+  out->year = tm.tm_year + 1900LL;
+  out->mon = tm.tm_mon + 1;
+  out->mday = tm.tm_mday;
+  out->hour = tm.tm_hour;
+  out->min = tm.tm_min;
+  out->sec = tm.tm_sec;
+
+  for (i = 0; i < prog->nops; i++)
+  {
+    if (prog->ops[i].code == TIMEFMT_OP_TZOFF)
+    {
+      out->has_offset = 1;
+      out->offset = tm.tm_gmtoff;
+    }
+  }
+
+  return end - buf;
+}
+
+static int
+parse_is_native(const struct timefmt_prog *prog)
+{
+  size_t i;
+
+  for (i = 0; i < prog->nops; i++)
+  {
+    const struct timefmt_op *op = &prog->ops[i];
+
+    if (op->code == TIMEFMT_OP_STRFTIME &&
+        strcmp(&prog->pool[op->off], "%f") &&
+        strcmp(&prog->pool[op->off], "%s"))
+    {
+      return 0;
+    }
+  }
+
+  return !prog->uses_names || names_refresh();
+}
+
+int
+timefmt_parse(const struct timefmt_prog *prog, const char *s, size_t len,
+              struct timefmt_parsed *out)
+{
+  struct parse_state st;
+  size_t i;
+  int rv = 0;
+
+  memset(out, 0, sizeof(*out));
+  out->year = 1970;
+  out->mon = 1;
+  out->mday = 1;
+
+  if (!parse_is_native(prog))
+    return parse_strptime(prog, s, len, out);
+
+  memset(&st, 0, sizeof(st));
+  st.p = s;
+  st.end = s + len;
+  st.pm = -1;
+
+  for (i = 0; !rv && i < prog->nops; i++)
+  {
+    const struct timefmt_op *op = &prog->ops[i];
+    int v = 0;
+
+    switch (op->code)
+    {
+      case TIMEFMT_OP_LIT:
+        rv = parse_lit(&st, &prog->pool[op->off], op->len);
+        break;
+      case TIMEFMT_OP_NUM:
+        rv = parse_num_op(&st, op, out);
+        break;
+      case TIMEFMT_OP_NAME:
+        if (op->field == TIMEFMT_WDAY_ABBR || op->field == TIMEFMT_WDAY_FULL)
+          rv = parse_name(&st, names.wday_full, names.wday_abbr, 7, &v);
+        else if (op->field == TIMEFMT_AMPM)
+        {
+          rv = parse_name(&st, names.ampm, NULL, 2, &v);
+          st.pm = v;
+        }
+        else
+        {
+          rv = parse_name(&st, names.mon_full, names.mon_abbr, 12, &v);
+          out->mon = v + 1;
+          st.have_date = 1;
+        }
+
+        break;
+      case TIMEFMT_OP_TZOFF:
+        rv = parse_tzoff(&st, out);
+        break;
+      case TIMEFMT_OP_STRFTIME:
+        if (!strcmp(&prog->pool[op->off], "%f"))
+          rv = parse_fraction(&st, out);
+        else
+          rv = parse_epoch(&st, out);
+
+        break;
+    }
+  }
+
+  if (rv)
+    return -1;
+
+  if (st.have_year2)
+  {
+    if (st.have_century)
+      out->year += (st.have_century - 1) * 100;
+    else
+      out->year += out->year < 69 ? 2000 : 1900;
+  }
+  else if (st.have_century && !st.have_year)
+    out->year = (st.have_century - 1) * 100;
+
+  if (st.hour12 && st.pm > 0)
+    out->hour += 12;
+
+  if (st.yday && !st.have_date)
+  {
+    long long days = civil_days_from_date(out->year, 1, 1) + st.yday - 1;
+
+    civil_date_from_days(days, &out->year, &out->mon, &out->mday);
+  }
+
+  if (out->mon < 1 || out->mon > 12 || out->mday < 1 ||
+      out->mday > civil_days_in_month(out->year, out->mon) ||
+      out->hour > 23 || out->min > 59 || out->sec > 60)
+  {
+    return -1;
+  }
+
+  return st.p - s;
+}
+
+const struct timefmt_prog *
+timefmt_cache_get(const char *fmt)
+{
+  struct timefmt_prog *prog;
+  int i;
+
+  for (i = 0; i < TIMEFMT_CACHE_SIZE; i++)
+  {
+    if (cache[i] && !strcmp(cache[i]->fmt, fmt))
+      return cache[i];
+  }
+
+  prog = timefmt_compile(fmt);
+
+  if (prog)
+  {
+    timefmt_free(cache[cache_next]);
+    cache[cache_next] = prog;
+    cache_next = (cache_next + 1) % TIMEFMT_CACHE_SIZE;
+  }
+
+  return prog;
+}
+
+void
+timefmt_cache_flush(void)
+{
+  int i;
+
+  for (i = 0; i < TIMEFMT_CACHE_SIZE; i++)
+  {
+    timefmt_free(cache[i]);
+    cache[i] = NULL;
+  }
+
+  cache_next = 0;
+  names.valid = 0;
+}
@@ -0,0 +1,86 @@
+#ifndef TIMEFMT_H
+#define TIMEFMT_H
+
+#include <time.h>
+#include <stddef.h>
+
+enum timefmt_opcode
+{
+  TIMEFMT_OP_LIT,
+  TIMEFMT_OP_NUM,
+  TIMEFMT_OP_NAME,
+  TIMEFMT_OP_TZOFF,
+  TIMEFMT_OP_STRFTIME
+};
+
+enum timefmt_field
+{
+  TIMEFMT_SEC,
+  TIMEFMT_MIN,
+  TIMEFMT_HOUR,
+  TIMEFMT_HOUR12,
+  TIMEFMT_MDAY,
+  TIMEFMT_MON,
+  TIMEFMT_YEAR,
+  TIMEFMT_YEAR2,
+  TIMEFMT_CENTURY,
+  TIMEFMT_YDAY,
+  TIMEFMT_WDAY,
+  TIMEFMT_WDAY1,
+  TIMEFMT_WDAY_ABBR,
+  TIMEFMT_WDAY_FULL,
+  TIMEFMT_MON_ABBR,
+  TIMEFMT_MON_FULL,
+  TIMEFMT_AMPM
+};
+
+struct timefmt_op
+{
+  unsigned char code;
+  unsigned char field;
+  unsigned char width;
+  char pad;
+  unsigned short off;
+  unsigned short len;
+};
+
+struct timefmt_prog
+{
+  char *fmt;
+  char *pool;
+  struct timefmt_op *ops;
+  size_t nops;
+  int uses_names;
+};
+
+struct timefmt_parsed
+{
+  long long year;
+  int mon;
+  int mday;
+  int hour;
+  int min;
+  int sec;
+  long nsec;
+  int has_offset;
+  long offset;
+  int has_epoch;
+  long long epoch;
+};
+
+struct timefmt_prog *timefmt_compile(const char *fmt);
+void timefmt_free(struct timefmt_prog *prog);
+size_t timefmt_exec(const struct timefmt_prog *prog, const struct tm *tm,
+                    char *s, size_t max);
+size_t timefmt_exec_layout(const struct timefmt_prog *prog,
+                           const struct tm *tm, char *s, size_t max,
+                           unsigned short *offs);
+int timefmt_can_patch(const struct timefmt_prog *prog, const struct tm *tm);
+void timefmt_patch(const struct timefmt_prog *prog, const struct tm *tm,
+                   char *s, const unsigned short *offs);
+int timefmt_parse(const struct timefmt_prog *prog, const char *s, size_t len,
+                  struct timefmt_parsed *out);
+const struct timefmt_prog *timefmt_cache_get(const char *fmt);
+void timefmt_cache_flush(void);
+
+#endif // TIMEFMT_H
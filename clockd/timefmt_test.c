@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "timefmt.h"
+#include "test.h"
+
+/* compiled programs have to give what strftime() gives */
+
+static const char *formats[] =
+{
+  "%Y-%m-%d %H:%M:%S",
+  "%d.%m.%y %I:%M %p",
+  "%a %b %e %H:%M:%S %Y",
+  "%A %d %B %C %j %u %w",
+  "%H:%M %Z %z",
+  "[%%] %D %R %T",
+  "literal only",
+  ""
+};
+
+static const time_t ticks[] =
+{
+  0, 951782400, 1000000000, 1711846800, 1729990800, 1735689599, 2147483647,
+  4102444800LL, -86401
+};
+
+static void
+test_exec(void)
+{
+  size_t f;
+  size_t t;
+
+  for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+  {
+    struct timefmt_prog *prog = timefmt_compile(formats[f]);
+
+    CHECK(prog != NULL);
+
+    if (!prog)
+      continue;
+
+    for (t = 0; t < sizeof(ticks) / sizeof(ticks[0]); t++)
+    {
+      char expected[128];
+      char buf[128];
+      struct tm tm;
+      size_t len;
+
+      localtime_r(&ticks[t], &tm);
+      len = strftime(expected, sizeof(expected), formats[f], &tm);
+      CHECK(timefmt_exec(prog, &tm, buf, sizeof(buf)) == len);
+      CHECK(!strcmp(buf, expected));
+
+      /* does not fit, like strftime() */
+      if (len)
+        CHECK(timefmt_exec(prog, &tm, buf, len) == 0);
+    }
+
+    timefmt_free(prog);
+  }
+}
+
+/* a record laid out once is patched for other times of the same day */
+static void
+test_patch(void)
+{
+  struct timefmt_prog *prog = timefmt_compile("%Y-%m-%d %I:%M:%S %p");
+  unsigned short offs[16];
+  char expected[64];
+  char buf[64];
+  struct tm tm;
+  time_t t = 1700000000;
+  int i;
+
+  CHECK(prog != NULL && prog->nops <= 16);
+
+  if (!prog || prog->nops > 16)
+    return;
+
+  localtime_r(&t, &tm);
+  CHECK(timefmt_exec_layout(prog, &tm, buf, sizeof(buf), offs) > 0);
+  CHECK(timefmt_can_patch(prog, &tm));
+
+  for (i = 0; i < 100; i++)
+  {
+    tm.tm_hour = i % 24;
+    tm.tm_min = (i * 7) % 60;
+    tm.tm_sec = (i * 13) % 60;
+    timefmt_patch(prog, &tm, buf, offs);
+    strftime(expected, sizeof(expected), prog->fmt, &tm);
+    CHECK(!strcmp(buf, expected));
+  }
+
+  timefmt_free(prog);
+}
+
+/* what a program writes it reads back */
+static void
+test_parse(void)
+{
+  static const char *parse_formats[] =
+  {
+    "%Y-%m-%d %H:%M:%S",
+    "%d.%m.%y %I:%M:%S %p",
+    "%a %b %e %H:%M:%S %Y",
+    "%Y-%m-%dT%H:%M:%S%z",
+    "%A %d %B %Y %T",
+    "%Y %j %T"
+  };
+  size_t f;
+  size_t t;
+
+  for (f = 0; f < sizeof(parse_formats) / sizeof(parse_formats[0]); f++)
+  {
+    struct timefmt_prog *prog = timefmt_compile(parse_formats[f]);
+
+    CHECK(prog != NULL);
+
+    if (!prog)
+      continue;
+
+    for (t = 1; t < sizeof(ticks) / sizeof(ticks[0]) - 2; t++)
+    {
+      struct timefmt_parsed parsed;
+      char buf[128];
+      struct tm tm;
+      size_t len;
+
+      localtime_r(&ticks[t], &tm);
+      len = strftime(buf, sizeof(buf), parse_formats[f], &tm);
+      CHECK(timefmt_parse(prog, buf, len, &parsed) == (int)len);
+      CHECK(parsed.year == tm.tm_year + 1900LL);
+      CHECK(parsed.mon == tm.tm_mon + 1);
+      CHECK(parsed.mday == tm.tm_mday);
+      CHECK(parsed.hour == tm.tm_hour);
+      CHECK(parsed.min == tm.tm_min);
+      CHECK(parsed.sec == tm.tm_sec);
+
+      if (strstr(parse_formats[f], "%z"))
+        CHECK(parsed.has_offset && parsed.offset == tm.tm_gmtoff);
+    }
+
+    timefmt_free(prog);
+  }
+}
+
+static void
+test_parse_invalid(void)
+{
+  struct timefmt_prog *prog = timefmt_compile("%Y-%m-%d %H:%M");
+  struct timefmt_parsed parsed;
+  static const char *bad[] =
+  {
+    "2023-02-29 10:00", "2024-13-01 10:00", "2024-01-01 24:00",
+    "2024-01-01 10:60", "2024/01/01 10:00", "2024-01-01", ""
+  };
+  size_t i;
+
+  CHECK(prog != NULL);
+
+  if (!prog)
+    return;
+
+  CHECK(timefmt_parse(prog, "2024-02-29 23:59", 16, &parsed) == 16);
+  CHECK(parsed.year == 2024 && parsed.mon == 2 && parsed.mday == 29);
+
+  for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+    CHECK(timefmt_parse(prog, bad[i], strlen(bad[i]), &parsed) < 0);
+
+  timefmt_free(prog);
+
+  prog = timefmt_compile("%s%f");
+  CHECK(prog != NULL);
+
+  if (!prog)
+    return;
+
+  CHECK(timefmt_parse(prog, "1700000000.25", 13, &parsed) == 13);
+  CHECK(parsed.has_epoch && parsed.epoch == 1700000000);
+  CHECK(parsed.nsec == 250000000);
+
+  timefmt_free(prog);
+}
+
+int
+main(void)
+{
+  setenv("TZ", "EST5EDT,M3.2.0,M11.1.0", 1);
+  tzset();
+  test_exec();
+  test_patch();
+  test_parse();
+  test_parse_invalid();
+
+  setenv("TZ", "UTC0", 1);
+  tzset();
+  test_exec();
+  test_parse();
+
+  return TEST_RESULT;
+}
@@ -0,0 +1,130 @@
+#include <glib.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "logging.h"
+#include "worker.h"
+
+/*
+ * Single worker thread for slow operations (disk writes, rclockd). Jobs
+ * run in the order they were pushed, completions are delivered back to
+ * the main loop.
+ */
+
+struct worker_job
+{
+  worker_func func;
+  worker_done_func done;
+  void *data;
+  GDestroyNotify free_data;
+  int rv;
+};
+
+static GThread *worker_thread = NULL;
+static GAsyncQueue *worker_queue = NULL;
+
+/* pushed to stop the thread */
+static struct worker_job worker_stop;
+
+static void
+worker_job_free(struct worker_job *job)
+{
+  if (job->free_data)
+    job->free_data(job->data);
+
+  g_free(job);
+}
+
+static gboolean
+worker_done_idle(gpointer user_data)
+{
+  struct worker_job *job = user_data;
+
+  if (job->done)
+    job->done(job->rv, job->data);
+
+  worker_job_free(job);
+
+  return FALSE;
+}
+
+static gpointer
+worker_main(gpointer user_data)
+{
+  struct worker_job *job;
+
+  while ((job = g_async_queue_pop(worker_queue)) != &worker_stop)
+  {
+    job->rv = job->func(job->data);
+
+    if (job->done)
+      g_idle_add(worker_done_idle, job);
+    else
+      worker_job_free(job);
+  }
+
+  return NULL;
+}
+
+int
+worker_init(void)
+{
+  worker_queue = g_async_queue_new();
+  worker_thread = g_thread_try_new("worker", worker_main, NULL, NULL);
+
+  if (!worker_thread)
+  {
+    DO_LOG(LOG_ERR, "worker_init(), thread creation failed");
+    g_async_queue_unref(worker_queue);
+    worker_queue = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* waits for the queued jobs, completions that did not run are dropped */
+void
+worker_quit(void)
+{
+  if (worker_thread)
+  {
+    g_async_queue_push(worker_queue, &worker_stop);
+    g_thread_join(worker_thread);
+    worker_thread = NULL;
+  }
+
+  if (worker_queue)
+  {
+    g_async_queue_unref(worker_queue);
+    worker_queue = NULL;
+  }
+}
+
+/* without the worker thread the job runs synchronously */
+void
+worker_push(worker_func func, worker_done_func done, void *data,
+            GDestroyNotify free_data)
+{
+  struct worker_job *job;
+
+  if (!worker_thread)
+  {
+    int rv = func(data);
+
+    if (done)
+      done(rv, data);
+
+    if (free_data)
+      free_data(data);
+
+    return;
+  }
+
+  job = g_new0(struct worker_job, 1);
+  job->func = func;
+  job->done = done;
+  job->data = data;
+  job->free_data = free_data;
+  g_async_queue_push(worker_queue, job);
+}
@@ -0,0 +1,17 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <glib.h>
+
+/* runs in the worker thread */
+typedef int (*worker_func)(void *data);
+
+/* runs in the main loop once 'func' has returned 'rv' */
+typedef void (*worker_done_func)(int rv, void *data);
+
+int worker_init(void);
+void worker_quit(void);
+void worker_push(worker_func func, worker_done_func done, void *data,
+                 GDestroyNotify free_data);
+
+#endif // WORKER_H
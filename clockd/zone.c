@@ -0,0 +1,751 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include "civil.h"
+#include "zone.h"
+
+/*
+ * Time zone engine: TZif files and POSIX TZ rules evaluated in-process,
+ * so conversions do not need to swap TZ and call tzset()/mktime().
+ */
+
+#define ZONE_DIR "/usr/share/zoneinfo"
+#define ZONE_LOCALTIME "/etc/localtime"
+#define ZONE_MAX_FILE_SIZE (512 * 1024)
+#define ZONE_CACHE_SIZE 4
+/* s between checks of a cached zone's file */
+#define ZONE_CHECK_INTERVAL 1
+
+static struct zone *cache[ZONE_CACHE_SIZE];
+static unsigned int cache_next = 0;
+
+static long
+be32(const unsigned char *p)
+{
+  return (int)((unsigned)p[0] << 24 | (unsigned)p[1] << 16 |
+               (unsigned)p[2] << 8 | (unsigned)p[3]);
+}
+
+static long long
+be64(const unsigned char *p)
+{
+  return (long long)((unsigned long long)(unsigned long)be32(p) << 32 |
+                     (unsigned long)(be32(p + 4) & 0xffffffffUL));
+}
+
+static int
+parse_rule_name(const char **s, char *abbr)
+{
+  const char *p = *s;
+  const char *name = p;
+  size_t len;
+
+  if (*p == '<')
+  {
+    for (name = ++p; *p && *p != '>'; p++);
+
+    if (*p != '>')
+      return -1;
+
+    len = p++ - name;
+  }
+  else
+  {
+    for (; isalpha((unsigned char)*p); p++);
+
+    if (p - *s < 3)
+      return -1;
+
+    len = p - name;
+  }
+
+  if (len >= ZONE_ABBR_SIZE)
+    len = ZONE_ABBR_SIZE - 1;
+
+  memcpy(abbr, name, len);
+  abbr[len] = 0;
+  *s = p;
+
+  return 0;
+}
+
+/* [+-]hh[:mm[:ss]], hours up to 167 */
+static int
+parse_rule_time(const char **s, long *secs)
+{
+  const char *p = *s;
+  long v[3] = {0, 0, 0};
+  int sign = 1;
+  int i;
+
+  if (*p == '+' || *p == '-')
+    sign = *p++ == '-' ? -1 : 1;
+
+  for (i = 0; i < 3; i++)
+  {
+    if (i)
+    {
+      if (*p != ':')
+        break;
+
+      p++;
+    }
+
+    if (!isdigit((unsigned char)*p))
+      return -1;
+
+    for (; isdigit((unsigned char)*p); p++)
+      v[i] = v[i] * 10 + (*p - '0');
+  }
+
+  if (v[0] > 167 || v[1] > 59 || v[2] > 59)
+    return -1;
+
+  *secs = sign * (v[0] * 3600 + v[1] * 60 + v[2]);
+  *s = p;
+
+  return 0;
+}
+
+static int
+parse_rule_num(const char **s, int *v)
+{
+  char *end;
+  long n = strtol(*s, &end, 10);
+
+  if (end == *s || n < 0 || n > 366)
+    return -1;
+
+  *v = n;
+  *s = end;
+
+  return 0;
+}
+
+static int
+parse_rule_date(const char **s, struct zone_rule_date *date)
+{
+  const char *p = *s;
+
+  memset(date, 0, sizeof(*date));
+
+  if (*p == 'J')
+  {
+    p++;
+    date->type = 'J';
+
+    if (parse_rule_num(&p, &date->day) || date->day < 1 || date->day > 365)
+      return -1;
+  }
+  else if (*p == 'M')
+  {
+    p++;
+    date->type = 'M';
+
+    if (parse_rule_num(&p, &date->mon) || *p++ != '.' ||
+        parse_rule_num(&p, &date->week) || *p++ != '.' ||
+        parse_rule_num(&p, &date->day) || date->mon < 1 || date->mon > 12 ||
+        date->week < 1 || date->week > 5 || date->day > 6)
+    {
+      return -1;
+    }
+  }
+  else
+  {
+    date->type = 'D';
+
+    if (parse_rule_num(&p, &date->day) || date->day > 365)
+      return -1;
+  }
+
+  date->secs = 2 * 3600;
+
+  if (*p == '/')
+  {
+    p++;
+
+    if (parse_rule_time(&p, &date->secs))
+      return -1;
+  }
+
+  *s = p;
+
+  return 0;
+}
+
+static int
+parse_rule(const char *s, struct zone_rule *rule)
+{
+  const char *p = s;
+  long off;
+
+  memset(rule, 0, sizeof(*rule));
+
+  if (parse_rule_name(&p, rule->std_abbr) || parse_rule_time(&p, &off))
+    return -1;
+
+  /* POSIX offsets are positive west of Greenwich */
+  rule->std_off = -off;
+
+  if (!*p)
+    return 0;
+
+  if (parse_rule_name(&p, rule->dst_abbr))
+    return -1;
+
+  rule->has_dst = 1;
+  rule->dst_off = rule->std_off + 3600;
+
+  if (*p && *p != ',')
+  {
+    if (parse_rule_time(&p, &off))
+      return -1;
+
+    rule->dst_off = -off;
+  }
+
+  if (!*p)
+  {
+    /* same default as glibc */
+    p = ",M3.2.0,M11.1.0";
+  }
+
+  if (*p++ != ',' || parse_rule_date(&p, &rule->start) || *p++ != ',' ||
+      parse_rule_date(&p, &rule->end) || *p)
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* local seconds since Epoch of the rule date in the given year */
+static long long
+rule_date_local(const struct zone_rule_date *date, long long year)
+{
+  long long days = civil_days_from_date(year, 1, 1);
+
+  if (date->type == 'J')
+    days += date->day - 1 + (date->day >= 60 && civil_is_leap(year));
+  else if (date->type == 'D')
+    days += date->day;
+  else
+  {
+    long long first = civil_days_from_date(year, date->mon, 1);
+    int dim = civil_days_in_month(year, date->mon);
+    int mday = 1 + (date->day - civil_weekday(first) + 7) % 7;
+
+    mday += (date->week - 1) * 7;
+
+    while (mday > dim)
+      mday -= 7;
+
+    days = first + mday - 1;
+  }
+
+  return days * CIVIL_SECS_PER_DAY + date->secs;
+}
+
+static void
+rule_lookup(const struct zone_rule *rule, long long t, long *gmtoff,
+            int *isdst, const char **abbr)
+{
+  long long start;
+  long long end;
+  long long year;
+  int mon;
+  int mday;
+  int dst;
+
+  if (!rule->has_dst)
+  {
+    *gmtoff = rule->std_off;
+    *isdst = 0;
+    *abbr = rule->std_abbr;
+    return;
+  }
+
+  civil_date_from_days(civil_floor_div(t + rule->std_off, CIVIL_SECS_PER_DAY),
+                       &year, &mon, &mday);
+
+  start = rule_date_local(&rule->start, year) - rule->std_off;
+  end = rule_date_local(&rule->end, year) - rule->dst_off;
+
+  if (start < end)
+    dst = t >= start && t < end;
+  else
+    dst = !(t >= end && t < start);
+
+  *gmtoff = dst ? rule->dst_off : rule->std_off;
+  *isdst = dst;
+  *abbr = dst ? rule->dst_abbr : rule->std_abbr;
+}
+
+static int
+parse_tzif(struct zone *zone, const unsigned char *buf, size_t len)
+{
+  const unsigned char *p = buf;
+  const unsigned char *end = buf + len;
+  size_t isutcnt, isstdcnt, leapcnt, timecnt, typecnt, charcnt;
+  size_t time_size = 4;
+  size_t i;
+
+  if (len < 44 || memcmp(p, "TZif", 4))
+    return -1;
+
+  while (1)
+  {
+    size_t block;
+
+    isutcnt = be32(p + 20);
+    isstdcnt = be32(p + 24);
+    leapcnt = be32(p + 28);
+    timecnt = be32(p + 32);
+    typecnt = be32(p + 36);
+    charcnt = be32(p + 40);
+
+    if (timecnt > len || typecnt > 256 || !typecnt || charcnt > len ||
+        leapcnt > len || isstdcnt > typecnt || isutcnt > typecnt)
+    {
+      return -1;
+    }
+
+    block = timecnt * time_size + timecnt + typecnt * 6 + charcnt +
+        leapcnt * (time_size + 4) + isstdcnt + isutcnt;
+
+    if ((size_t)(end - p) < 44 + block)
+      return -1;
+
+    if (time_size == 8 || buf[4] < '2')
+      break;
+
+    /* skip the 32-bit data of version 2+ files */
+    p += 44 + block;
+    time_size = 8;
+
+    if (end - p < 44 || memcmp(p, "TZif", 4))
+      return -1;
+  }
+
+  /* right/ zones with leap seconds are left to the C library */
+  if (leapcnt)
+    return -1;
+
+  zone->ntrans = timecnt;
+  zone->ntypes = typecnt;
+  zone->trans = malloc((timecnt ? timecnt : 1) * sizeof(*zone->trans));
+  zone->trans_type = malloc(timecnt ? timecnt : 1);
+  zone->types = malloc(typecnt * sizeof(*zone->types));
+
+  if (!zone->trans || !zone->trans_type || !zone->types)
+    return -1;
+
+  p += 44;
+
+  for (i = 0; i < timecnt; i++, p += time_size)
+    zone->trans[i] = time_size == 8 ? be64(p) : be32(p);
+
+  for (i = 0; i < timecnt; i++, p++)
+  {
+    if (*p >= typecnt)
+      return -1;
+
+    zone->trans_type[i] = *p;
+  }
+
+  for (i = 0; i < typecnt; i++, p += 6)
+  {
+    zone->types[i].gmtoff = be32(p);
+    zone->types[i].isdst = !!p[4];
+  }
+
+  /* the abbreviations follow the types, p[5] indexes them */
+  for (i = 0; i < typecnt; i++)
+  {
+    size_t at = (p - 6 * (typecnt - i))[5];
+    size_t n = 0;
+
+    if (at >= charcnt)
+      return -1;
+
+    while (at + n < charcnt && p[at + n] && n < ZONE_ABBR_SIZE - 1)
+      n++;
+
+    memcpy(zone->types[i].abbr, p + at, n);
+    zone->types[i].abbr[n] = 0;
+  }
+
+  p += charcnt + isstdcnt + isutcnt;
+
+  if (time_size == 8 && end - p > 2 && *p == '\n')
+  {
+    const unsigned char *nl = memchr(p + 1, '\n', end - p - 1);
+
+    if (nl && nl - p > 1)
+    {
+      char footer[128];
+      size_t n = nl - p - 1;
+
+      if (n < sizeof(footer))
+      {
+        memcpy(footer, p + 1, n);
+        footer[n] = 0;
+        zone->has_rule = !parse_rule(footer, &zone->rule);
+      }
+    }
+  }
+
+  return 0;
+}
+
+static int
+load_file(struct zone *zone, const char *path)
+{
+  unsigned char *buf;
+  struct stat st;
+  ssize_t len;
+  int rv = -1;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+
+  if (fd == -1)
+    return -1;
+
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size > ZONE_MAX_FILE_SIZE)
+  {
+    close(fd);
+    return -1;
+  }
+
+  zone->dev = st.st_dev;
+  zone->ino = st.st_ino;
+  zone->mtime = st.st_mtime;
+
+  buf = malloc(st.st_size + 1);
+
+  if (buf)
+  {
+    len = read(fd, buf, st.st_size);
+
+    if (len == st.st_size)
+      rv = parse_tzif(zone, buf, len);
+
+    free(buf);
+  }
+
+  close(fd);
+
+  return rv;
+}
+
+struct zone *
+zone_load(const char *tz)
+{
+  const char *name = tz ? tz : "";
+  const char *spec = name;
+  struct zone *zone;
+  char path[PATH_MAX];
+  const char *dir;
+
+  zone = calloc(1, sizeof(*zone));
+
+  if (!zone)
+    return NULL;
+
+  zone->name = strdup(name);
+
+  if (!zone->name)
+    goto err;
+
+  if (*spec == ':')
+    spec++;
+
+  dir = getenv("TZDIR");
+
+  if (!dir || !*dir)
+    dir = ZONE_DIR;
+
+  if (!*spec)
+    snprintf(path, sizeof(path), "%s", ZONE_LOCALTIME);
+  else if (*spec == '/')
+    snprintf(path, sizeof(path), "%s", spec);
+  else if (strstr(spec, ".."))
+    path[0] = 0;
+  else
+    snprintf(path, sizeof(path), "%s/%s", dir, spec);
+
+  if (path[0])
+  {
+    zone->path = strdup(path);
+
+    if (!zone->path)
+      goto err;
+
+    zone->checked = time(NULL);
+
+    if (!load_file(zone, path))
+      return zone;
+  }
+
+  free(zone->trans);
+  free(zone->trans_type);
+  free(zone->types);
+  zone->trans = NULL;
+  zone->trans_type = NULL;
+  zone->types = NULL;
+  zone->ntrans = zone->ntypes = 0;
+
+  if (*name != ':' && *spec && !parse_rule(spec, &zone->rule))
+  {
+    zone->has_rule = 1;
+    return zone;
+  }
+
+  if (!*spec)
+  {
+    /* like the C library, no local time zone means UTC */
+    memset(&zone->rule, 0, sizeof(zone->rule));
+    zone->has_rule = 1;
+    return zone;
+  }
+
+err:
+  zone_free(zone);
+
+  return NULL;
+}
+
+void
+zone_free(struct zone *zone)
+{
+  if (zone)
+  {
+    free(zone->name);
+    free(zone->path);
+    free(zone->trans);
+    free(zone->trans_type);
+    free(zone->types);
+    free(zone);
+  }
+}
+
+int
+zone_lookup(const struct zone *zone, long long t, long *gmtoff, int *isdst)
+{
+  const char *abbr;
+
+  return zone_lookup_abbr(zone, t, gmtoff, isdst, &abbr);
+}
+
+/* zone_lookup() with the abbreviation, valid as long as 'zone' is */
+int
+zone_lookup_abbr(const struct zone *zone, long long t, long *gmtoff,
+                 int *isdst, const char **abbr)
+{
+  size_t lo;
+  size_t hi;
+
+  if (!zone->ntrans || t < zone->trans[0])
+  {
+    if (zone->ntypes)
+    {
+      *gmtoff = zone->types[0].gmtoff;
+      *isdst = zone->types[0].isdst;
+      *abbr = zone->types[0].abbr;
+    }
+    else
+      rule_lookup(&zone->rule, t, gmtoff, isdst, abbr);
+
+    return 0;
+  }
+
+  if (t >= zone->trans[zone->ntrans - 1] && zone->has_rule)
+  {
+    rule_lookup(&zone->rule, t, gmtoff, isdst, abbr);
+    return 0;
+  }
+
+  lo = 0;
+  hi = zone->ntrans;
+
+  while (hi - lo > 1)
+  {
+    size_t mid = (lo + hi) / 2;
+
+    if (zone->trans[mid] <= t)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  *gmtoff = zone->types[zone->trans_type[lo]].gmtoff;
+  *isdst = zone->types[zone->trans_type[lo]].isdst;
+  *abbr = zone->types[zone->trans_type[lo]].abbr;
+
+  return 0;
+}
+
+static long
+offset_at(const struct zone *zone, long long t)
+{
+  long gmtoff;
+  int isdst;
+
+  zone_lookup(zone, t, &gmtoff, &isdst);
+
+  return gmtoff;
+}
+
+/*
+ * Converts wall clock seconds (local time counted as if it was UTC) to
+ * the instant. Offsets in effect a day before and after are the only
+ * candidates, which holds as long as transitions are more than two days
+ * apart.
+ */
+int
+zone_local_to_utc(const struct zone *zone, long long local, int policy,
+                  long long *t)
+{
+  long off_a = offset_at(zone, local - CIVIL_SECS_PER_DAY);
+  long off_b = offset_at(zone, local + CIVIL_SECS_PER_DAY);
+  long long t_a = local - off_a;
+  long long t_b = local - off_b;
+  int valid_a = offset_at(zone, t_a) == off_a;
+  int valid_b = offset_at(zone, t_b) == off_b;
+
+  if (valid_a && valid_b && t_a != t_b)
+  {
+    /* fold, wall clock time occurs twice */
+    if (policy & ZONE_FOLD_LATER)
+      *t = t_a > t_b ? t_a : t_b;
+    else
+      *t = t_a < t_b ? t_a : t_b;
+  }
+  else if (valid_a)
+    *t = t_a;
+  else if (valid_b)
+    *t = t_b;
+  else
+  {
+    long long lo;
+    long long hi;
+
+    /* gap, wall clock time is skipped */
+    if (policy & ZONE_GAP_REJECT)
+      return -1;
+
+    if (!(policy & ZONE_GAP_NEXT))
+    {
+      *t = t_a;
+      return 0;
+    }
+
+    /* first instant after the gap */
+    lo = t_b < t_a ? t_b : t_a;
+    hi = t_b < t_a ? t_a : t_b;
+
+    while (hi - lo > 1)
+    {
+      long long mid = lo + (hi - lo) / 2;
+
+      if (offset_at(zone, mid) == off_a)
+        lo = mid;
+      else
+        hi = mid;
+    }
+
+    *t = hi;
+  }
+
+  return 0;
+}
+
+/* the file has been replaced or changed since the zone was loaded */
+static int
+zone_is_stale(struct zone *zone)
+{
+  struct stat st;
+  time_t now;
+
+  if (!zone->path)
+    return 0;
+
+  now = time(NULL);
+
+  if (now >= zone->checked && now - zone->checked < ZONE_CHECK_INTERVAL)
+    return 0;
+
+  zone->checked = now;
+
+  if (stat(zone->path, &st))
+    return zone->ino != 0;
+
+  return st.st_ino != zone->ino || st.st_dev != zone->dev ||
+      st.st_mtime != zone->mtime;
+}
+
+/*
+ * Zones are reloaded when their file changes, a tzdata upgrade or a new
+ * /etc/localtime is picked up within ZONE_CHECK_INTERVAL.
+ */
+struct zone *
+zone_cache_get(const char *tz)
+{
+  struct zone *zone;
+  int i;
+
+  if (!tz)
+    tz = "";
+
+  for (i = 0; i < ZONE_CACHE_SIZE; i++)
+  {
+    if (cache[i] && !strcmp(cache[i]->name, tz))
+    {
+      if (!zone_is_stale(cache[i]))
+        return cache[i];
+
+      zone = zone_load(tz);
+
+      if (!zone)
+        return cache[i];
+
+      zone_free(cache[i]);
+      cache[i] = zone;
+
+      return zone;
+    }
+  }
+
+  zone = zone_load(tz);
+
+  if (zone)
+  {
+    zone_free(cache[cache_next]);
+    cache[cache_next] = zone;
+    cache_next = (cache_next + 1) % ZONE_CACHE_SIZE;
+  }
+
+  return zone;
+}
+
+void
+zone_cache_flush(void)
+{
+  int i;
+
+  for (i = 0; i < ZONE_CACHE_SIZE; i++)
+  {
+    zone_free(cache[i]);
+    cache[i] = NULL;
+  }
+
+  cache_next = 0;
+}
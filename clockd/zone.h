@@ -0,0 +1,72 @@
+#ifndef ZONE_H
+#define ZONE_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/* zone_local_to_utc() policy, see TIME_CAL_* in libtime.h */
+#define ZONE_FOLD_EARLIER  0x00
+#define ZONE_FOLD_LATER    0x01
+#define ZONE_GAP_SHIFT     0x00
+#define ZONE_GAP_REJECT    0x02
+#define ZONE_GAP_NEXT      0x04
+
+/* abbreviations are truncated to fit */
+#define ZONE_ABBR_SIZE 8
+
+struct zone_rule_date
+{
+  char type;  /* 'J', 'D' (zero based day of year) or 'M' */
+  int mon;
+  int week;
+  int day;
+  long secs;
+};
+
+struct zone_rule
+{
+  long std_off;
+  long dst_off;
+  char std_abbr[ZONE_ABBR_SIZE];
+  char dst_abbr[ZONE_ABBR_SIZE];
+  int has_dst;
+  struct zone_rule_date start;
+  struct zone_rule_date end;
+};
+
+struct zone_type
+{
+  long gmtoff;
+  int isdst;
+  char abbr[ZONE_ABBR_SIZE];
+};
+
+struct zone
+{
+  char *name;
+  char *path;       /* TZif file, NULL if none applies */
+  dev_t dev;        /* the file when loaded, ino 0 if it was missing */
+  ino_t ino;
+  time_t mtime;
+  time_t checked;   /* by zone_cache_get() */
+  long long *trans;
+  unsigned char *trans_type;
+  size_t ntrans;
+  struct zone_type *types;
+  size_t ntypes;
+  int has_rule;
+  struct zone_rule rule;
+};
+
+struct zone *zone_load(const char *tz);
+void zone_free(struct zone *zone);
+int zone_lookup(const struct zone *zone, long long t, long *gmtoff,
+                int *isdst);
+int zone_lookup_abbr(const struct zone *zone, long long t, long *gmtoff,
+                     int *isdst, const char **abbr);
+int zone_local_to_utc(const struct zone *zone, long long local, int policy,
+                      long long *t);
+struct zone *zone_cache_get(const char *tz);
+void zone_cache_flush(void);
+
+#endif // ZONE_H
@@ -0,0 +1,322 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <ftw.h>
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <glib.h>
+
+#include "logging.h"
+#include "worker.h"
+#include "zone_index.h"
+
+/*
+ * Set of the zone names under ZONE_INDEX_DIR, each mapped to the name of
+ * the file it links to, so zone names are validated and canonicalized
+ * without touching the file system. The tree is scanned by the worker at
+ * startup and again once it has been quiet for ZONE_INDEX_DELAY ms after
+ * a change, a tzdata upgrade for instance.
+ */
+
+#define ZONE_INDEX_DIR "/usr/share/zoneinfo"
+#define ZONE_INDEX_DELAY 1000
+#define ZONE_INDEX_WATCH (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+                          IN_CREATE | IN_DELETE | IN_ONLYDIR)
+
+struct zone_index_build
+{
+  GHashTable *zones;
+  bool changed;
+};
+
+/* name -> canonical name, relative to ZONE_INDEX_DIR, main thread only */
+static GHashTable *zones = NULL;
+static zone_index_func index_func = NULL;
+static bool build_running = false;
+static bool build_again = false;
+
+static int watch_fd = -1;
+static guint watch_id = 0;
+static guint delay_id = 0;
+
+/* used by the nftw() callback, worker thread only */
+static GHashTable *building = NULL;
+static char real_dir[PATH_MAX];
+
+static void zone_index_build(bool changed);
+
+static bool
+zone_index_is_tzif(const char *path)
+{
+  char magic[4];
+  bool rv;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1)
+    return false;
+
+  rv = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+      !memcmp(magic, "TZif", sizeof(magic));
+  close(fd);
+
+  return rv;
+}
+
+static int
+zone_index_add(const char *path, const struct stat *sb, int type,
+               struct FTW *ftw)
+{
+  size_t len = strlen(real_dir);
+  const char *name = path + len + 1;
+  char target[PATH_MAX];
+
+  switch (type)
+  {
+    case FTW_D:
+      if (watch_fd != -1)
+        inotify_add_watch(watch_fd, path, ZONE_INDEX_WATCH);
+      break;
+
+    case FTW_F:
+      if (zone_index_is_tzif(path))
+        g_hash_table_replace(building, g_strdup(name), g_strdup(name));
+      break;
+
+    case FTW_SL:
+      if (realpath(path, target) && !strncmp(target, real_dir, len) &&
+          target[len] == '/' && zone_index_is_tzif(target))
+      {
+        g_hash_table_replace(building, g_strdup(name),
+                             g_strdup(&target[len + 1]));
+      }
+      break;
+  }
+
+  return 0;
+}
+
+static int
+zone_index_build_job(void *data)
+{
+  struct zone_index_build *b = data;
+
+  if (!realpath(ZONE_INDEX_DIR, real_dir))
+  {
+    DO_LOG(LOG_ERR, "failed to resolve %s (%s)", ZONE_INDEX_DIR,
+           strerror(errno));
+    return -1;
+  }
+
+  building = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+  if (nftw(real_dir, zone_index_add, 16, FTW_PHYS))
+  {
+    DO_LOG(LOG_ERR, "failed to scan %s (%s)", ZONE_INDEX_DIR,
+           strerror(errno));
+    g_hash_table_destroy(building);
+    building = NULL;
+    return -1;
+  }
+
+  b->zones = building;
+  building = NULL;
+
+  return 0;
+}
+
+static void
+zone_index_build_done(int rv, void *data)
+{
+  struct zone_index_build *b = data;
+
+  build_running = false;
+
+  /* a failed scan keeps the previous index */
+  if (!rv)
+  {
+    if (zones)
+      g_hash_table_destroy(zones);
+
+    zones = b->zones;
+    b->zones = NULL;
+    DO_LOG(LOG_DEBUG, "%u zones indexed", g_hash_table_size(zones));
+
+    if (b->changed && index_func)
+      index_func();
+  }
+
+  if (build_again)
+  {
+    build_again = false;
+    zone_index_build(true);
+  }
+}
+
+static void
+zone_index_build_free(void *data)
+{
+  struct zone_index_build *b = data;
+
+  if (b->zones)
+    g_hash_table_destroy(b->zones);
+
+  g_free(b);
+}
+
+static void
+zone_index_build(bool changed)
+{
+  struct zone_index_build *b;
+
+  if (build_running)
+  {
+    build_again = true;
+    return;
+  }
+
+  b = g_new0(struct zone_index_build, 1);
+  b->changed = changed;
+  build_running = true;
+  worker_push(zone_index_build_job, zone_index_build_done, b,
+              zone_index_build_free);
+}
+
+static gboolean
+zone_index_delay(gpointer user_data)
+{
+  delay_id = 0;
+  zone_index_build(true);
+
+  return FALSE;
+}
+
+static gboolean
+zone_index_io(GIOChannel *channel, GIOCondition cond, gpointer data)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  bool changed = false;
+  ssize_t bytes;
+  char *p;
+
+  if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+  {
+    DO_LOG(LOG_ERR, "zoneinfo watch failed, no index updates");
+    watch_id = 0;
+    return FALSE;
+  }
+
+  while ((bytes = read(watch_fd, buf, sizeof(buf))) > 0)
+  {
+    for (p = buf; p < buf + bytes; p += sizeof(*ev) + ev->len)
+    {
+      ev = (const struct inotify_event *)p;
+
+      if (!(ev->mask & IN_IGNORED))
+        changed = true;
+    }
+  }
+
+  /* wait for the end of the upgrade */
+  if (changed)
+  {
+    if (delay_id)
+      g_source_remove(delay_id);
+
+    delay_id = g_timeout_add(ZONE_INDEX_DELAY, zone_index_delay, NULL);
+  }
+
+  return TRUE;
+}
+
+/* until the first scan is done zone_index_find() returns -1 */
+int
+zone_index_init(zone_index_func func)
+{
+  index_func = func;
+  watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+  if (watch_fd != -1)
+  {
+    GIOChannel *channel = g_io_channel_unix_new(watch_fd);
+
+    watch_id = g_io_add_watch(channel, G_IO_IN | G_IO_ERR | G_IO_HUP,
+                              zone_index_io, NULL);
+    g_io_channel_unref(channel);
+  }
+  else
+    DO_LOG(LOG_ERR, "inotify_init1 failed (%s)", strerror(errno));
+
+  zone_index_build(false);
+
+  return watch_fd != -1 ? 0 : -1;
+}
+
+void
+zone_index_quit(void)
+{
+  if (delay_id)
+  {
+    g_source_remove(delay_id);
+    delay_id = 0;
+  }
+
+  if (watch_id)
+  {
+    g_source_remove(watch_id);
+    watch_id = 0;
+  }
+
+  if (watch_fd != -1)
+  {
+    close(watch_fd);
+    watch_fd = -1;
+  }
+
+  if (zones)
+  {
+    g_hash_table_destroy(zones);
+    zones = NULL;
+  }
+}
+
+/*
+ * 1 if 'tz', ":Name", "Name" or ":" ZONE_INDEX_DIR "/Name", is a zone,
+ * 0 if not, -1 if there is no index to tell. '*canonical' is the name of
+ * the file 'tz' links to, valid until the main loop runs again.
+ */
+int
+zone_index_find(const char *tz, const char **canonical)
+{
+  const char *name = tz;
+  const char *found;
+
+  if (!zones || !name)
+    return -1;
+
+  if (*name == ':')
+    name++;
+
+  if (!strncmp(name, ZONE_INDEX_DIR "/", strlen(ZONE_INDEX_DIR "/")))
+    name += strlen(ZONE_INDEX_DIR "/");
+  else if (*name == '/')
+    return -1;
+
+  found = g_hash_table_lookup(zones, name);
+
+  if (!found)
+    return 0;
+
+  if (canonical)
+    *canonical = found;
+
+  return 1;
+}
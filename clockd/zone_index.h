@@ -0,0 +1,11 @@
+#ifndef ZONE_INDEX_H
+#define ZONE_INDEX_H
+
+/* runs in the main loop after the zoneinfo tree changed and was indexed */
+typedef void (*zone_index_func)(void);
+
+int zone_index_init(zone_index_func func);
+void zone_index_quit(void);
+int zone_index_find(const char *tz, const char **canonical);
+
+#endif // ZONE_INDEX_H
@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "civil.h"
+#include "zone.h"
+#include "test.h"
+
+static long long
+local_secs(long long year, int mon, int mday, int hour, int min)
+{
+  return civil_days_from_date(year, mon, mday) * CIVIL_SECS_PER_DAY +
+      hour * 3600 + min * 60;
+}
+
+/* offsets, DST flags and abbreviations against the C library */
+static void
+test_lookup(const char *tz)
+{
+  struct zone *zone = zone_load(tz);
+  long long t;
+
+  CHECK(zone != NULL);
+
+  if (!zone)
+    return;
+
+  setenv("TZ", tz, 1);
+  tzset();
+
+  /*
+   * every 6 hours from 1970 to 2060, past the last TZif transition;
+   * glibc takes rules of years before 1970 to be those of 1970
+   */
+  for (t = 0; t < 2840140800LL; t += 6 * 3600 + 7)
+  {
+    time_t tt = t;
+    const char *abbr = NULL;
+    struct tm tm;
+    long gmtoff;
+    int isdst;
+
+    localtime_r(&tt, &tm);
+    CHECK(!zone_lookup_abbr(zone, t, &gmtoff, &isdst, &abbr));
+    CHECK(gmtoff == tm.tm_gmtoff);
+    CHECK(!isdst == !tm.tm_isdst);
+    CHECK(abbr && !strcmp(abbr, tm.tm_zone));
+
+    if (gmtoff != tm.tm_gmtoff)
+    {
+      fprintf(stderr, "  %s at %lld\n", tz, t);
+      break;
+    }
+  }
+
+  zone_free(zone);
+}
+
+static void
+test_posix(void)
+{
+  struct zone *zone = zone_load("<+0330>-3:30");
+  const char *abbr = NULL;
+  long gmtoff;
+  int isdst;
+
+  CHECK(zone != NULL && zone->has_rule && !zone->rule.has_dst);
+
+  if (zone)
+  {
+    CHECK(!zone_lookup_abbr(zone, 1700000000, &gmtoff, &isdst, &abbr));
+    CHECK(gmtoff == 12600 && !isdst && !strcmp(abbr, "+0330"));
+    zone_free(zone);
+  }
+
+  zone = zone_load("IST-2IDT,M3.4.4/26,M10.5.0");
+  CHECK(zone != NULL && zone->rule.has_dst);
+
+  if (zone)
+  {
+    CHECK(zone->rule.std_off == 7200 && zone->rule.dst_off == 10800);
+    CHECK(zone->rule.start.type == 'M' && zone->rule.start.mon == 3 &&
+          zone->rule.start.week == 4 && zone->rule.start.day == 4 &&
+          zone->rule.start.secs == 26 * 3600);
+    zone_free(zone);
+  }
+
+  /* rules hold for every year */
+  zone = zone_load("EST5EDT,M3.2.0,M11.1.0");
+  CHECK(zone != NULL);
+
+  if (zone)
+  {
+    CHECK(!zone_lookup(zone, -298339200, &gmtoff, &isdst));
+    CHECK(gmtoff == -14400 && isdst);
+    CHECK(!zone_lookup(zone, -(1LL << 40), &gmtoff, &isdst));
+    zone_free(zone);
+  }
+
+  /* not a zone */
+  CHECK(zone_load(":No/Such_Zone") == NULL);
+  CHECK(zone_load("EST5EDT,M3.2.0,M13.1.0") == NULL);
+  CHECK(zone_load("../../etc/passwd") == NULL);
+
+  test_lookup("EST5EDT,M3.2.0,M11.1.0");
+  test_lookup("<+0330>-3:30");
+  test_lookup("IST-2IDT,M3.4.4/26,M10.5.0");
+  test_lookup("NZST-12NZDT,M9.5.0,M4.1.0/3");
+}
+
+/* skipped and repeated wall clock times under every policy */
+static void
+check_local(const char *tz, long long local, long long earlier,
+            long long later, int gap)
+{
+  struct zone *zone = zone_load(tz);
+  long long t = 0;
+
+  CHECK(zone != NULL);
+
+  if (!zone)
+    return;
+
+  CHECK(!zone_local_to_utc(zone, local, ZONE_FOLD_EARLIER, &t));
+  CHECK(t == earlier);
+  CHECK(!zone_local_to_utc(zone, local, ZONE_FOLD_LATER, &t));
+  CHECK(t == (gap ? earlier : later));
+
+  if (gap)
+  {
+    CHECK(zone_local_to_utc(zone, local, ZONE_GAP_REJECT, &t) == -1);
+    CHECK(!zone_local_to_utc(zone, local, ZONE_GAP_NEXT, &t));
+    CHECK(t == later);
+  }
+  else
+  {
+    CHECK(!zone_local_to_utc(zone, local, ZONE_GAP_REJECT, &t));
+    CHECK(!zone_local_to_utc(zone, local, ZONE_GAP_NEXT, &t));
+  }
+
+  zone_free(zone);
+}
+
+static void
+test_gap_fold(const char *helsinki)
+{
+  const char *ny = "EST5EDT,M3.2.0,M11.1.0";
+
+  /* 2024-03-10 02:30 is skipped, 2024-11-03 01:30 repeated */
+  check_local(ny, local_secs(2024, 3, 10, 2, 30), 1710055800, 1710054000, 1);
+  check_local(ny, local_secs(2024, 11, 3, 1, 30), 1730611800, 1730615400, 0);
+  check_local(ny, local_secs(2024, 7, 1, 12, 0), 1719849600, 1719849600, 0);
+
+  if (!helsinki)
+    return;
+
+  check_local(helsinki, local_secs(2024, 3, 31, 3, 30), 1711848600,
+              1711846800, 1);
+  check_local(helsinki, local_secs(2024, 10, 27, 3, 30), 1729989000,
+              1729992600, 0);
+  check_local(helsinki, local_secs(2024, 1, 15, 0, 0), 1705269600,
+              1705269600, 0);
+}
+
+int
+main(void)
+{
+  const char *helsinki = "Europe/Helsinki";
+
+  if (access("/usr/share/zoneinfo/Europe/Helsinki", R_OK) &&
+      !getenv("TZDIR"))
+  {
+    fprintf(stderr, "no tzdata, TZif checks skipped\n");
+    helsinki = NULL;
+  }
+
+  test_posix();
+  test_gap_fold(helsinki);
+
+  if (helsinki)
+  {
+    test_lookup(helsinki);
+    test_lookup("America/Sao_Paulo");
+    test_lookup("Australia/Lord_Howe");
+  }
+
+  return TEST_RESULT;
+}
@@ -15,8 +15,20 @@ else
     logger -t clockd restore did not find $FNAME
 fi
 
-logger -t clockd "Restarting clock daemon" 
-kill `pidof clockd`
+# clockd watches $FNAME, applies the restored settings itself and
+# removes restore_tz. If it does not (no inotify), restart it.
+if [ -f $FNAME ] && /bin/grep -q restore_tz $FNAME; then
+  WAIT=10
+  while [ $WAIT -gt 0 ] && /bin/grep -q restore_tz $FNAME; do
+    sleep 1
+    WAIT=`expr $WAIT - 1`
+  done
+
+  if /bin/grep -q restore_tz $FNAME && pidof clockd > /dev/null; then
+    logger -t clockd "Restarting clock daemon"
+    kill `pidof clockd`
+  fi
+fi
 
 exit 0
 